@@ -21,6 +21,7 @@
 #ifndef __ctpl_thread_pool_H__
 #define __ctpl_thread_pool_H__
 
+#include <algorithm>
 #include <functional>
 #include <thread>
 #include <atomic>
@@ -29,6 +30,10 @@
 #include <exception>
 #include <future>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "ctpl_arena.h"
+#include "ctpl_governor.h"
 #include <boost/lockfree/queue.hpp>
 
 
@@ -58,11 +63,25 @@ namespace ctpl {
         }
 
         // get the number of running threads in the pool
-        int size() { return static_cast<int>(this->threads.size()); }
+        // the threads are started on demand, see prewarm()
+        int size() { return this->nThreads; }
 
         // number of idle threads
         int n_idle() { return this->nWaiting; }
-        std::thread & get_thread(int i) { return *this->threads[i]; }
+
+        // number of threads started so far, at most size()
+        int n_started() { return this->nStarted; }
+
+        // starts the thread if it was not yet
+        std::thread & get_thread(int i) {
+            this->start_threads(i + 1);
+            return *this->threads[i];
+        }
+
+        // starts all the threads now instead of when the queue fills, for
+        // latency sensitive users
+        // 预先启动全部线程，避免首批任务等待线程创建
+        void prewarm() { this->start_threads(this->size()); }
 
         // change the number of threads in the pool
         // should be called from one thread, otherwise be careful to not interleave, also with this->stop()
@@ -71,46 +90,55 @@ namespace ctpl {
             if (!this->isStop && !this->isDone) {
                 int oldNThreads = static_cast<int>(this->threads.size());
                 if (oldNThreads <= nThreads) {  // if the number of threads is increased
+                    std::unique_lock<std::mutex> lock(this->startMutex);
                     this->threads.resize(nThreads);
                     this->flags.resize(nThreads);
 
                     for (int i = oldNThreads; i < nThreads; ++i) {
                         this->flags[i] = std::make_shared<std::atomic<bool>>(false);
-                        this->set_thread(i);
                     }
+                    this->nThreads = nThreads;  // started by push() as needed
                 }
                 else {  // the number of threads is decreased
-                    for (int i = oldNThreads - 1; i >= nThreads; --i) {
-                        *this->flags[i] = true;  // this thread will finish
-                        this->threads[i]->detach();
-                    }
                     {
-                        // stop the detached threads that were waiting
-                        std::unique_lock<std::mutex> lock(this->mutex);
-                        this->cv.notify_all();
+                        // no thread at an index >= nThreads can be started from here on
+                        std::unique_lock<std::mutex> lock(this->startMutex);
+                        this->nThreads = nThreads;
+                        if (this->nStarted > nThreads)
+                            this->nStarted = nThreads;
+                        for (int i = oldNThreads - 1; i >= nThreads; --i) {
+                            *this->flags[i] = true;  // this thread will finish
+                            if (this->threads[i])
+                                this->threads[i]->detach();
+                        }
+                        this->threads.resize(nThreads);  // safe to delete because the threads are detached
+                        this->flags.resize(nThreads);  // safe to delete because the threads have copies of shared_ptr of the flags, not originals
                     }
-                    this->threads.resize(nThreads);  // safe to delete because the threads are detached
-                    this->flags.resize(nThreads);  // safe to delete because the threads have copies of shared_ptr of the flags, not originals
+                    // stop the detached threads that were waiting
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    this->cv.notify_all();
                 }
             }
         }
 
         // empty the queue
         void clear_queue() {
-            std::function<void(int id)> * _f;
-            while (this->q.pop(_f))
-                delete _f;  // empty the queue
+            detail::task * _f;
+            while (this->pop_task(_f))
+                detail::task_deleter()(_f); // empty the queue
         }
 
         // pops a functional wraper to the original function
         std::function<void(int)> pop() {
-            std::function<void(int id)> * _f = nullptr;
-            this->q.pop(_f);
-            std::unique_ptr<std::function<void(int id)>> func(_f);  // at return, delete the function even if an exception occurred
-            
+            detail::task * _f = nullptr;
+            this->pop_task(_f);
             std::function<void(int)> f;
-            if (_f)
-                f = *_f;
+            if (_f) {
+                // the task may outlive the pool, its deleter keeps the arena
+                std::shared_ptr<detail::arena> a(this->taskArena);
+                std::shared_ptr<detail::task> t(_f, [a](detail::task * p) { detail::task_deleter()(p); });
+                f = [t](int id) { t->run(id); };
+            }
             return f;
         }
 
@@ -133,12 +161,16 @@ namespace ctpl {
                     return;
                 this->isDone = true;  // give the waiting threads a command to finish
             }
+            {
+                // no thread is started from now on
+                std::unique_lock<std::mutex> lock(this->startMutex);
+            }
             {
                 std::unique_lock<std::mutex> lock(this->mutex);
                 this->cv.notify_all();  // stop all waiting threads
             }
             for (int i = 0; i < static_cast<int>(this->threads.size()); ++i) {  // wait for the computing threads to finish
-                if (this->threads[i]->joinable())
+                if (this->threads[i] && this->threads[i]->joinable())
                     this->threads[i]->join();
             }
             // if there were no threads in the pool but some functors in the queue, the functors are not deleted by the threads
@@ -146,42 +178,69 @@ namespace ctpl {
             this->clear_queue();
             this->threads.clear();
             this->flags.clear();
+            this->nThreads = 0;
+            this->nStarted = 0;
         }
 
         template<typename F, typename... Rest>
         auto push(F && f, Rest&&... rest) ->std::future<decltype(f(0, rest...))> {
-            auto pck = std::make_shared<std::packaged_task<decltype(f(0, rest...))(int)>>(
+            return this->push_task<decltype(f(0, rest...))>(
                 std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...)
             );
-
-            auto _f = new std::function<void(int id)>([pck](int id) {
-                (*pck)(id);
-            });
-            this->q.push(_f);
-
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->cv.notify_one();
-
-            return pck->get_future();
         }
 
         // run the user's function that excepts argument int - id of the running thread. returned value is templatized
         // operator returns std::future, where the user can get the result and rethrow the catched exceptins
         template<typename F>
         auto push(F && f) ->std::future<decltype(f(0))> {
-            auto pck = std::make_shared<std::packaged_task<decltype(f(0))(int)>>(std::forward<F>(f));
+            return this->push_task<decltype(f(0))>(typename std::decay<F>::type(std::forward<F>(f)));
+        }
 
-            auto _f = new std::function<void(int id)>([pck](int id) {
-                (*pck)(id);
-            });
-            this->q.push(_f);
+        // run the user's function without a future: the callable is stored in
+        // the queue directly, no promise or shared state is created.
+        // an exception thrown by it is passed to the exception handler
+        template<typename F, typename... Rest>
+        void post(F && f, Rest&&... rest) {
+            this->post_task(std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...));
+        }
 
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->cv.notify_one();
+        template<typename F>
+        void post(F && f) {
+            this->post_task(typename std::decay<F>::type(std::forward<F>(f)));
+        }
 
-            return pck->get_future();
+        // runs one queued function on the calling thread, with 'id' as the
+        // thread index. returns false if the queue is empty
+        bool run_one(int id) {
+            detail::task * _f = nullptr;
+            if (!this->pop_task(_f))
+                return false;
+            std::unique_ptr<detail::task, detail::task_deleter> func(_f);  // at return, delete the function even if an exception occurred
+            try {
+                _f->run(id);
+            }
+            catch (...) {
+                this->handle_exception(std::current_exception());
+            }
+            return true;
+        }
+
+        // usage of the arena holding the queued tasks and the futures' shared states
+        detail::arena::stats arena_stats() { return this->taskArena->get_stats(); }
+
+        // handler of the exceptions thrown by posted functions, called on the
+        // worker thread. without a handler such an exception terminates the
+        // program, like any exception escaping a std::thread
+        void set_exception_handler(std::function<void(std::exception_ptr)> handler) {
+            std::unique_lock<std::mutex> lock(this->handlerMutex);
+            this->exceptionHandler = std::move(handler);
         }
 
+        // the threads run the functions while holding a token of 'governor',
+        // shared with other pools to not oversubscribe the cpu, see
+        // cpu_governor. nullptr, the default, for no limit
+        void set_governor(cpu_governor * governor) { this->governor = governor; }
+
 
     private:
 
@@ -191,27 +250,92 @@ namespace ctpl {
         thread_pool & operator=(const thread_pool &);// = delete;
         thread_pool & operator=(thread_pool &&);// = delete;
 
+        // the task and the shared state of its future come from the arena
+        template<typename R, typename Function>
+        std::future<R> push_task(Function && f) {
+            typedef detail::promise_task<Function, R> task_type;
+            task_type * _f = detail::create_task<task_type>(*this->taskArena, std::move(f), detail::arena_allocator<char>(this->taskArena));
+            std::future<R> future = _f->promise.get_future();
+            ++this->nQueued;
+            this->q.push(_f);
+            this->start_thread_if_busy();
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.notify_one();
+            return future;
+        }
+
+        template<typename Function>
+        void post_task(Function && f) {
+            detail::task * _f = detail::create_task<detail::posted_task<Function>>(*this->taskArena, std::move(f));
+            ++this->nQueued;
+            this->q.push(_f);
+            this->start_thread_if_busy();
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.notify_one();
+        }
+
+        bool pop_task(detail::task * & _f) {
+            if (!this->q.pop(_f))
+                return false;
+            --this->nQueued;
+            return true;
+        }
+
+        // starts one more thread while more tasks are queued than threads idle
+        void start_thread_if_busy() {
+            if (this->nStarted < this->nThreads && this->nQueued > this->nWaiting)
+                this->start_threads(this->nStarted + 1);
+        }
+
+        // starts the threads with index < n that are not running yet
+        void start_threads(int n) {
+            std::unique_lock<std::mutex> lock(this->startMutex);
+            if (this->isStop || this->isDone)
+                return;
+            n = std::min(n, static_cast<int>(this->threads.size()));
+            for (int i = this->nStarted; i < n; ++i)
+                this->set_thread(i);
+            if (this->nStarted < n)
+                this->nStarted = n;
+        }
+
         void set_thread(int i) {
             std::shared_ptr<std::atomic<bool>> flag(this->flags[i]);  // a copy of the shared ptr to the flag
             auto f = [this, i, flag/* a copy of the shared ptr to the flag */]() {
                 std::atomic<bool> & _flag = *flag;
-                std::function<void(int id)> * _f;
-                bool isPop = this->q.pop(_f);
+                detail::current_pool() = this;
+                detail::current_thread_id() = i;
+                detail::task * _f;
+                bool isPop = this->pop_task(_f);
                 while (true) {
                     while (isPop) {  // if there is anything in the queue
-                        std::unique_ptr<std::function<void(int id)>> func(_f);  // at return, delete the function even if an exception occurred
-                        (*_f)(i);
-
-                        if (_flag)
+                        std::unique_ptr<detail::task, detail::task_deleter> func(_f);  // at return, delete the function even if an exception occurred
+                        this->start_thread_if_busy();  // the queue fills faster than the threads empty it
+                        cpu_governor * governor = this->governor;
+                        if (governor)
+                            governor->acquire();  // kept from one function to the next
+                        try {
+                            _f->run(i);
+                        }
+                        catch (...) {  // only posted functions throw, pushed ones store the exception in their future
+                            this->handle_exception(std::current_exception());
+                        }
+
+                        if (governor)
+                            governor->yield();
+                        if (_flag) {
+                            release_token();
                             return;  // the thread is wanted to stop, return even if the queue is not empty yet
+                        }
                         else
-                            isPop = this->q.pop(_f);
+                            isPop = this->pop_task(_f);
                     }
 
                     // the queue is empty here, wait for the next command
+                    release_token();
                     std::unique_lock<std::mutex> lock(this->mutex);
                     ++this->nWaiting;
-                    this->cv.wait(lock, [this, &_f, &isPop, &_flag](){ isPop = this->q.pop(_f); return isPop || this->isDone || _flag; });
+                    this->cv.wait(lock, [this, &_f, &isPop, &_flag](){ isPop = this->pop_task(_f); return isPop || this->isDone || _flag; });
                     --this->nWaiting;
 
                     if (!isPop)
@@ -221,17 +345,188 @@ namespace ctpl {
             this->threads[i].reset(new std::thread(f));  // compiler may not support std::make_unique()
         }
 
-        void init() { this->nWaiting = 0; this->isStop = false; this->isDone = false; }
+        // the thread waits or exits, the token goes to the other threads
+        static void release_token() {
+            cpu_governor * governor = cpu_governor::current();
+            if (governor)
+                governor->release();
+        }
+
+        void handle_exception(std::exception_ptr e) {
+            std::function<void(std::exception_ptr)> handler;
+            {
+                std::unique_lock<std::mutex> lock(this->handlerMutex);
+                handler = this->exceptionHandler;
+            }
+            if (!handler)
+                std::rethrow_exception(e);
+            handler(e);
+        }
+
+        friend class task_group;
+
+        void init() { this->nWaiting = 0; this->isStop = false; this->isDone = false; this->nThreads = 0; this->nStarted = 0; this->nQueued = 0; this->governor = nullptr; this->taskArena = std::make_shared<detail::arena>(); }
 
         std::vector<std::unique_ptr<std::thread>> threads;
         std::vector<std::shared_ptr<std::atomic<bool>>> flags;
-        mutable boost::lockfree::queue<std::function<void(int id)> *> q;
+        mutable boost::lockfree::queue<detail::task *> q;
         std::atomic<bool> isDone;
         std::atomic<bool> isStop;
         std::atomic<int> nWaiting;  // how many threads are waiting
+        std::atomic<int> nThreads;  // size()
+        std::atomic<int> nStarted;  // threads [0, nStarted) are running
+        std::atomic<int> nQueued;  // tasks in the queue
+        std::atomic<cpu_governor *> governor;
+        std::mutex startMutex;  // guards threads and flags against the threads started by push()
 
         std::mutex mutex;
         std::condition_variable cv;
+
+        // shared with the futures, whose shared states may outlive the pool
+        std::shared_ptr<detail::arena> taskArena;
+
+        std::mutex handlerMutex;
+        std::function<void(std::exception_ptr)> exceptionHandler;
+    };
+
+    // fork-join on top of a thread_pool, for recursive divide and conquer:
+    //
+    //     void sum(int id, const int * a, int n, long & s) {
+    //         if (n < 1000) { s = std::accumulate(a, a + n, 0L); return; }
+    //         long left = 0, right = 0;
+    //         ctpl::task_group g(pool);
+    //         g.spawn(sum, a, n / 2, std::ref(left));
+    //         sum(id, a + n / 2, n - n / 2, right);
+    //         g.sync();
+    //         s = left + right;
+    //     }
+    //
+    // on a thread of the pool, sync() does not block its thread: while
+    // children are pending it runs them itself, the most recently spawned
+    // first, then other queued functions of the pool. the idle threads take
+    // the oldest children. a recursion deeper than the number of threads
+    // therefore can not deadlock. other threads, those of other pools
+    // included, just wait in sync()
+    class task_group {
+
+    public:
+
+        explicit task_group(thread_pool & pool)
+            : pool(pool), state(std::allocate_shared<state_type>(detail::arena_allocator<state_type>(pool.taskArena))) {}
+
+        // waits for the children, their exceptions are dropped
+        ~task_group() { this->wait(); }
+
+        // spawns f(id, rest...), id being the index of the thread running it
+        template<typename F, typename... Rest>
+        void spawn(F && f, Rest&&... rest) {
+            this->spawn_function(std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...));
+        }
+
+        template<typename F>
+        void spawn(F && f) {
+            this->spawn_function(std::function<void(int id)>(std::forward<F>(f)));
+        }
+
+        // waits for all spawned functions and rethrows the first exception
+        // thrown by one of them
+        void sync() {
+            this->wait();
+            std::exception_ptr e;
+            {
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                std::swap(e, this->state->exception);
+            }
+            if (e)
+                std::rethrow_exception(e);
+        }
+
+    private:
+
+        // deleted
+        task_group(const task_group &);// = delete;
+        task_group & operator=(const task_group &);// = delete;
+
+        // shared with the jobs posted to the pool, which may outlive the group
+        struct state_type {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<std::function<void(int id)>> children;  // not started yet
+            int nPending = 0;  // spawned and not finished
+            std::exception_ptr exception;
+        };
+
+        void spawn_function(std::function<void(int id)> f) {
+            {
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->children.push_back(std::move(f));
+                ++this->state->nPending;
+            }
+            // the job runs the oldest child, unless sync() already ran them all
+            std::shared_ptr<state_type> s(this->state);
+            this->pool.post([s](int id) { run_child(*s, id, false); });
+        }
+
+        static bool run_child(state_type & s, int id, bool newest) {
+            std::function<void(int id)> f;
+            {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                if (s.children.empty())
+                    return false;
+                if (newest) {
+                    f = std::move(s.children.back());
+                    s.children.pop_back();
+                }
+                else {
+                    f = std::move(s.children.front());
+                    s.children.pop_front();
+                }
+            }
+            try {
+                f(id);
+            }
+            catch (...) {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                if (!s.exception)
+                    s.exception = std::current_exception();
+            }
+            std::unique_lock<std::mutex> lock(s.mutex);
+            if (--s.nPending == 0)
+                s.cv.notify_all();
+            return true;
+        }
+
+        void wait() {
+            if (detail::current_pool() != &this->pool) {
+                // not a thread of the pool, maybe one of another pool: the
+                // children and the pool's functions get the id of the thread
+                // running them, leave them to the pool's threads
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->cv.wait(lock, [this](){ return this->state->nPending == 0; });
+                return;
+            }
+            int id = detail::current_thread_id();
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(this->state->mutex);
+                    if (this->state->nPending == 0)
+                        return;
+                }
+                if (run_child(*this->state, id, true))
+                    continue;
+                // the remaining children run on other threads, help the pool meanwhile
+                if (this->pool.run_one(id))
+                    continue;
+                // the last child to finish wakes this thread up
+                blocking_region blocking;  // sleeping, the token of the thread goes to others
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->cv.wait(lock, [this](){ return this->state->nPending == 0; });
+                return;
+            }
+        }
+
+        thread_pool & pool;
+        std::shared_ptr<state_type> state;
     };
 
 }
@@ -0,0 +1,250 @@
+#ifndef __ctpl_arena_H__
+#define __ctpl_arena_H__
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+
+
+// memory of the thread pools' tasks, shared by ctpl.h and ctpl_stl.h
+
+
+namespace ctpl {
+
+    namespace detail {
+
+        // index of the pool thread running the calling code, -1 outside of
+        // the pools
+        inline int & current_thread_id() {
+            static thread_local int id = -1;
+            return id;
+        }
+
+        // pool of the thread running the calling code, nullptr outside of the
+        // pools. current_thread_id() is an index into this pool only
+        inline const void *& current_pool() {
+            static thread_local const void * pool = nullptr;
+            return pool;
+        }
+
+        // size-class arena of a pool: the task nodes, the futures' shared
+        // states and the task groups' blocks are recycled through free lists
+        // instead of going through the global operator new for every push.
+        // the free lists are split in shards, one per pool thread (modulo
+        // nShards) plus one for the other threads, so that threads rarely
+        // contend on a shard's mutex. a block returns to the shard it came from
+        // 每个线程池的分级内存池，按线程分片以减少锁竞争
+        class arena {
+
+        public:
+
+            struct stats {
+                size_t allocations = 0;      // blocks handed out so far
+                size_t heapAllocations = 0;  // of these, the ones taken from operator new
+                size_t blocksInUse = 0;
+                size_t bytesReserved = 0;    // taken from operator new and not given back, in use or free
+            };
+
+            static const int nShards = 8;
+            static const int nSizeClasses = 5;  // 64, 128, ... 1024 bytes of payload
+            static const size_t minBlockSize = 64;
+
+            arena() {}
+
+            ~arena() {
+                for (int i = 0; i < nShards; ++i) {
+                    // threads detached by resize() may have returned blocks last
+                    std::unique_lock<std::mutex> lock(this->shards[i].mutex);
+                    for (int c = 0; c < nSizeClasses; ++c) {
+                        while (this->shards[i].freeBlocks[c]) {
+                            free_block * b = this->shards[i].freeBlocks[c];
+                            this->shards[i].freeBlocks[c] = b->next;
+                            ::operator delete(b);
+                        }
+                    }
+                }
+            }
+
+            // 'threadId' is the index of the calling pool thread, or -1
+            void * allocate(size_t size, int threadId) {
+                shard & s = this->shards[static_cast<unsigned>(threadId + 1) % nShards];
+                int sizeClass = size_class(size);
+                size_t blockSize = sizeClass < 0 ? sizeof(header) + size : sizeof(header) + (minBlockSize << sizeClass);
+                void * block = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(s.mutex);
+                    ++s.counters.allocations;
+                    ++s.counters.blocksInUse;
+                    if (sizeClass >= 0 && s.freeBlocks[sizeClass]) {
+                        free_block * b = s.freeBlocks[sizeClass];
+                        s.freeBlocks[sizeClass] = b->next;
+                        block = b;
+                    }
+                    else {
+                        ++s.counters.heapAllocations;
+                        s.counters.bytesReserved += blockSize;
+                    }
+                }
+                if (!block) {
+                    try {
+                        block = ::operator new(blockSize);
+                    }
+                    catch (...) {
+                        std::unique_lock<std::mutex> lock(s.mutex);
+                        --s.counters.blocksInUse;
+                        s.counters.bytesReserved -= blockSize;
+                        throw;
+                    }
+                }
+                header * h = static_cast<header *>(block);
+                h->owner = &s;
+                h->sizeClass = sizeClass;
+                h->blockSize = blockSize;
+                return h + 1;
+            }
+
+            // gives a block back to the shard it was allocated from, from any thread
+            static void deallocate(void * p) {
+                header * h = static_cast<header *>(p) - 1;
+                shard & s = *h->owner;
+                std::unique_lock<std::mutex> lock(s.mutex);
+                --s.counters.blocksInUse;
+                if (h->sizeClass < 0) {
+                    s.counters.bytesReserved -= h->blockSize;
+                    lock.unlock();
+                    ::operator delete(h);
+                    return;
+                }
+                free_block * b = reinterpret_cast<free_block *>(h);
+                b->next = s.freeBlocks[h->sizeClass];
+                s.freeBlocks[h->sizeClass] = b;
+            }
+
+            stats get_stats() {
+                stats total;
+                for (int i = 0; i < nShards; ++i) {
+                    std::unique_lock<std::mutex> lock(this->shards[i].mutex);
+                    total.allocations += this->shards[i].counters.allocations;
+                    total.heapAllocations += this->shards[i].counters.heapAllocations;
+                    total.blocksInUse += this->shards[i].counters.blocksInUse;
+                    total.bytesReserved += this->shards[i].counters.bytesReserved;
+                }
+                return total;
+            }
+
+        private:
+
+            // deleted
+            arena(const arena &);// = delete;
+            arena & operator=(const arena &);// = delete;
+
+            struct free_block {
+                free_block * next;
+            };
+
+            struct shard {
+                std::mutex mutex;
+                free_block * freeBlocks[nSizeClasses] = {};
+                stats counters;
+            };
+
+            // precedes every block, keeps the payload aligned for any type
+            struct alignas(std::max_align_t) header {
+                shard * owner;
+                int sizeClass;  // -1: not recycled
+                size_t blockSize;
+            };
+
+            static int size_class(size_t size) {
+                size_t blockSize = minBlockSize;
+                for (int c = 0; c < nSizeClasses; ++c, blockSize *= 2) {
+                    if (size <= blockSize)
+                        return c;
+                }
+                return -1;
+            }
+
+            shard shards[nShards];
+        };
+
+        // std allocator over an arena, the shared states of the futures keep
+        // the arena alive
+        template <typename T>
+        struct arena_allocator {
+            typedef T value_type;
+
+            explicit arena_allocator(const std::shared_ptr<arena> & a) : a(a) {}
+            template <typename U>
+            arena_allocator(const arena_allocator<U> & other) : a(other.a) {}
+
+            T * allocate(size_t n) {
+                return static_cast<T *>(this->a->allocate(n * sizeof(T), current_thread_id()));
+            }
+            void deallocate(T * p, size_t) { arena::deallocate(p); }
+
+            template <typename U>
+            bool operator==(const arena_allocator<U> & other) const { return this->a == other.a; }
+            template <typename U>
+            bool operator!=(const arena_allocator<U> & other) const { return this->a != other.a; }
+
+            std::shared_ptr<arena> a;
+        };
+
+        // a queued function, allocated in the pool's arena
+        struct task {
+            virtual void run(int id) = 0;
+            virtual ~task() {}
+        };
+
+        struct task_deleter {
+            void operator()(task * t) const {
+                t->~task();
+                arena::deallocate(t);
+            }
+        };
+
+        template <typename T, typename... Args>
+        T * create_task(arena & a, Args&&... args) {
+            void * p = a.allocate(sizeof(T), current_thread_id());
+            try {
+                return new (p) T(std::forward<Args>(args)...);
+            }
+            catch (...) {
+                arena::deallocate(p);
+                throw;
+            }
+        }
+
+        // a pushed function, its result or exception goes to the promise
+        template <typename F, typename R>
+        struct promise_task : task {
+            promise_task(F && f, const arena_allocator<char> & alloc)
+                : f(std::move(f)), promise(std::allocator_arg, alloc) {}
+            void run(int id) override {
+                try {
+                    set(this->promise, id);
+                }
+                catch (...) {
+                    this->promise.set_exception(std::current_exception());
+                }
+            }
+            template <typename T>
+            void set(std::promise<T> & p, int id) { p.set_value(this->f(id)); }
+            void set(std::promise<void> & p, int id) { this->f(id); p.set_value(); }
+
+            F f;
+            std::promise<R> promise;
+        };
+
+        // a posted function, its exceptions reach the pool's handler
+        template <typename F>
+        struct posted_task : task {
+            explicit posted_task(F && f) : f(std::move(f)) {}
+            void run(int id) override { this->f(id); }
+            F f;
+        };
+    }
+}
+
+#endif // __ctpl_arena_H__
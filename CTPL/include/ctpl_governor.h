@@ -0,0 +1,160 @@
+#ifndef __ctpl_governor_H__
+#define __ctpl_governor_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+
+// cpu tokens shared by thread pools, header only and without dependency on the
+// pools so that ctpl.h, ctpl_stl.h, ../../LThreadPool and ../../googleThreadPool
+// can all opt into the same process-wide governor
+
+
+namespace ctpl {
+
+    // a pool thread holds one of the governor's tokens while it runs tasks and
+    // gives it back before it waits for work, so that the busy threads of all
+    // the pools using a governor are at most its number of tokens. pools that
+    // each size themselves to the cores, one pushing into the other, then do
+    // not oversubscribe the cpu. the tokens are handed out in arrival order.
+    // a task that blocks, e.g. on a future of another pool, should do so in a
+    // blocking_region to give its token away meanwhile
+    // 进程级的 CPU 令牌，防止多个线程池叠加后线程数超过核数
+    class cpu_governor {
+
+    public:
+
+        explicit cpu_governor(int nTokens) : nTokens(std::max(nTokens, 1)) {}
+
+        // the process-wide governor, one token per hardware thread
+        static cpu_governor & global() {
+            static cpu_governor g(static_cast<int>(std::thread::hardware_concurrency()));
+            return g;
+        }
+
+        // the governor whose token the calling thread holds, or nullptr
+        static cpu_governor * current() { return held(); }
+
+        int size() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            return this->nTokens;
+        }
+
+        // number of tokens held
+        int n_active() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            return this->nActive;
+        }
+
+        // number of threads waiting for a token
+        int n_waiting() { return this->nWaiting; }
+
+        // nTokens must be >= 1. when shrinking, the extra tokens are taken back
+        // as their threads release them
+        void resize(int nTokens) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->nTokens = std::max(nTokens, 1);
+            this->cv.notify_all();
+        }
+
+        // blocks until the calling thread holds a token, does nothing if it
+        // already holds one. a token of another governor is released first
+        void acquire() {
+            cpu_governor * & h = held();
+            if (h == this)
+                return;
+            if (h)
+                h->release();
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (this->nActive >= this->nTokens || this->nWaiting > 0) {
+                uint64_t ticket = this->nextTicket++;
+                ++this->nWaiting;
+                this->cv.wait(lock, [this, ticket](){ return ticket == this->nowServing && this->nActive < this->nTokens; });
+                --this->nWaiting;
+                ++this->nowServing;
+                if (this->nWaiting > 0)
+                    this->cv.notify_all();  // the next ticket may have a token too
+            }
+            ++this->nActive;
+            h = this;
+        }
+
+        // gives back the calling thread's token, if it holds one of this governor
+        void release() {
+            cpu_governor * & h = held();
+            if (h != this)
+                return;
+            h = nullptr;
+            std::unique_lock<std::mutex> lock(this->mutex);
+            --this->nActive;
+            if (this->nWaiting > 0)
+                this->cv.notify_all();
+        }
+
+        // called between two tasks: if threads wait for a token, the calling
+        // thread gives its token to the first of them and waits for its turn
+        void yield() {
+            if (held() != this || this->nWaiting == 0)
+                return;
+            this->release();
+            this->acquire();
+        }
+
+    private:
+
+        // deleted
+        cpu_governor(const cpu_governor &);// = delete;
+        cpu_governor & operator=(const cpu_governor &);// = delete;
+
+        static cpu_governor * & held() {
+            static thread_local cpu_governor * g = nullptr;
+            return g;
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        int nTokens;
+        int nActive = 0;
+        std::atomic<int> nWaiting{0};  // read without locking by yield()
+        uint64_t nextTicket = 0;  // the waiting threads get their token in ticket order
+        uint64_t nowServing = 0;
+    };
+
+    // gives the calling thread's token back for the lifetime of the region and
+    // waits for one again at its end, around a call that blocks:
+    //
+    //     {
+    //         ctpl::blocking_region blocking;
+    //         result = future.get();
+    //     }
+    //
+    // does nothing on threads that hold no token
+    class blocking_region {
+
+    public:
+
+        blocking_region() : governor(cpu_governor::current()) {
+            if (this->governor)
+                this->governor->release();
+        }
+
+        ~blocking_region() {
+            if (this->governor)
+                this->governor->acquire();
+        }
+
+    private:
+
+        // deleted
+        blocking_region(const blocking_region &);// = delete;
+        blocking_region & operator=(const blocking_region &);// = delete;
+
+        cpu_governor * governor;
+    };
+}
+
+#endif // __ctpl_governor_H__
@@ -20,6 +20,7 @@
 #ifndef __ctpl_stl_thread_pool_H__
 #define __ctpl_stl_thread_pool_H__
 
+#include <algorithm>
 #include <functional>
 #include <thread>
 #include <atomic>
@@ -28,8 +29,11 @@
 #include <exception>
 #include <future>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "ctpl_arena.h"
+#include "ctpl_governor.h"
 #include <queue>
-#include <iostream>
 
 
 // thread pool to run user's functors with signature
@@ -81,11 +85,25 @@ namespace ctpl {
         }
 
         // get the number of running threads in the pool
-        int size() {     return static_cast<int>(this->threads.size()); }
+        // the threads are started on demand, see prewarm()
+        int size() { return this->nThreads; }
 
         // number of idle threads
         int n_idle() { return this->nWaiting; }
-        std::thread & get_thread(int i) { return *this->threads[i]; }
+
+        // number of threads started so far, at most size()
+        int n_started() { return this->nStarted; }
+
+        // starts the thread if it was not yet
+        std::thread & get_thread(int i) {
+            this->start_threads(i + 1);
+            return *this->threads[i];
+        }
+
+        // starts all the threads now instead of when the queue fills, for
+        // latency sensitive users
+        // 预先启动全部线程，避免首批任务等待线程创建
+        void prewarm() { this->start_threads(this->size()); }
 
         // change the number of threads in the pool
         // should be called from one thread, otherwise be careful to not interleave, also with this->stop()
@@ -100,51 +118,58 @@ namespace ctpl {
                 // 若新线程数 n_threads 大于当前的工作线程数 old_n_threads ，则将工作线程数组 threads_ 和线程标志数组 flags_ 的尺寸修改为新数目，
                 // 同时使用for循环调用 SetThread(i) 函数逐个重新创建工作线程；
                 if (oldNThreads <= nThreads) {  // if the number of threads is increased
+                    std::unique_lock<std::mutex> lock(this->startMutex);
                     this->threads.resize(nThreads);
                     this->flags.resize(nThreads);
 
                     for (int i = oldNThreads; i < nThreads; ++i) {
                         this->flags[i] = std::make_shared<std::atomic<bool>>(false);
-                        this->set_thread(i);
                     }
+                    this->nThreads = nThreads;  // started by push() as needed
                 }
                 
                 // 若新线程数 n_threads 小于当前的工作线程数 old_n_threads ，则将先完成 old_n_threads - n_threads 个线程正在执行的任务，
                 // 之后将工作线程数组 threads_ 和线程标志数组 flags_ 的尺寸修改为新数目。
                 else {  // the number of threads is decreased
-                    for (int i = oldNThreads - 1; i >= nThreads; --i) {
-                        *this->flags[i] = true;  // this thread will finish
-                        this->threads[i]->detach();
-                    }
                     {
-                        // stop the detached threads that were waiting
-                        std::unique_lock<std::mutex> lock(this->mutex);
-                        this->cv.notify_all();
+                        // no thread at an index >= nThreads can be started from here on
+                        std::unique_lock<std::mutex> lock(this->startMutex);
+                        this->nThreads = nThreads;
+                        if (this->nStarted > nThreads)
+                            this->nStarted = nThreads;
+                        for (int i = oldNThreads - 1; i >= nThreads; --i) {
+                            *this->flags[i] = true;  // this thread will finish
+                            if (this->threads[i])
+                                this->threads[i]->detach();
+                        }
+                        this->threads.resize(nThreads);  // safe to delete because the threads are detached
+                        this->flags.resize(nThreads);  // safe to delete because the threads have copies of shared_ptr of the flags, not originals
                     }
-                    this->threads.resize(nThreads);  // safe to delete because the threads are detached
-                    this->flags.resize(nThreads);  // safe to delete because the threads have copies of shared_ptr of the flags, not originals
+                    // stop the detached threads that were waiting
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    this->cv.notify_all();
                 }
             }
         }
 
         // empty the queue
         void clear_queue() {
-            std::function<void(int id)> * _f;
-            while (this->q.pop(_f))
-                delete _f; // empty the queue
+            detail::task * _f;
+            while (this->pop_task(_f))
+                detail::task_deleter()(_f); // empty the queue
         }
 
         // pops a functional wrapper to the original function
         std::function<void(int)> pop() {
-            std::function<void(int id)> * _f = nullptr;
-            this->q.pop(_f);
-
-            // 函数里使用一个小花招，即创建一个智能指针 func，当超出该对象的作用域时，
-            // 就会在其析构函数中调用delete运算符释放内存。如果任务队列q_中存储的是智能指针，就不必使用这种小花招来释放内存了。
-            std::unique_ptr<std::function<void(int id)>> func(_f); // at return, delete the function even if an exception occurred
+            detail::task * _f = nullptr;
+            this->pop_task(_f);
             std::function<void(int)> f;
-            if (_f)
-                f = *_f;
+            if (_f) {
+                // the task may outlive the pool, its deleter keeps the arena
+                std::shared_ptr<detail::arena> a(this->taskArena);
+                std::shared_ptr<detail::task> t(_f, [a](detail::task * p) { detail::task_deleter()(p); });
+                f = [t](int id) { t->run(id); };
+            }
             return f;
         }
 
@@ -167,12 +192,16 @@ namespace ctpl {
                     return;
                 this->isDone = true;  // give the waiting threads a command to finish
             }
+            {
+                // no thread is started from now on
+                std::unique_lock<std::mutex> lock(this->startMutex);
+            }
             {
                 std::unique_lock<std::mutex> lock(this->mutex);
                 this->cv.notify_all();  // stop all waiting threads
             }
             for (int i = 0; i < static_cast<int>(this->threads.size()); ++i) {  // wait for the computing threads to finish
-                    if (this->threads[i]->joinable())
+                    if (this->threads[i] && this->threads[i]->joinable())
                         this->threads[i]->join();
             }
             // if there were no threads in the pool but some functors in the queue, the functors are not deleted by the threads
@@ -180,51 +209,71 @@ namespace ctpl {
             this->clear_queue();
             this->threads.clear();
             this->flags.clear();
+            this->nThreads = 0;
+            this->nStarted = 0;
         }
 
         template<typename F, typename... Rest>
         auto push(F && f, Rest&&... rest) ->std::future<decltype(f(0, rest...))> {
-            // 因为任务函数f的声明各式各样(参数个数/返回值类型)……因此不能将其直接存储到任务队列 q，
-            // 于是先利用 std::bind 函数将其包装为一个异步操作任务 std::packaged_task<decltype(f(0, rest...))(int)> 对象 pck，
-            //（接受一个整型参数，返回值类型为(f(0, rest...)函数的返回值类型）。
-            // std::placeholders::_1 表示通过 std::bind 函数绑定后得到的异步任务对象接受的第一个参数是自由参数
-            auto pck = std::make_shared<std::packaged_task<decltype(f(0, rest...))(int)>>(
+            // 先利用 std::bind 将参数绑定到任务函数上，得到只接受线程 id 的函数对象
+            return this->push_task<decltype(f(0, rest...))>(
                 std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...)
             );
-            
-            // 利用Lambda表达式将 pck 包装为一个 std::function<void(int id)> 对象，这样就可以存储到任务队列 q 中了                
-            // 直接使用new运算符创建裸指针_f，后面还需想办法释放指针内存
-            auto _f = new std::function<void(int id)>([pck](int id) {
-                (*pck)(id);
-            });
-            this->q.push(_f);
-            std::unique_lock<std::mutex> lock(this->mutex);  // 对互斥量加锁
-
-            // 使用条件变量 std::condition_variable 对象 cv_.notify_one() 函数通知各个线程任务队列已经发生了改变，
-            // 让空闲线程赶紧从任务队列中拉取新任务执行；最后通过 pck->get_future() 返回一个 std::future 对象，以便调用者能从中取出函数执行完毕后的返回值。
-            this->cv.notify_one();
-            
-            // Push 函数的返回值为一个 std::future 对象，std::future 对象内存储的数据类型由f(0, rest...)函数的返回值类型确定;
-            // decltype(f(0, rest...))的作用就是获取 (f(0, rest...) 函数的返回值类型。
-            // std::future 提供一种异步操作结果的访问机制，从字面意思来理解，它表示未来，名字非常贴切，
-            // 因为一个异步操作的结果不可能马上获取，只能在未来某个时候得到。
-            return pck->get_future();
         }
 
         // run the user's function that excepts argument int - id of the running thread. returned value is templatized
         // operator returns std::future, where the user can get the result and rethrow the catched exceptins
         template<typename F>
-        auto push(F && f) ->std::future<decltype(f(0))> {            
-            auto pck = std::make_shared<std::packaged_task<decltype(f(0))(int)>>(std::forward<F>(f));
-            auto _f = new std::function<void(int id)>([pck](int id) {
-                (*pck)(id);
-            });
-            this->q.push(_f);
-            std::unique_lock<std::mutex> lock(this->mutex);
-            this->cv.notify_one();
-            return pck->get_future();
+        auto push(F && f) ->std::future<decltype(f(0))> {
+            return this->push_task<decltype(f(0))>(typename std::decay<F>::type(std::forward<F>(f)));
+        }
+
+        // run the user's function without a future: the callable is stored in
+        // the queue directly, no promise or shared state is created.
+        // an exception thrown by it is passed to the exception handler
+        // post 不创建 promise 和 future，适用于不关心返回值的任务
+        template<typename F, typename... Rest>
+        void post(F && f, Rest&&... rest) {
+            this->post_task(std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...));
+        }
+
+        template<typename F>
+        void post(F && f) {
+            this->post_task(typename std::decay<F>::type(std::forward<F>(f)));
+        }
+
+        // runs one queued function on the calling thread, with 'id' as the
+        // thread index. returns false if the queue is empty
+        bool run_one(int id) {
+            detail::task * _f = nullptr;
+            if (!this->pop_task(_f))
+                return false;
+            std::unique_ptr<detail::task, detail::task_deleter> func(_f);  // at return, delete the function even if an exception occurred
+            try {
+                _f->run(id);
+            }
+            catch (...) {
+                this->handle_exception(std::current_exception());
+            }
+            return true;
         }
 
+        // usage of the arena holding the queued tasks and the futures' shared states
+        detail::arena::stats arena_stats() { return this->taskArena->get_stats(); }
+
+        // handler of the exceptions thrown by posted functions, called on the
+        // worker thread. without a handler such an exception terminates the
+        // program, like any exception escaping a std::thread
+        void set_exception_handler(std::function<void(std::exception_ptr)> handler) {
+            std::unique_lock<std::mutex> lock(this->handlerMutex);
+            this->exceptionHandler = std::move(handler);
+        }
+
+        // the threads run the functions while holding a token of 'governor',
+        // shared with other pools to not oversubscribe the cpu, see
+        // cpu_governor. nullptr, the default, for no limit
+        void set_governor(cpu_governor * governor) { this->governor = governor; }
+
 
     private:
 
@@ -234,31 +283,92 @@ namespace ctpl {
         thread_pool & operator=(const thread_pool &);// = delete;
         thread_pool & operator=(thread_pool &&);// = delete;
 
+        // the task and the shared state of its future come from the arena
+        template<typename R, typename Function>
+        std::future<R> push_task(Function && f) {
+            typedef detail::promise_task<Function, R> task_type;
+            task_type * _f = detail::create_task<task_type>(*this->taskArena, std::move(f), detail::arena_allocator<char>(this->taskArena));
+            std::future<R> future = _f->promise.get_future();
+            ++this->nQueued;
+            this->q.push(_f);
+            this->start_thread_if_busy();
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.notify_one();
+            return future;
+        }
+
+        template<typename Function>
+        void post_task(Function && f) {
+            detail::task * _f = detail::create_task<detail::posted_task<Function>>(*this->taskArena, std::move(f));
+            ++this->nQueued;
+            this->q.push(_f);
+            this->start_thread_if_busy();
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.notify_one();
+        }
+
+        bool pop_task(detail::task * & _f) {
+            if (!this->q.pop(_f))
+                return false;
+            --this->nQueued;
+            return true;
+        }
+
+        // starts one more thread while more tasks are queued than threads idle
+        void start_thread_if_busy() {
+            if (this->nStarted < this->nThreads && this->nQueued > this->nWaiting)
+                this->start_threads(this->nStarted + 1);
+        }
+
+        // starts the threads with index < n that are not running yet
+        void start_threads(int n) {
+            std::unique_lock<std::mutex> lock(this->startMutex);
+            if (this->isStop || this->isDone)
+                return;
+            n = std::min(n, static_cast<int>(this->threads.size()));
+            for (int i = this->nStarted; i < n; ++i)
+                this->set_thread(i);
+            if (this->nStarted < n)
+                this->nStarted = n;
+        }
+
         // SetThread 函数的作用重新创建指定序号i的工作线程
         void set_thread(int i) {
-            std::cout << "------------------------- set_thread(" << i << ") -------------------------" << std::endl;
-            std::cout << "flag = " << *this->flags[i] << std::endl;
-
             // 使用 flags[i] 来初始化标志变量 flag
             std::shared_ptr<std::atomic<bool>> flag(this->flags[i]); // a copy of the shared ptr to the flag
             
             // 创建一个 Lambda 表达式变量 f --> 将之作为第i个线程的任务，该任务保存有创建时的{1.this(主线程创建的线程池对象); 2.i(任务id); 3.flag(标记变量)}
             auto f = [this, i, flag/* a copy of the shared ptr to the flag */]() {
                 std::atomic<bool> & _flag = *flag;
-                std::function<void(int id)> * _f;
-                bool isPop = this->q.pop(_f);
+                detail::current_pool() = this;
+                detail::current_thread_id() = i;
+                detail::task * _f;
+                bool isPop = this->pop_task(_f);
                 while (true) {
                     while (isPop) {  // if there is anything in the queue
                         // 如果任务队列 q 中存储的是智能指针，就不必使用这种小花招来释放内存了。
-                        std::unique_ptr<std::function<void(int id)>> func(_f); // at return, delete the function even if an exception occurred
-                        (*_f)(i);  // 执行任务函数
-                        std::cout << "------------------------- (*_f)(" << i << ") -------------------------" << std::endl;
-                        if (_flag)
+                        std::unique_ptr<detail::task, detail::task_deleter> func(_f); // at return, delete the function even if an exception occurred
+                        this->start_thread_if_busy();  // the queue fills faster than the threads empty it
+                        cpu_governor * governor = this->governor;
+                        if (governor)
+                            governor->acquire();  // kept from one function to the next
+                        try {
+                            _f->run(i);  // 执行任务函数
+                        }
+                        catch (...) {  // only posted functions throw, pushed ones store the exception in their future
+                            this->handle_exception(std::current_exception());
+                        }
+                        if (governor)
+                            governor->yield();
+                        if (_flag) {
+                            release_token();
                             return;  // the thread is wanted to stop, return even if the queue is not empty yet
+                        }
                         else
-                            isPop = this->q.pop(_f);
+                            isPop = this->pop_task(_f);
                     }
                     // the queue is empty here, wait for the next command
+                    release_token();
                     // 这里必须使用 std::unique_lock ，因为后面条件变量 cv 等待期间，需要解锁。
                     std::unique_lock<std::mutex> lock(this->mutex);
                     ++this->nWaiting;
@@ -267,7 +377,7 @@ namespace ctpl {
                     // 那么Lambda表达式变量f何时启动呢？当任务队列 q.pop(_f) 的返回值为 true 时，表明从任务队列 q 中取到了一个新任务，
                     // 于是调用 (*_f)(i); 执行之，如果当前任务队列没有任务，则使用下面的 this->cv.wait(...) 来等待新任务的到来，
                     // 在新任务到来之前，当前工作线程处于休眠状态。
-                    this->cv.wait(lock, [this, &_f, &isPop, &_flag](){ isPop = this->q.pop(_f); return isPop || this->isDone || _flag; });
+                    this->cv.wait(lock, [this, &_f, &isPop, &_flag](){ isPop = this->pop_task(_f); return isPop || this->isDone || _flag; });
                     --this->nWaiting;
                     if (!isPop)
                         return;  // if the queue is empty and this->isDone == true or *flag then return
@@ -278,17 +388,188 @@ namespace ctpl {
             this->threads[i].reset(new std::thread(f)); // compiler may not support std::make_unique()
         }
 
-        void init() { this->nWaiting = 0; this->isStop = false; this->isDone = false; }
+        // the thread waits or exits, the token goes to the other threads
+        static void release_token() {
+            cpu_governor * governor = cpu_governor::current();
+            if (governor)
+                governor->release();
+        }
+
+        void handle_exception(std::exception_ptr e) {
+            std::function<void(std::exception_ptr)> handler;
+            {
+                std::unique_lock<std::mutex> lock(this->handlerMutex);
+                handler = this->exceptionHandler;
+            }
+            if (!handler)
+                std::rethrow_exception(e);
+            handler(e);
+        }
+
+        friend class task_group;
+
+        void init() { this->nWaiting = 0; this->isStop = false; this->isDone = false; this->nThreads = 0; this->nStarted = 0; this->nQueued = 0; this->governor = nullptr; this->taskArena = std::make_shared<detail::arena>(); }
 
         std::vector<std::unique_ptr<std::thread>> threads;
         std::vector<std::shared_ptr<std::atomic<bool>>> flags;
-        detail::Queue<std::function<void(int id)> *> q;
+        detail::Queue<detail::task *> q;
         std::atomic<bool> isDone;
         std::atomic<bool> isStop;
         std::atomic<int> nWaiting;  // how many threads are waiting
+        std::atomic<int> nThreads;  // size()
+        std::atomic<int> nStarted;  // threads [0, nStarted) are running
+        std::atomic<int> nQueued;  // tasks in the queue
+        std::atomic<cpu_governor *> governor;
+        std::mutex startMutex;  // guards threads and flags against the threads started by push()
 
         std::mutex mutex;
         std::condition_variable cv;
+
+        // shared with the futures, whose shared states may outlive the pool
+        std::shared_ptr<detail::arena> taskArena;
+
+        std::mutex handlerMutex;
+        std::function<void(std::exception_ptr)> exceptionHandler;
+    };
+
+    // fork-join on top of a thread_pool, for recursive divide and conquer:
+    //
+    //     void sum(int id, const int * a, int n, long & s) {
+    //         if (n < 1000) { s = std::accumulate(a, a + n, 0L); return; }
+    //         long left = 0, right = 0;
+    //         ctpl::task_group g(pool);
+    //         g.spawn(sum, a, n / 2, std::ref(left));
+    //         sum(id, a + n / 2, n - n / 2, right);
+    //         g.sync();
+    //         s = left + right;
+    //     }
+    //
+    // on a thread of the pool, sync() does not block its thread: while
+    // children are pending it runs them itself, the most recently spawned
+    // first, then other queued functions of the pool. the idle threads take
+    // the oldest children. a recursion deeper than the number of threads
+    // therefore can not deadlock. other threads, those of other pools
+    // included, just wait in sync()
+    class task_group {
+
+    public:
+
+        explicit task_group(thread_pool & pool)
+            : pool(pool), state(std::allocate_shared<state_type>(detail::arena_allocator<state_type>(pool.taskArena))) {}
+
+        // waits for the children, their exceptions are dropped
+        ~task_group() { this->wait(); }
+
+        // spawns f(id, rest...), id being the index of the thread running it
+        template<typename F, typename... Rest>
+        void spawn(F && f, Rest&&... rest) {
+            this->spawn_function(std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Rest>(rest)...));
+        }
+
+        template<typename F>
+        void spawn(F && f) {
+            this->spawn_function(std::function<void(int id)>(std::forward<F>(f)));
+        }
+
+        // waits for all spawned functions and rethrows the first exception
+        // thrown by one of them
+        void sync() {
+            this->wait();
+            std::exception_ptr e;
+            {
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                std::swap(e, this->state->exception);
+            }
+            if (e)
+                std::rethrow_exception(e);
+        }
+
+    private:
+
+        // deleted
+        task_group(const task_group &);// = delete;
+        task_group & operator=(const task_group &);// = delete;
+
+        // shared with the jobs posted to the pool, which may outlive the group
+        struct state_type {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<std::function<void(int id)>> children;  // not started yet
+            int nPending = 0;  // spawned and not finished
+            std::exception_ptr exception;
+        };
+
+        void spawn_function(std::function<void(int id)> f) {
+            {
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->children.push_back(std::move(f));
+                ++this->state->nPending;
+            }
+            // the job runs the oldest child, unless sync() already ran them all
+            std::shared_ptr<state_type> s(this->state);
+            this->pool.post([s](int id) { run_child(*s, id, false); });
+        }
+
+        static bool run_child(state_type & s, int id, bool newest) {
+            std::function<void(int id)> f;
+            {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                if (s.children.empty())
+                    return false;
+                if (newest) {
+                    f = std::move(s.children.back());
+                    s.children.pop_back();
+                }
+                else {
+                    f = std::move(s.children.front());
+                    s.children.pop_front();
+                }
+            }
+            try {
+                f(id);
+            }
+            catch (...) {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                if (!s.exception)
+                    s.exception = std::current_exception();
+            }
+            std::unique_lock<std::mutex> lock(s.mutex);
+            if (--s.nPending == 0)
+                s.cv.notify_all();
+            return true;
+        }
+
+        void wait() {
+            if (detail::current_pool() != &this->pool) {
+                // not a thread of the pool, maybe one of another pool: the
+                // children and the pool's functions get the id of the thread
+                // running them, leave them to the pool's threads
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->cv.wait(lock, [this](){ return this->state->nPending == 0; });
+                return;
+            }
+            int id = detail::current_thread_id();
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(this->state->mutex);
+                    if (this->state->nPending == 0)
+                        return;
+                }
+                if (run_child(*this->state, id, true))
+                    continue;
+                // the remaining children run on other threads, help the pool meanwhile
+                if (this->pool.run_one(id))
+                    continue;
+                // the last child to finish wakes this thread up
+                blocking_region blocking;  // sleeping, the token of the thread goes to others
+                std::unique_lock<std::mutex> lock(this->state->mutex);
+                this->state->cv.wait(lock, [this](){ return this->state->nPending == 0; });
+                return;
+            }
+        }
+
+        thread_pool & pool;
+        std::shared_ptr<state_type> state;
     };
 }
 
@@ -0,0 +1,310 @@
+#include "ctpl_stl.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+void add(int id, std::atomic<int>* sum, int value) {
+  // id is unused.
+  *sum += value;
+}
+
+TEST(thread_pool, post_runs_functions) {
+  std::atomic<int> sum(0);
+  {
+    ctpl::thread_pool p(2);
+    for (int i = 1; i <= 100; ++i) {
+      p.post(add, &sum, i);
+      p.post([&sum](int) { ++sum; });
+    }
+    // the destructor runs the queued functions
+  }
+  EXPECT_EQ(5050 + 100, sum.load());
+}
+
+TEST(thread_pool, post_passes_exceptions_to_handler) {
+  std::atomic<int> num_exceptions(0);
+  std::atomic<int> num_runs(0);
+  {
+    ctpl::thread_pool p(2);
+    p.set_exception_handler([&num_exceptions](std::exception_ptr e) {
+      try {
+        std::rethrow_exception(e);
+      } catch (const std::runtime_error& error) {
+        EXPECT_EQ(std::string("posted"), error.what());
+        ++num_exceptions;
+      }
+    });
+    for (int i = 0; i < 10; ++i) {
+      p.post([](int) { throw std::runtime_error("posted"); });
+      p.post([&num_runs](int) { ++num_runs; });
+    }
+    // pushed functions keep their exception in the future
+    std::future<void> future =
+        p.push([](int) { throw std::runtime_error("pushed"); });
+    EXPECT_THROW(future.get(), std::runtime_error);
+  }
+  EXPECT_EQ(10, num_exceptions.load());
+  EXPECT_EQ(10, num_runs.load());
+}
+
+int sum(int id, const std::vector<int>& values, size_t begin, size_t end,
+        ctpl::thread_pool* pool, std::vector<int>* ids) {
+  (*ids)[begin] = id;
+  if (end - begin == 1) {
+    return values[begin];
+  }
+  const size_t middle = begin + (end - begin) / 2;
+  int left = 0;
+  ctpl::task_group g(*pool);
+  g.spawn([&](int child_id) {
+    left = sum(child_id, values, begin, middle, pool, ids);
+  });
+  const int right = sum(id, values, middle, end, pool, ids);
+  g.sync();
+  return left + right;
+}
+
+TEST(task_group, sync_on_a_pool_thread) {
+  ctpl::thread_pool p(2);
+  std::vector<int> values(100, 1);
+  std::vector<int> ids(values.size(), -2);
+  // deeper than the number of threads
+  EXPECT_EQ(100, p.push(sum, std::cref(values), 0, values.size(), &p, &ids).get());
+  for (int id : ids) {
+    EXPECT_GE(id, 0);
+    EXPECT_LT(id, 2);
+  }
+}
+
+TEST(task_group, sync_outside_the_pool_runs_nothing_itself) {
+  ctpl::thread_pool p(2);
+  std::atomic<int> num_runs(0);
+  std::atomic<bool> bad_id(false);
+  ctpl::task_group g(p);
+  for (int i = 0; i < 100; ++i) {
+    g.spawn([&num_runs, &bad_id](int id) {
+      if (id < 0 || id >= 2) {
+        bad_id = true;
+      }
+      ++num_runs;
+    });
+  }
+  g.sync();
+  EXPECT_EQ(100, num_runs.load());
+  EXPECT_FALSE(bad_id);
+
+  g.spawn([](int) { throw std::runtime_error("child"); });
+  EXPECT_THROW(g.sync(), std::runtime_error);
+}
+
+TEST(task_group, sync_on_a_thread_of_another_pool) {
+  ctpl::thread_pool other(3);
+  ctpl::thread_pool p(1);
+  std::atomic<int> num_running(0);
+  std::atomic<int> num_runs(0);
+  std::atomic<bool> bad_id(false);
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < 3; ++i) {
+    futures.push_back(other.push([&](int) {
+      // every thread of 'other' syncs, also those whose index 'p' does not have
+      ++num_running;
+      const auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (num_running < 3 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+      ctpl::task_group g(p);
+      for (int j = 0; j < 10; ++j) {
+        g.spawn([&num_runs, &bad_id](int id) {
+          if (id != 0) {
+            bad_id = true;
+          }
+          ++num_runs;
+        });
+      }
+      g.sync();
+    }));
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+  EXPECT_EQ(30, num_runs.load());
+  EXPECT_FALSE(bad_id);
+}
+
+TEST(arena, recycles_blocks) {
+  ctpl::detail::arena a;
+  void* block = a.allocate(100, 0);
+  ctpl::detail::arena::deallocate(block);
+  EXPECT_EQ(block, a.allocate(128, 0));
+  ctpl::detail::arena::deallocate(block);
+  // too large for the size classes
+  ctpl::detail::arena::deallocate(a.allocate(4000, 0));
+  ctpl::detail::arena::stats stats = a.get_stats();
+  EXPECT_EQ(3u, stats.allocations);
+  EXPECT_EQ(2u, stats.heapAllocations);
+  EXPECT_EQ(0u, stats.blocksInUse);
+}
+
+TEST(arena, pushed_tasks_reuse_blocks) {
+  ctpl::thread_pool p(1);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i, p.push([i](int) { return i; }).get());
+    p.post([](int) {});
+  }
+  p.stop(true);
+  ctpl::detail::arena::stats stats = p.arena_stats();
+  EXPECT_GE(stats.allocations, 3000u);  // task, shared state, posted task
+  EXPECT_LT(stats.heapAllocations, 100u);
+  EXPECT_EQ(0u, stats.blocksInUse);
+}
+
+TEST(thread_pool, starts_threads_on_demand) {
+  ctpl::thread_pool p(4);
+  EXPECT_EQ(4, p.size());
+  EXPECT_EQ(0, p.n_started());
+  EXPECT_EQ(1, p.push([](int) { return 1; }).get());
+  EXPECT_GE(p.n_started(), 1);
+
+  // the four functions only return once all of them run together
+  std::atomic<int> num_running(0);
+  std::vector<std::future<bool>> futures;
+  for (int i = 0; i < 4; ++i) {
+    futures.push_back(p.push([&num_running](int) {
+      ++num_running;
+      const auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (num_running < 4 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+      return num_running >= 4;
+    }));
+  }
+  for (auto& future : futures) {
+    EXPECT_TRUE(future.get());
+  }
+  EXPECT_EQ(4, p.n_started());
+}
+
+TEST(thread_pool, prewarm_starts_all_threads) {
+  ctpl::thread_pool p(3);
+  p.get_thread(1);
+  EXPECT_EQ(2, p.n_started());
+  p.prewarm();
+  EXPECT_EQ(3, p.n_started());
+  p.resize(5);
+  EXPECT_EQ(5, p.size());
+  EXPECT_EQ(3, p.n_started());
+}
+
+TEST(thread_pool, resize_while_pushing) {
+  std::atomic<int> sum(0);
+  {
+    ctpl::thread_pool p(4);
+    std::atomic<bool> done(false);
+    // started threads and shrinking race, the pushes start threads
+    std::thread resizer([&p, &done]() {
+      while (!done) {
+        p.resize(1);
+        p.resize(4);
+      }
+    });
+    for (int i = 0; i < 20000; ++i) {
+      p.post(add, &sum, 1);
+    }
+    done = true;
+    resizer.join();
+  }
+  EXPECT_EQ(20000, sum.load());
+}
+
+// waits until 'governor' has 'n' threads waiting for a token
+void wait_for_waiting(ctpl::cpu_governor& governor, int n) {
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (governor.n_waiting() < n && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ(n, governor.n_waiting());
+}
+
+TEST(cpu_governor, bounds_the_threads_running_tasks) {
+  ctpl::cpu_governor governor(1);
+  std::atomic<int> num_running(0);
+  std::atomic<int> max_running(0);
+  {
+    ctpl::thread_pool p(3);
+    p.set_governor(&governor);
+    p.prewarm();
+    for (int i = 0; i < 30; ++i) {
+      p.post([&num_running, &max_running](int) {
+        const int running = ++num_running;
+        int max = max_running;
+        while (running > max && !max_running.compare_exchange_weak(max, running)) {
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        --num_running;
+      });
+    }
+  }
+  EXPECT_EQ(1, max_running.load());
+  EXPECT_EQ(0, governor.n_active());
+}
+
+TEST(cpu_governor, hands_out_tokens_in_arrival_order) {
+  ctpl::cpu_governor governor(1);
+  governor.acquire();
+  governor.acquire();  // already held
+  EXPECT_EQ(1, governor.n_active());
+  std::mutex mutex;
+  std::vector<int> order;
+  const auto take = [&governor, &mutex, &order](int number) {
+    governor.acquire();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      order.push_back(number);
+    }
+    governor.release();
+  };
+  std::thread first(take, 1);
+  wait_for_waiting(governor, 1);
+  std::thread second(take, 2);
+  wait_for_waiting(governor, 2);
+  governor.release();
+  first.join();
+  second.join();
+  EXPECT_EQ(std::vector<int>({1, 2}), order);
+  EXPECT_EQ(0, governor.n_active());
+}
+
+TEST(cpu_governor, blocking_region_lends_the_token) {
+  ctpl::cpu_governor governor(1);
+  governor.acquire();
+  {
+    ctpl::blocking_region blocking;
+    EXPECT_EQ(nullptr, ctpl::cpu_governor::current());
+    // another thread can run meanwhile
+    std::thread other([&governor]() {
+      governor.acquire();
+      governor.release();
+    });
+    other.join();
+  }
+  EXPECT_EQ(&governor, ctpl::cpu_governor::current());
+
+  // a token of another governor is given back first
+  ctpl::cpu_governor other_governor(1);
+  other_governor.acquire();
+  EXPECT_EQ(0, governor.n_active());
+  other_governor.release();
+  EXPECT_EQ(nullptr, ctpl::cpu_governor::current());
+}
+
+}  // namespace
@@ -20,6 +20,9 @@
 #ifndef __ctpl_thread_pool_H__
 #define __ctpl_thread_pool_H__
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
 #include <functional>
 #include <thread>
 #include <atomic>
@@ -28,8 +31,10 @@
 #include <exception>
 #include <future>
 #include <mutex>
-#include <queue>
+#include <new>
+#include <type_traits>
 
+#include "ctpl_governor.h"  // ../CTPL/include, shared with the other pools
 
 
 // thread pool to run user's functors with signature
@@ -41,33 +46,310 @@
 namespace ctpl {
 
   namespace detail {
+      // Recycles the memory of task nodes and of their futures' shared states.
+      // Every thread keeps a free list per size class; blocks freed by worker
+      // threads flow back to pushing threads in batches of kBatchSize through
+      // a global depot, so steady-state Push()/execute does not allocate and
+      // only takes the depot lock once per batch.
+      class NodeAllocator {
+      public:
+          static constexpr size_t kMinBlockSize = 64;
+          static constexpr int kNumSizeClasses = 5;  // 64, 128, ... 1024 bytes
+          static constexpr size_t kBatchSize = 32;
+
+          static void *Allocate(size_t size) {
+              const int size_class = SizeClass(size);
+              if (size_class < 0) {
+                  return ::operator new(size);
+              }
+              Cache &cache = LocalCache();
+              if (cache.head[size_class] == nullptr) {
+                  cache.head[size_class] = GetDepot().TakeBatch(size_class);
+                  cache.count[size_class] = kBatchSize;
+                  if (cache.head[size_class] == nullptr) {
+                      cache.count[size_class] = 0;
+                      return ::operator new(BlockSize(size_class));
+                  }
+              }
+              FreeBlock *block = cache.head[size_class];
+              cache.head[size_class] = block->next;
+              if (cache.count[size_class] > 0) {
+                  --cache.count[size_class];
+              }
+              return block;
+          }
+
+          static void Free(void *pointer, size_t size) {
+              const int size_class = SizeClass(size);
+              if (size_class < 0) {
+                  ::operator delete(pointer);
+                  return;
+              }
+              Cache &cache = LocalCache();
+              FreeBlock *block = static_cast<FreeBlock *>(pointer);
+              block->next = cache.head[size_class];
+              cache.head[size_class] = block;
+              if (++cache.count[size_class] >= 2 * kBatchSize) {
+                  // Keep one batch, hand one to the depot.
+                  FreeBlock *batch = cache.head[size_class];
+                  FreeBlock *last = batch;
+                  for (size_t i = 1; i < kBatchSize; ++i) {
+                      last = last->next;
+                  }
+                  cache.head[size_class] = last->next;
+                  last->next = nullptr;
+                  cache.count[size_class] -= kBatchSize;
+                  GetDepot().PutBatch(size_class, batch);
+              }
+          }
+
+      private:
+          struct FreeBlock {
+              FreeBlock *next;
+          };
+
+          static int SizeClass(size_t size) {
+              size_t block_size = kMinBlockSize;
+              for (int size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+                  if (size <= block_size) {
+                      return size_class;
+                  }
+                  block_size *= 2;
+              }
+              return -1;
+          }
+
+          static size_t BlockSize(int size_class) { return kMinBlockSize << size_class; }
+
+          // Batches of free blocks shared by all threads.
+          class Depot {
+          public:
+              FreeBlock *TakeBatch(int size_class) {
+                  std::unique_lock<std::mutex> lock(this->mutex);
+                  if (this->batches[size_class].empty()) {
+                      return nullptr;
+                  }
+                  FreeBlock *batch = this->batches[size_class].back();
+                  this->batches[size_class].pop_back();
+                  return batch;
+              }
+              void PutBatch(int size_class, FreeBlock *batch) {
+                  std::unique_lock<std::mutex> lock(this->mutex);
+                  this->batches[size_class].push_back(batch);
+              }
+          private:
+              std::mutex mutex;
+              std::vector<FreeBlock *> batches[kNumSizeClasses];
+          };
+
+          // Never destroyed: threads may return their blocks at any time,
+          // even during static destruction.
+          static Depot &GetDepot() {
+              static Depot *depot = new Depot();
+              return *depot;
+          }
+
+          struct Cache {
+              FreeBlock *head[kNumSizeClasses] = {};
+              size_t count[kNumSizeClasses] = {};
+              ~Cache() {
+                  // The thread exits, its blocks go to the depot as one
+                  // (possibly short) batch per size class.
+                  for (int size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+                      if (this->head[size_class] != nullptr) {
+                          GetDepot().PutBatch(size_class, this->head[size_class]);
+                      }
+                  }
+              }
+          };
+
+          static Cache &LocalCache() {
+              static thread_local Cache cache;
+              return cache;
+          }
+      };
+
+      // std::allocator interface of NodeAllocator, for the promises' shared
+      // states.
       template <typename T>
-      class Queue {
+      struct NodeStdAllocator {
+          using value_type = T;
+          NodeStdAllocator() = default;
+          template <typename U>
+          NodeStdAllocator(const NodeStdAllocator<U> &) {}
+          T *allocate(size_t n) {
+              return static_cast<T *>(NodeAllocator::Allocate(n * sizeof(T)));
+          }
+          void deallocate(T *pointer, size_t n) {
+              NodeAllocator::Free(pointer, n * sizeof(T));
+          }
+          template <typename U>
+          bool operator==(const NodeStdAllocator<U> &) const { return true; }
+          template <typename U>
+          bool operator!=(const NodeStdAllocator<U> &) const { return false; }
+      };
+
+      // A queued task. The node owns the user's function and its promise and
+      // is owned by exactly one place at a time: the queue, a worker or the
+      // function returned by Pop().
+      struct TaskNode {
+          TaskNode *next = nullptr;
+          // Runs the function if 'execute', then destroys and frees the node.
+          void (*finish)(TaskNode *node, int id, bool execute);
+
+          void Run(int id) { this->finish(this, id, true); }
+          // The future reports std::future_errc::broken_promise.
+          void Discard() { this->finish(this, 0, false); }
+      };
+
+      template <typename R>
+      struct PromiseSetter {
+          template <typename F>
+          static void Set(std::promise<R> &promise, F &function, int id) {
+              promise.set_value(function(id));
+          }
+      };
+
+      template <>
+      struct PromiseSetter<void> {
+          template <typename F>
+          static void Set(std::promise<void> &promise, F &function, int id) {
+              function(id);
+              promise.set_value();
+          }
+      };
+
+      template <typename F, typename R>
+      struct FunctionTaskNode : TaskNode {
+          explicit FunctionTaskNode(F &&f)
+              : function(std::move(f)),
+                promise(std::allocator_arg, NodeStdAllocator<char>()) {
+              this->finish = &FunctionTaskNode::Finish;
+          }
+
+          static FunctionTaskNode *Create(F &&f) {
+              static_assert(alignof(FunctionTaskNode) <= alignof(std::max_align_t),
+                            "over-aligned functions are not supported");
+              void *memory = NodeAllocator::Allocate(sizeof(FunctionTaskNode));
+              return new (memory) FunctionTaskNode(std::move(f));
+          }
+
+          static void Finish(TaskNode *base, int id, bool execute) {
+              FunctionTaskNode *node = static_cast<FunctionTaskNode *>(base);
+              if (execute) {
+                  try {
+                      PromiseSetter<R>::Set(node->promise, node->function, id);
+                  } catch (...) {
+                      node->promise.set_exception(std::current_exception());
+                  }
+              }
+              node->~FunctionTaskNode();
+              NodeAllocator::Free(node, sizeof(FunctionTaskNode));
+          }
+
+          F function;
+          std::promise<R> promise;
+      };
+
+      // FIFO of task nodes linked through TaskNode::next.
+      class TaskQueue {
       public:
-          bool push(T const & value) {
+          bool push(TaskNode *node) {
               std::unique_lock<std::mutex> lock(this->mutex);
-              this->q.push(value);
+              node->next = nullptr;
+              if (this->tail == nullptr) {
+                  this->head = node;
+              } else {
+                  this->tail->next = node;
+              }
+              this->tail = node;
+              ++this->size;
+              // seq_cst: ordered before the pusher's read of the pool's
+              // waiting threads, see ThreadPool::Submit()
+              this->size_hint.store(this->size);
               return true;
           }
-          // deletes the retrieved element, do not use for non integral types
-          bool pop(T & v) {
+          bool pop(TaskNode *&node) {
+              return this->pop_if_longer(node, 1);
+          }
+          // pops only if at least min_size nodes are queued
+          bool pop_if_longer(TaskNode *&node, size_t min_size) {
               std::unique_lock<std::mutex> lock(this->mutex);
-              if (this->q.empty())
+              if (this->head == nullptr || this->size < min_size)
                   return false;
-              v = this->q.front();
-              this->q.pop();
+              node = this->head;
+              --this->size;
+              this->size_hint.store(this->size, std::memory_order_relaxed);
+              this->head = node->next;
+              if (this->head == nullptr) {
+                  this->tail = nullptr;
+              }
+              node->next = nullptr;
               return true;
           }
           bool empty() {
               std::unique_lock<std::mutex> lock(this->mutex);
-              return this->q.empty();
+              return this->head == nullptr;
           }
+          // without locking, may be outdated
+          bool maybe_empty() const { return this->size_hint.load() == 0; }
+          size_t approximate_size() const { return this->size_hint.load(); }
       private:
-          std::queue<T> q;
+          TaskNode *head = nullptr;
+          TaskNode *tail = nullptr;
+          size_t size = 0;
+          std::atomic<size_t> size_hint{0};
           std::mutex mutex;
       };
+
+      // A worker thread's tasks pushed with a key, and the condition it waits
+      // on, so that a keyed push wakes only that thread.
+      struct Worker {
+          TaskQueue queue;
+          std::condition_variable cv;
+          // set under the pool mutex while the thread waits, read without it
+          // by the pushers of keyed tasks
+          std::atomic<bool> is_waiting{false};
+          // set by Resize() when it removes the thread, before it moves the
+          // queued tasks to the shared queue
+          std::atomic<bool> is_retired{false};
+      };
+
+      // A process-wide index of the calling thread, it selects the thread's
+      // submission queue in every pool.
+      inline size_t ProducerIndex() {
+          static std::atomic<size_t> next_index{0};
+          static thread_local size_t index = next_index++;
+          return index;
+      }
+
+      // The task returned by ThreadPool::Pop(). Runs at most once; a task that
+      // is never run is discarded.
+      class PoppedTask {
+      public:
+          explicit PoppedTask(TaskNode *node) : node_(node) {}
+          ~PoppedTask() {
+              if (node_ != nullptr) {
+                  node_->Discard();
+              }
+          }
+          void Run(int id) {
+              TaskNode *node = node_;
+              node_ = nullptr;
+              if (node != nullptr) {
+                  node->Run(id);
+              }
+          }
+      private:
+          PoppedTask(const PoppedTask &);             // = delete;
+          PoppedTask &operator=(const PoppedTask &);  // = delete;
+          TaskNode *node_;
+      };
   }
 
+  template <typename T>
+  class CompletionQueue;
+
   class ThreadPool {
   public:
     ThreadPool() { Init(); }
@@ -86,18 +368,32 @@ namespace ctpl {
     int NumIdle() { return n_waiting_; }
     std::thread &GetThread(const int i) { return *(threads_[i]); }
 
+    // the threads run the tasks while holding a token of 'governor', which
+    // other pools of the process may share so that together they do not
+    // run more threads than cores, see cpu_governor. nullptr: no limit
+    void SetGovernor(cpu_governor *governor) { governor_ = governor; }
+
     // change the number of threads in the pool
     // should be called from one thread, otherwise be careful to not interleave,
     // also with stop()
     // n_threads must be >= 0
     void Resize(const int n_threads) {
       if (!is_stop_ && !is_done_) {
+        JoinExitedThreads();
         int old_n_threads = static_cast<int>(threads_.size());
 
         if (old_n_threads <=
             n_threads) {  // if the number of threads is increased
           threads_.resize(n_threads);
           flags_.resize(n_threads);
+          {
+            std::unique_lock<std::mutex> lock(local_q_mutex_);
+            local_q_.resize(n_threads);
+            for (int i = old_n_threads; i < n_threads; ++i) {
+              local_q_[i] = std::make_shared<detail::Worker>();
+            }
+            ++local_q_version_;
+          }
           for (int i = old_n_threads; i < n_threads; ++i) {
             flags_[i] = std::make_shared<std::atomic<bool>>(false);
             SetThread(i);
@@ -105,13 +401,30 @@ namespace ctpl {
         } else {  // the number of threads is decreased
           for (int i = old_n_threads - 1; i >= n_threads; --i) {
             *(flags_[i]) = true;  // this thread will finish
-            threads_[i]->detach();
+            // joined once it exited: detached, it could still use the pool
+            // after the destructor
+            retired_threads_.push_back(
+                RetiredThread{std::move(threads_[i]), flags_[i]});
           }
 
-          // stop the detached threads that were waiting
-          cv_.notify_all();
+          // keys are routed to the remaining threads from now on
+          Workers removed;
+          {
+            std::unique_lock<std::mutex> lock(local_q_mutex_);
+            removed.assign(local_q_.begin() + n_threads, local_q_.end());
+            local_q_.resize(n_threads);
+            ++local_q_version_;
+          }
+          for (const auto &worker : removed) {
+            // stop the removed threads that were waiting, their tasks go to
+            // the shared queue. keyed pushes with an outdated copy of
+            // local_q_ move theirs too, see PushNode()
+            Wake(worker.get());
+            worker->is_retired = true;
+            ResubmitQueued(*worker);
+          }
 
-          // safe to delete because the threads are detached
+          // the removed threads are in retired_threads_
           threads_.resize(n_threads);
 
           // safe to delete because the threads
@@ -124,18 +437,32 @@ namespace ctpl {
 
     // empty the queue
     void ClearQueue() {
-      std::shared_ptr<std::function<void(int id)>> f;
-      // empty the queue
-      while (q_.pop(f)) {
-        // do nothing
+      detail::TaskNode *node;
+      // empty the queue, the futures of the dropped tasks get broken_promise
+      size_t cursor = 0;
+      while (PopSubmitted(cursor, node)) {
+        node->Discard();
+      }
+      std::unique_lock<std::mutex> lock(local_q_mutex_);
+      for (const auto &worker : local_q_) {
+        while (worker->queue.pop(node)) {
+          node->Discard();
+        }
       }
     }
 
     // pops a functional wrapper to the original function
+    // (allocates, unlike Push() and the workers)
     std::shared_ptr<std::function<void(int id)>> Pop() {
-      std::shared_ptr<std::function<void(int id)>> f;
-      q_.pop(f);
-      return f;
+      detail::TaskNode *node;
+      size_t cursor = 0;
+      if (!PopSubmitted(cursor, node) && !PopLocal(node, 1)) {
+        return nullptr;
+      }
+      std::shared_ptr<detail::PoppedTask> task =
+          std::make_shared<detail::PoppedTask>(node);
+      return std::make_shared<std::function<void(int id)>>(
+          [task](int id) { task->Run(id); });
     }
 
     // wait for all computing threads to finish and stop all threads
@@ -157,7 +484,7 @@ namespace ctpl {
         is_done_ = true;  // give the waiting threads a command to finish
       }
 
-      cv_.notify_all();  // stop all waiting threads
+      WakeAll();  // stop all waiting threads
 
       for (int i = 0; i < static_cast<int>(threads_.size());
           ++i) {  // wait for the computing threads to finish
@@ -165,27 +492,29 @@ namespace ctpl {
           threads_[i]->join();
         }
       }
+      for (const auto &retired : retired_threads_) {
+        retired.thread->join();
+      }
+      retired_threads_.clear();
       // if there were no threads in the pool but some functions in the queue, the
       // functions are not deleted by the threads
       // therefore delete them here
       ClearQueue();
       threads_.clear();
       flags_.clear();
+      std::unique_lock<std::mutex> lock(local_q_mutex_);
+      for (const auto &worker : local_q_) {
+        worker->is_retired = true;
+      }
+      local_q_.clear();
+      ++local_q_version_;
     }
 
     template <typename F, typename... Rest>
     auto Push(F &&f, Rest &&... rest) -> std::future<decltype(f(0, rest...))> {
-      auto pck =
-          std::make_shared<std::packaged_task<decltype(f(0, rest...))(int)>>(
-              std::bind(std::forward<F>(f), std::placeholders::_1,
-                        std::forward<Rest>(rest)...));
-      auto _f = std::make_shared<std::function<void(int id)>>(
-          [pck](int id) { (*pck)(id); });
-      // It is not necessary to lock q_ because it is locked in the Queue class.
-      q_.push(std::move(_f));
-      cv_.notify_one();
-
-      return pck->get_future();
+      auto bound = std::bind(std::forward<F>(f), std::placeholders::_1,
+                             std::forward<Rest>(rest)...);
+      return PushNode<decltype(f(0, rest...))>(std::move(bound));
     }
 
     // run the user's function that excepts argument int - id of the running
@@ -194,17 +523,34 @@ namespace ctpl {
     // the catched exceptins
     template <typename F>
     auto Push(F &&f) -> std::future<decltype(f(0))> {
-      auto pck = std::make_shared<std::packaged_task<decltype(f(0))(int)>>(
-          std::forward<F>(f));
-      auto _f = std::make_shared<std::function<void(int id)>>(
-          [pck](int id) { (*pck)(id); });
-      // It is not necessary to lock q_ because it is locked in the Queue class.
-      q_.push(std::move(_f));
-      cv_.notify_one();
+      using Function = typename std::decay<F>::type;
+      return PushNode<decltype(f(0))>(Function(std::forward<F>(f)));
+    }
 
-      return pck->get_future();
+    // like Push(), but the task runs on the home thread of 'key',
+    // key % size(), so that the tasks of a key find their data in that core's
+    // caches. other threads take it only when the home thread is overloaded,
+    // i.e. kStealThreshold tasks wait for it. hash non-integral keys first,
+    // e.g. Push(std::hash<std::string>()(name), f).
+    // 按 key 将任务路由到固定的工作线程，提高缓存命中率
+    template <typename F, typename... Rest>
+    auto Push(size_t key, F &&f, Rest &&... rest)
+        -> std::future<decltype(f(0, rest...))> {
+      auto bound = std::bind(std::forward<F>(f), std::placeholders::_1,
+                             std::forward<Rest>(rest)...);
+      return PushNode<decltype(f(0, rest...))>(std::move(bound), &key);
     }
 
+    template <typename F>
+    auto Push(size_t key, F &&f) -> std::future<decltype(f(0))> {
+      using Function = typename std::decay<F>::type;
+      return PushNode<decltype(f(0))>(Function(std::forward<F>(f)), &key);
+    }
+
+    // number of tasks waiting for their home thread above which the other
+    // threads may run them
+    static constexpr size_t kStealThreshold = 4;
+
   private:
     // deleted
     ThreadPool(const ThreadPool &);             // = delete;
@@ -212,33 +558,245 @@ namespace ctpl {
     ThreadPool &operator=(const ThreadPool &);  // = delete;
     ThreadPool &operator=(ThreadPool &&);       // = delete;
 
+    template <typename T>
+    friend class CompletionQueue;
+
+    // queues a node created by a CompletionQueue
+    void PushTaskNode(detail::TaskNode *node) { Submit(node); }
+
+    // the producers' FIFOs, a thread always uses the same one
+    static constexpr size_t kNumSubmissionQueues = 64;
+
+    using Workers = std::vector<std::shared_ptr<detail::Worker>>;
+
+    struct SubmissionSlot {
+      detail::TaskQueue queue;
+      // the producers' copy of local_q_ for keyed pushes, see UpdateWorkers()
+      std::mutex workers_mutex;
+      Workers workers;
+      unsigned workers_version = static_cast<unsigned>(-1);
+      char padding[64];  // keeps the producers' queues on distinct cache lines
+    };
+
+    detail::TaskQueue &SubmissionQueue() {
+      return submission_q_[detail::ProducerIndex() % kNumSubmissionQueues].queue;
+    }
+
+    // the producers only share the pool mutex when a thread waits
+    void Submit(detail::TaskNode *node) {
+      SubmissionQueue().push(node);
+      // a thread about to wait counts itself in n_waiting_ before checking
+      // the queues, both seq_cst: either it sees the task or it is seen here
+      if (n_waiting_ > 0) {
+        WakeOne();
+      }
+    }
+
+    // the waiting threads are in idle_, the most recent last. all take the
+    // pool mutex, to not notify between a thread's check of the queues and
+    // its wait
+    void WakeOne() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        idle_.back()->cv.notify_one();
+        idle_.pop_back();
+      }
+    }
+
+    void Wake(detail::Worker *worker) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (worker->is_waiting) {
+        auto it = std::find(idle_.begin(), idle_.end(), worker);
+        if (it != idle_.end()) {
+          idle_.erase(it);
+        }
+        worker->cv.notify_one();
+      }
+    }
+
+    void WakeAll() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (detail::Worker *worker : idle_) {
+        worker->cv.notify_one();
+      }
+    }
+
+    // pops from the producers' queues round-robin, starting at 'cursor'
+    // which moves past the queue popped from
+    bool PopSubmitted(size_t &cursor, detail::TaskNode *&node) {
+      for (size_t n = 0; n < kNumSubmissionQueues; ++n) {
+        detail::TaskQueue &queue =
+            submission_q_[(cursor + n) % kNumSubmissionQueues].queue;
+        if (!queue.maybe_empty() && queue.pop(node)) {
+          cursor = (cursor + n + 1) % kNumSubmissionQueues;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // The function and its promise live in one recycled node, which the
+    // queue links intrusively.
+    // 'key', if not null, selects the home thread.
+    template <typename R, typename Function>
+    std::future<R> PushNode(Function &&function, const size_t *key = nullptr) {
+      auto *node = detail::FunctionTaskNode<Function, R>::Create(
+          std::move(function));
+      std::future<R> future = node->promise.get_future();
+      if (key != nullptr) {
+        SubmissionSlot &slot =
+            submission_q_[detail::ProducerIndex() % kNumSubmissionQueues];
+        std::shared_ptr<detail::Worker> home;
+        {
+          // local_q_mutex_ is only taken after a Resize()
+          std::unique_lock<std::mutex> lock(slot.workers_mutex);
+          UpdateWorkers(slot.workers, slot.workers_version);
+          if (!slot.workers.empty()) {
+            home = slot.workers[*key % slot.workers.size()];
+          }
+        }
+        if (home) {
+          home->queue.push(node);
+          const size_t queued = home->queue.approximate_size();
+          // Resize() sets is_retired before it empties the queue, both
+          // seq_cst: either it moves the task or the task is moved here
+          if (home->is_retired) {
+            ResubmitQueued(*home);
+            return future;
+          }
+          // the home thread sets is_waiting before checking its queue, both
+          // seq_cst: either it sees the task or it is seen here. the other
+          // threads only help once the home thread is overloaded
+          if (home->is_waiting) {
+            Wake(home.get());
+          } else if (queued >= kStealThreshold && n_waiting_ > 0) {
+            WakeOne();
+          }
+          return future;
+        }
+      }
+      // It is not necessary to lock the queue because it is locked in the TaskQueue class.
+      Submit(node);
+      return future;
+    }
+
+    // steals from the first queue of 'workers' holding at least min_size
+    // tasks
+    static bool Steal(const Workers &workers, detail::TaskNode *&node,
+                      size_t min_size) {
+      for (const auto &worker : workers) {
+        if (worker->queue.approximate_size() >= min_size &&
+            worker->queue.pop_if_longer(node, min_size)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool PopLocal(detail::TaskNode *&node, size_t min_size) {
+      std::unique_lock<std::mutex> lock(local_q_mutex_);
+      return Steal(local_q_, node, min_size);
+    }
+
+    // own queue first, then the producers' ones, then overloaded threads.
+    // 'workers' is the thread's copy of local_q_, so that idle threads do not
+    // take local_q_mutex_
+    bool PopTask(detail::Worker &worker, const Workers &workers,
+                 size_t &cursor, detail::TaskNode *&node) {
+      return (!worker.queue.maybe_empty() && worker.queue.pop(node)) ||
+             PopSubmitted(cursor, node) ||
+             Steal(workers, node, kStealThreshold);
+    }
+
+    // moves the tasks of a removed thread to the shared queue
+    void ResubmitQueued(detail::Worker &worker) {
+      detail::TaskNode *node;
+      while (worker.queue.pop(node)) {
+        Submit(node);
+      }
+    }
+
+    // joins the threads removed by Resize() that exited, their function no
+    // longer holds a copy of their flag
+    void JoinExitedThreads() {
+      auto exited = std::partition(
+          retired_threads_.begin(), retired_threads_.end(),
+          [](const RetiredThread &retired) { return retired.flag.use_count() > 1; });
+      for (auto it = exited; it != retired_threads_.end(); ++it) {
+        it->thread->join();
+      }
+      retired_threads_.erase(exited, retired_threads_.end());
+    }
+
+    // updates a thread's or a producer slot's copy of local_q_ after Resize()
+    void UpdateWorkers(Workers &workers, unsigned &version) {
+      if (version != local_q_version_) {
+        std::unique_lock<std::mutex> lock(local_q_mutex_);
+        workers = local_q_;
+        version = local_q_version_;
+      }
+    }
+
     void SetThread(int i) {
       std::shared_ptr<std::atomic<bool>> flag(
           flags_[i]);  // a copy of the shared ptr to the flag
-      auto f = [this, i, flag /* a copy of the shared ptr to the flag */]() {
+      std::shared_ptr<detail::Worker> worker(local_q_[i]);
+      auto f = [this, i, flag /* a copy of the shared ptr to the flag */,
+                worker]() {
         std::atomic<bool> &_flag = *flag;
-        std::shared_ptr<std::function<void(int id)>> _f;
-        bool is_pop_ = q_.pop(_f);
+        Workers workers;
+        unsigned workers_version = local_q_version_ - 1;
+        UpdateWorkers(workers, workers_version);
+        detail::TaskNode *_f;
+        size_t cursor = i;  // the threads start draining at different producers
+        bool is_pop_ = PopTask(*worker, workers, cursor, _f);
         while (true) {
           while (is_pop_) {  // if there is anything in the queue
-            (*_f)(i);
+            cpu_governor *governor = governor_;
+            if (governor) {
+              governor->acquire();  // kept from one task to the next
+            }
+            _f->Run(i);  // runs and recycles the node
+            if (governor) {
+              governor->yield();
+            }
             if (_flag) {
               // the thread is wanted to stop, return even if the queue is not
               // empty yet
+              ReleaseToken();
               return;
             } else {
-              is_pop_ = q_.pop(_f);
+              UpdateWorkers(workers, workers_version);
+              is_pop_ = PopTask(*worker, workers, cursor, _f);
             }
           }
           // the queue is empty here, wait for the next command
+          ReleaseToken();
+          UpdateWorkers(workers, workers_version);
           {
             std::unique_lock<std::mutex> lock(mutex_);
+            worker->is_waiting = true;
             ++n_waiting_;
-            cv_.wait(lock, [this, &_f, &is_pop_, &_flag]() {
-              is_pop_ = q_.pop(_f);
-              return is_pop_ || is_done_ || _flag;
+            worker->cv.wait(lock, [this, &_f, &is_pop_, &_flag, &worker,
+                                   &workers, &cursor]() {
+              is_pop_ = PopTask(*worker, workers, cursor, _f);
+              if (is_pop_ || is_done_ || _flag) {
+                return true;
+              }
+              // (back) in idle_ before waiting: WakeOne() takes the thread
+              // out, also when another thread then gets the task
+              if (std::find(idle_.begin(), idle_.end(), worker.get()) ==
+                  idle_.end()) {
+                idle_.push_back(worker.get());
+              }
+              return false;
             });
             --n_waiting_;
+            worker->is_waiting = false;
+            auto it = std::find(idle_.begin(), idle_.end(), worker.get());
+            if (it != idle_.end()) {
+              idle_.erase(it);
+            }
             if (!is_pop_) {
               // if the queue is empty and is_done_ == true or *flag
               // then return
@@ -251,21 +809,374 @@ namespace ctpl {
           new std::thread(f));  // compiler may not support std::make_unique()
     }
 
+    // the thread waits or exits, its token goes to the other threads
+    static void ReleaseToken() {
+      cpu_governor *governor = cpu_governor::current();
+      if (governor) {
+        governor->release();
+      }
+    }
+
     void Init() {
       is_stop_ = false;
       is_done_ = false;
       n_waiting_ = 0;
+      local_q_version_ = 0;
+      governor_ = nullptr;
     }
 
     std::vector<std::unique_ptr<std::thread>> threads_;
+    // removed by Resize(), they finish their task and exit
+    struct RetiredThread {
+      std::unique_ptr<std::thread> thread;
+      std::shared_ptr<std::atomic<bool>> flag;
+    };
+    std::vector<RetiredThread> retired_threads_;
     std::vector<std::shared_ptr<std::atomic<bool>>> flags_;
-    detail::Queue<std::shared_ptr<std::function<void(int id)>>> q_;
+    std::unique_ptr<SubmissionSlot[]> submission_q_{
+        new SubmissionSlot[kNumSubmissionQueues]};
+    // tasks pushed with a key, per home thread
+    Workers local_q_;
+    std::mutex local_q_mutex_;
+    // changed with local_q_, the threads then update their copy
+    std::atomic<unsigned> local_q_version_;
     std::atomic<bool> is_done_;
     std::atomic<bool> is_stop_;
     std::atomic<int> n_waiting_;  // how many threads are waiting
+    std::atomic<cpu_governor *> governor_;
 
     std::mutex mutex_;
-    std::condition_variable cv_;
+    std::vector<detail::Worker *> idle_;  // waiting threads, under mutex_
+  };
+
+  // A serial queue on top of a ThreadPool: the functions pushed to a strand
+  // run one at a time, in the order they were pushed, on the pool's threads.
+  // A strand takes a worker only while it has queued functions and owns no
+  // thread, so any number of strands can share a pool, e.g. one per entity
+  // whose work must be ordered. Functions get the id of the running thread.
+  // 串行队列：同一 strand 内的任务按 FIFO 顺序执行且互不并发
+  class Strand {
+  public:
+    // the pool must outlive the functions pushed to the strand
+    explicit Strand(ThreadPool &pool)
+        : pool_(&pool), state_(std::make_shared<State>()) {}
+
+    // functions still queued run later, the strand's state is kept alive by
+    // the pool's tasks
+    ~Strand() {}
+
+    template <typename F, typename... Rest>
+    auto Push(F &&f, Rest &&... rest) -> std::future<decltype(f(0, rest...))> {
+      auto bound = std::bind(std::forward<F>(f), std::placeholders::_1,
+                             std::forward<Rest>(rest)...);
+      return PushNode<decltype(f(0, rest...))>(std::move(bound));
+    }
+
+    template <typename F>
+    auto Push(F &&f) -> std::future<decltype(f(0))> {
+      using Function = typename std::decay<F>::type;
+      return PushNode<decltype(f(0))>(Function(std::forward<F>(f)));
+    }
+
+  private:
+    // deleted
+    Strand(const Strand &);             // = delete;
+    Strand &operator=(const Strand &);  // = delete;
+
+    // number of functions run before the worker is handed back to the pool,
+    // so that busy strands do not starve the others
+    static constexpr int kMaxBatchSize = 32;
+
+    struct State {
+      // the pool was stopped without running the Drain() task and the strand
+      // is gone: discard the functions left
+      ~State() {
+        while (head != nullptr) {
+          detail::TaskNode *node = head;
+          head = node->next;
+          node->Discard();
+        }
+      }
+
+      std::mutex mutex;
+      detail::TaskNode *head = nullptr;
+      detail::TaskNode *tail = nullptr;
+      // a Drain() task is queued in or running on the pool
+      bool is_scheduled = false;
+    };
+
+    template <typename R, typename Function>
+    std::future<R> PushNode(Function &&function) {
+      auto *node = detail::FunctionTaskNode<Function, R>::Create(
+          std::move(function));
+      std::future<R> future = node->promise.get_future();
+      bool schedule = false;
+      {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        node->next = nullptr;
+        if (state_->tail == nullptr) {
+          state_->head = node;
+        } else {
+          state_->tail->next = node;
+        }
+        state_->tail = node;
+        schedule = !state_->is_scheduled;
+        state_->is_scheduled = true;
+      }
+      if (schedule) {
+        Schedule(pool_, state_);
+      }
+      return future;
+    }
+
+    static void Schedule(ThreadPool *pool, const std::shared_ptr<State> &state) {
+      pool->Push([pool, state](int id) { Drain(pool, state, id); });
+    }
+
+    // runs the queued functions, at most kMaxBatchSize of them before
+    // rescheduling itself behind the pool's other tasks
+    static void Drain(ThreadPool *pool, const std::shared_ptr<State> &state,
+                      int id) {
+      for (int i = 0; i < kMaxBatchSize; ++i) {
+        detail::TaskNode *node;
+        {
+          std::unique_lock<std::mutex> lock(state->mutex);
+          node = state->head;
+          if (node == nullptr) {
+            state->is_scheduled = false;
+            return;
+          }
+          state->head = node->next;
+          if (state->head == nullptr) {
+            state->tail = nullptr;
+          }
+        }
+        node->Run(id);
+      }
+      Schedule(pool, state);
+    }
+
+    ThreadPool *pool_;
+    std::shared_ptr<State> state_;
+  };
+
+  namespace detail {
+      // A task of a CompletionQueue<T>. Once run, the node keeps the result,
+      // or the exception, and waits in the queue for the consumer.
+      template <typename T>
+      struct CompletionNode : TaskNode {
+          T *value() { return reinterpret_cast<T *>(&this->storage); }
+
+          typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+          bool has_value = false;
+          std::exception_ptr exception;
+          // destroys the completed node and frees it
+          void (*release)(CompletionNode *node);
+      };
+
+      template <typename T>
+      struct CompletionState {
+          std::mutex mutex;
+          std::condition_variable cv;
+          CompletionNode<T> *head = nullptr;  // completed, oldest first
+          CompletionNode<T> *tail = nullptr;
+          size_t num_pending = 0;  // pushed and not completed
+      };
+
+      template <typename F, typename T>
+      struct FunctionCompletionNode : CompletionNode<T> {
+          FunctionCompletionNode(F &&f, CompletionState<T> *state)
+              : function(std::move(f)), state(state) {
+              this->finish = &FunctionCompletionNode::Finish;
+              this->release = &FunctionCompletionNode::Release;
+          }
+
+          static FunctionCompletionNode *Create(F &&f, CompletionState<T> *state) {
+              static_assert(alignof(FunctionCompletionNode) <= alignof(std::max_align_t),
+                            "over-aligned results are not supported");
+              void *memory = NodeAllocator::Allocate(sizeof(FunctionCompletionNode));
+              return new (memory) FunctionCompletionNode(std::move(f), state);
+          }
+
+          static void Finish(TaskNode *base, int id, bool execute) {
+              FunctionCompletionNode *node = static_cast<FunctionCompletionNode *>(base);
+              CompletionState<T> *state = node->state;
+              if (!execute) {  // the pool dropped the task
+                  node->~FunctionCompletionNode();
+                  NodeAllocator::Free(node, sizeof(FunctionCompletionNode));
+                  std::unique_lock<std::mutex> lock(state->mutex);
+                  --state->num_pending;
+                  state->cv.notify_all();
+                  return;
+              }
+              try {
+                  new (node->value()) T(node->function(id));
+                  node->has_value = true;
+              } catch (...) {
+                  node->exception = std::current_exception();
+              }
+              std::unique_lock<std::mutex> lock(state->mutex);
+              node->next = nullptr;
+              if (state->tail == nullptr) {
+                  state->head = node;
+              } else {
+                  state->tail->next = node;
+              }
+              state->tail = node;
+              --state->num_pending;
+              state->cv.notify_all();
+          }
+
+          static void Release(CompletionNode<T> *base) {
+              FunctionCompletionNode *node = static_cast<FunctionCompletionNode *>(base);
+              if (node->has_value) {
+                  node->value()->~T();
+              }
+              node->~FunctionCompletionNode();
+              NodeAllocator::Free(node, sizeof(FunctionCompletionNode));
+          }
+
+          F function;
+          CompletionState<T> *state;
+      };
+  }
+
+  // Results of functions run on a ThreadPool, in the order they complete
+  // rather than the order they were pushed, so that a slow function does not
+  // hold back the finished ones as a vector of futures would:
+  //
+  //   ctpl::CompletionQueue<std::string> results(pool);
+  //   for (...) results.Push(filter_duplicates);
+  //   std::string result;
+  //   while (results.Pop(result)) { ... }
+  //
+  // The result is kept in the function's task node, no future is created.
+  // 按完成顺序获取结果，避免逐个等待 future
+  template <typename T>
+  class CompletionQueue {
+  public:
+    explicit CompletionQueue(ThreadPool &pool) : pool_(&pool) {}
+
+    // waits for the pushed functions, the results not popped are dropped
+    ~CompletionQueue() {
+      std::unique_lock<std::mutex> lock(state_.mutex);
+      state_.cv.wait(lock, [this]() { return state_.num_pending == 0; });
+      while (state_.head != nullptr) {
+        detail::CompletionNode<T> *node = state_.head;
+        state_.head = static_cast<detail::CompletionNode<T> *>(node->next);
+        node->release(node);
+      }
+    }
+
+    // runs f(id, rest...) on the pool, its result must convert to T
+    template <typename F, typename... Rest>
+    void Push(F &&f, Rest &&... rest) {
+      auto bound = std::bind(std::forward<F>(f), std::placeholders::_1,
+                             std::forward<Rest>(rest)...);
+      PushFunction(std::move(bound));
+    }
+
+    template <typename F>
+    void Push(F &&f) {
+      using Function = typename std::decay<F>::type;
+      PushFunction(Function(std::forward<F>(f)));
+    }
+
+    // waits for the next result. returns false once all the pushed functions
+    // completed and their results were popped. rethrows the exception of a
+    // function that threw
+    bool Pop(T &value) {
+      std::unique_lock<std::mutex> lock(state_.mutex);
+      state_.cv.wait(lock, [this]() {
+        return state_.head != nullptr || state_.num_pending == 0;
+      });
+      detail::CompletionNode<T> *node = Unlink();
+      lock.unlock();
+      return node != nullptr && Take(node, value);
+    }
+
+    // returns false if no result is ready
+    bool TryPop(T &value) {
+      std::unique_lock<std::mutex> lock(state_.mutex);
+      detail::CompletionNode<T> *node = Unlink();
+      lock.unlock();
+      return node != nullptr && Take(node, value);
+    }
+
+    // waits for the next result, then appends it and the other ready ones, at
+    // most max_count, to 'values'. returns their number, 0 as Pop() returns
+    // false. an exception is rethrown if it is the first result, otherwise the
+    // batch stops before it
+    size_t PopBatch(std::vector<T> &values, size_t max_count) {
+      std::unique_lock<std::mutex> lock(state_.mutex);
+      state_.cv.wait(lock, [this]() {
+        return state_.head != nullptr || state_.num_pending == 0;
+      });
+      size_t count = 0;
+      while (count < max_count && state_.head != nullptr) {
+        if (state_.head->exception && count > 0) {
+          break;
+        }
+        detail::CompletionNode<T> *node = Unlink();
+        if (node->exception) {
+          std::exception_ptr exception = node->exception;
+          node->release(node);
+          std::rethrow_exception(exception);
+        }
+        values.push_back(std::move(*node->value()));
+        node->release(node);
+        ++count;
+      }
+      return count;
+    }
+
+    // number of pushed functions not completed yet
+    size_t NumPending() {
+      std::unique_lock<std::mutex> lock(state_.mutex);
+      return state_.num_pending;
+    }
+
+  private:
+    // deleted
+    CompletionQueue(const CompletionQueue &);             // = delete;
+    CompletionQueue &operator=(const CompletionQueue &);  // = delete;
+
+    template <typename Function>
+    void PushFunction(Function &&function) {
+      auto *node = detail::FunctionCompletionNode<Function, T>::Create(
+          std::move(function), &state_);
+      {
+        std::unique_lock<std::mutex> lock(state_.mutex);
+        ++state_.num_pending;
+      }
+      pool_->PushTaskNode(node);
+    }
+
+    // the oldest completed node, state_.mutex must be held
+    detail::CompletionNode<T> *Unlink() {
+      detail::CompletionNode<T> *node = state_.head;
+      if (node != nullptr) {
+        state_.head = static_cast<detail::CompletionNode<T> *>(node->next);
+        if (state_.head == nullptr) {
+          state_.tail = nullptr;
+        }
+      }
+      return node;
+    }
+
+    bool Take(detail::CompletionNode<T> *node, T &value) {
+      if (node->exception) {
+        std::exception_ptr exception = node->exception;
+        node->release(node);
+        std::rethrow_exception(exception);
+      }
+      value = std::move(*node->value());
+      node->release(node);
+      return true;
+    }
+
+    ThreadPool *pool_;
+    detail::CompletionState<T> state_;
   };
 
 }
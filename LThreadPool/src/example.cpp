@@ -125,7 +125,17 @@ void lzw_test6() {
 }
 
 void lzw_test7() {
-    
+    // results in the order they complete, without futures
+    ctpl::CompletionQueue<std::string> results(p);
+    for (int i = 0; i < 4; ++i) {
+        results.Push([](int id, int i) {
+            return "task " + std::to_string(i) + " done on " + std::to_string(id);
+        }, i);
+    }
+    std::string result;
+    while (results.Pop(result)) {
+        std::cout << result << '\n';
+    }
 }
 
 void lzw_test8() {
@@ -141,6 +151,7 @@ int main(int argc, char **argv) {
     // lzw_test4();
     // lzw_test5();
     // lzw_test6();   
+    // lzw_test7();
 
     return 0;
 }
@@ -1,19 +1,24 @@
-#include "modules/common/util/ctpl_stl.h"
+#include "ctpl.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <future>
 #include <iterator>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 
-namespace apollo {
-namespace common {
-namespace util {
-
 namespace {
+
+using ctpl::ThreadPool;
+
 // ...
 
 // Attention: don't use overloaded functions, otherwise the compiler can't
@@ -54,8 +59,6 @@ std::string filter_duplicates(int id) {
   return ss_out.str();
 }
 
-}  // namespace
-
 TEST(ThreadPool, filter_duplicates) {
   const unsigned int hardware_threads = std::thread::hardware_concurrency();
   const unsigned int threads =
@@ -80,6 +83,196 @@ TEST(ThreadPool, filter_duplicates) {
   }
 }
 
-}  // namespace util
-}  // namespace common
-}  // namespace apollo
\ No newline at end of file
+TEST(ThreadPool, recycles_task_nodes) {
+  // a freed block is handed out again by the same thread
+  void *block = ctpl::detail::NodeAllocator::Allocate(100);
+  ctpl::detail::NodeAllocator::Free(block, 100);
+  EXPECT_EQ(block, ctpl::detail::NodeAllocator::Allocate(128));
+  ctpl::detail::NodeAllocator::Free(block, 128);
+
+  ThreadPool p(2);
+  for (int round = 0; round < 3; ++round) {
+    std::vector<std::future<int>> futures;
+    for (int i = 0; i < 1000; ++i) {
+      futures.push_back(p.Push([i](int) { return i; }));
+    }
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_EQ(i, futures[i].get());
+    }
+  }
+  // too large for the size classes
+  std::array<char, 2000> payload{};
+  payload[1999] = 7;
+  EXPECT_EQ(7, p.Push([payload](int) { return payload[1999]; }).get());
+}
+
+TEST(ThreadPool, exception_goes_to_future) {
+  ThreadPool p(1);
+  std::future<void> future =
+      p.Push([](int) { throw std::runtime_error("failed"); });
+  EXPECT_THROW(future.get(), std::runtime_error);
+  EXPECT_EQ(3, p.Push([](int) { return 3; }).get());
+}
+
+TEST(ThreadPool, dropped_tasks_break_their_promise) {
+  ThreadPool p;  // no threads, the tasks stay queued
+  std::future<int> cleared = p.Push([](int) { return 1; });
+  p.ClearQueue();
+  try {
+    cleared.get();
+    ADD_FAILURE() << "no exception";
+  } catch (const std::future_error &e) {
+    EXPECT_EQ(std::future_errc::broken_promise, e.code());
+  }
+
+  std::future<int> popped = p.Push([](int id) { return id; });
+  std::shared_ptr<std::function<void(int id)>> task = p.Pop();
+  ASSERT_TRUE(task != nullptr);
+  EXPECT_TRUE(p.Pop() == nullptr);
+  (*task)(5);
+  (*task)(6);  // runs only once
+  EXPECT_EQ(5, popped.get());
+
+  std::future<int> discarded = p.Push([](int) { return 1; });
+  p.Pop().reset();
+  EXPECT_THROW(discarded.get(), std::future_error);
+}
+
+TEST(Strand, runs_functions_in_order_one_at_a_time) {
+  ThreadPool p(4);
+  ctpl::Strand first(p);
+  ctpl::Strand second(p);
+  ctpl::Strand *strands[2] = {&first, &second};
+  std::vector<int> order[2];
+  std::atomic<int> running[2];
+  std::atomic<bool> overlapped(false);
+  std::vector<std::future<void>> futures;
+  for (int s = 0; s < 2; ++s) {
+    running[s] = 0;
+  }
+  // more functions than a batch, so that the strands reschedule
+  for (int i = 0; i < 500; ++i) {
+    for (int s = 0; s < 2; ++s) {
+      futures.push_back(strands[s]->Push([&, s, i](int) {
+        if (++running[s] != 1) {
+          overlapped = true;
+        }
+        order[s].push_back(i);
+        --running[s];
+      }));
+    }
+  }
+  for (auto &future : futures) {
+    future.get();
+  }
+  EXPECT_FALSE(overlapped);
+  for (int s = 0; s < 2; ++s) {
+    ASSERT_EQ(500u, order[s].size());
+    for (int i = 0; i < 500; ++i) {
+      EXPECT_EQ(i, order[s][i]);
+    }
+  }
+  EXPECT_EQ(6, first.Push([](int, int a, int b) { return a * b; }, 2, 3).get());
+}
+
+TEST(ThreadPool, keyed_tasks_run_on_their_home_thread) {
+  ThreadPool p(4);
+  for (size_t key = 0; key < 20; ++key) {
+    // one at a time, so that no thread is overloaded and may steal
+    EXPECT_EQ(static_cast<int>(key % 4), p.Push(key, [](int id) { return id; }).get());
+  }
+}
+
+TEST(ThreadPool, keyed_tasks_survive_resize) {
+  ThreadPool p(4);
+  std::atomic<bool> pushing(true);
+  std::vector<std::future<size_t>> futures;
+  std::thread producer([&p, &pushing, &futures]() {
+    for (size_t key = 0; pushing || key < 1000; ++key) {
+      futures.push_back(p.Push(key, [key](int) { return key; }));
+    }
+  });
+  for (int i = 0; i < 50; ++i) {
+    p.Resize(1 + i % 4);
+  }
+  pushing = false;
+  producer.join();
+  for (size_t key = 0; key < futures.size(); ++key) {
+    ASSERT_EQ(std::future_status::ready,
+              futures[key].wait_for(std::chrono::seconds(10)))
+        << "task " << key << " was lost";
+    EXPECT_EQ(key, futures[key].get());
+  }
+}
+
+TEST(CompletionQueue, returns_results_in_completion_order) {
+  ThreadPool p(2);
+  ctpl::CompletionQueue<std::string> results(p);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  // the first function waits until the second one's result was popped
+  results.Push([released](int) {
+    released.wait();
+    return std::string("slow");
+  });
+  results.Push([](int) { return std::string("fast"); });
+  std::string result;
+  ASSERT_TRUE(results.Pop(result));
+  EXPECT_EQ("fast", result);
+  EXPECT_FALSE(results.TryPop(result));
+  EXPECT_EQ(1u, results.NumPending());
+  release.set_value();
+  ASSERT_TRUE(results.Pop(result));
+  EXPECT_EQ("slow", result);
+  EXPECT_FALSE(results.Pop(result));
+}
+
+TEST(CompletionQueue, pops_batches_and_rethrows) {
+  ThreadPool p(2);
+  ctpl::CompletionQueue<int> results(p);
+  for (int i = 0; i < 100; ++i) {
+    results.Push([](int, int value) { return value; }, i);
+  }
+  std::vector<int> values;
+  while (results.PopBatch(values, 16) > 0) {
+  }
+  ASSERT_EQ(100u, values.size());
+  std::sort(values.begin(), values.end());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, values[i]);
+  }
+
+  results.Push([](int) -> int { throw std::runtime_error("failed"); });
+  int value;
+  EXPECT_THROW(results.Pop(value), std::runtime_error);
+  EXPECT_FALSE(results.Pop(value));
+}
+
+TEST(ThreadPool, runs_each_producer_in_order) {
+  ThreadPool p(1);  // one thread, the order of a producer's queue is kept
+  std::vector<int> order[4];
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < 4; ++producer) {
+    producers.emplace_back([&p, &order, producer]() {
+      std::vector<std::future<void>> futures;
+      for (int i = 0; i < 500; ++i) {
+        futures.push_back(
+            p.Push([&order, producer, i](int) { order[producer].push_back(i); }));
+      }
+      for (auto &future : futures) {
+        future.get();
+      }
+    });
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+  for (int producer = 0; producer < 4; ++producer) {
+    ASSERT_EQ(500u, order[producer].size());
+    for (int i = 0; i < 500; ++i) {
+      EXPECT_EQ(i, order[producer][i]);
+    }
+  }
+}
+
+}  // namespace
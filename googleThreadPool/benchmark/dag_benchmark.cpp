@@ -0,0 +1,392 @@
+// Scheduling benchmark: runs synthetic task graphs on the thread pools and
+// compares the makespan with the ideal one, max(total work / threads,
+// critical path), for a range of worker counts.
+//
+//   make benchmark
+//   ./build/apps/dag_benchmark --graphs=chain,layered --tasks=20000
+//       --work_us=10 --threads=1,2,4,8 --repeats=5 --backend=threadpool
+//
+// Columns: makespan and ideal makespan in ms, efficiency = ideal / makespan,
+// speedup over the first worker count, and the scheduling overhead per task,
+// (makespan - ideal) * threads / tasks, in us. With --work_us=0 the overhead
+// is the whole cost of getting a task through the pool.
+// 任务图调度性能测试
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "ctpl_thread_pool.h"
+#include "inline_thread_pool.h"
+#include "task.h"
+#include "task_graph.h"
+#include "task_graph_template.h"
+#include "thread_pool.h"
+
+namespace {
+
+struct Flags {
+    std::vector<std::string> graphs = {"chain", "fanout", "fanin", "layered",
+                                       "mixed"};
+    int tasks = 10000;
+    double work_us = 5.;
+    std::vector<int> threads = {1, 2, 4, 8};
+    int repeats = 5;
+    std::string backend = "threadpool";  // threadpool, ctpl or inline.
+};
+
+// Busy work, so that the pool's threads compete for CPU like real tasks do.
+void Spin(const double duration_us) {
+  const auto end = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                       std::chrono::duration<double, std::micro>(duration_us));
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+// A graph description: dependencies always point to earlier nodes, so the
+// node order is topological.
+struct Dag {
+    struct Node {
+        double work_us;
+        int type;
+        std::vector<size_t> dependencies;
+    };
+    std::vector<Node> nodes;
+
+    size_t Add(const double work_us, const int type,
+               std::vector<size_t> dependencies = {}) {
+      nodes.push_back(Node{work_us, type, std::move(dependencies)});
+      return nodes.size() - 1;
+    }
+
+    double TotalWorkUs() const {
+      double total = 0.;
+      for (const Node& node : nodes) total += node.work_us;
+      return total;
+    }
+
+    double CriticalPathUs() const {
+      std::vector<double> finish(nodes.size(), 0.);
+      double longest = 0.;
+      for (size_t i = 0; i != nodes.size(); ++i) {
+        double start = 0.;
+        for (size_t dependency : nodes[i].dependencies) {
+          start = std::max(start, finish[dependency]);
+        }
+        finish[i] = start + nodes[i].work_us;
+        longest = std::max(longest, finish[i]);
+      }
+      return longest;
+    }
+};
+
+Dag MakeChain(const int num_tasks, const double work_us) {
+  Dag dag;
+  for (int i = 0; i != num_tasks; ++i) {
+    if (i == 0) {
+      dag.Add(work_us, 0);
+    } else {
+      dag.Add(work_us, 0, {static_cast<size_t>(i - 1)});
+    }
+  }
+  return dag;
+}
+
+Dag MakeFanOut(const int num_tasks, const double work_us) {
+  Dag dag;
+  const size_t root = dag.Add(work_us, 0);
+  for (int i = 1; i < num_tasks; ++i) {
+    dag.Add(work_us, 1, {root});
+  }
+  return dag;
+}
+
+// Binary reduction tree over num_tasks / 2 leaves.
+Dag MakeFanIn(const int num_tasks, const double work_us) {
+  Dag dag;
+  std::vector<size_t> level;
+  for (int i = 0; i < std::max(1, num_tasks / 2); ++i) {
+    level.push_back(dag.Add(work_us, 0));
+  }
+  while (level.size() > 1) {
+    std::vector<size_t> next;
+    for (size_t i = 0; i + 1 < level.size(); i += 2) {
+      next.push_back(dag.Add(work_us, 1, {level[i], level[i + 1]}));
+    }
+    if (level.size() % 2 == 1) next.push_back(level.back());
+    level.swap(next);
+  }
+  return dag;
+}
+
+// Layers of 64 nodes, each depending on 1 to 3 random nodes of the previous
+// layer. Work varies by +-50%.
+Dag MakeLayered(const int num_tasks, const double work_us) {
+  constexpr int kWidth = 64;
+  std::mt19937 random(42);
+  std::uniform_real_distribution<double> work(0.5 * work_us, 1.5 * work_us);
+  std::uniform_int_distribution<int> fan_in(1, 3);
+  std::uniform_int_distribution<int> pick(0, kWidth - 1);
+  Dag dag;
+  std::vector<size_t> previous;
+  while (static_cast<int>(dag.nodes.size()) < num_tasks) {
+    std::vector<size_t> layer;
+    for (int i = 0; i != kWidth && static_cast<int>(dag.nodes.size()) < num_tasks;
+         ++i) {
+      std::vector<size_t> dependencies;
+      if (!previous.empty()) {
+        for (int j = fan_in(random); j != 0; --j) {
+          const size_t dependency = previous[pick(random) % previous.size()];
+          if (std::find(dependencies.begin(), dependencies.end(), dependency) ==
+              dependencies.end()) {
+            dependencies.push_back(dependency);
+          }
+        }
+      }
+      layer.push_back(dag.Add(work(random), 0, std::move(dependencies)));
+    }
+    previous.swap(layer);
+  }
+  return dag;
+}
+
+// Shaped like Cartographer's pose graph work, using the 'type_' values of
+// Task: per node a fast matcher (1) feeding local constraints (2) and a
+// global constraint search (3), then finishing the node (4); every 20 nodes
+// an optimization (5) waits for the finished nodes.
+Dag MakeMixed(const int num_tasks, const double work_us) {
+  constexpr int kTasksPerNode = 6;
+  constexpr int kNodesPerOptimization = 20;
+  Dag dag;
+  std::vector<size_t> finished_nodes;
+  size_t last_optimization = 0;
+  bool has_optimization = false;
+  while (static_cast<int>(dag.nodes.size()) + kTasksPerNode <= num_tasks) {
+    std::vector<size_t> matcher_dependencies;
+    if (has_optimization) matcher_dependencies.push_back(last_optimization);
+    const size_t matcher = dag.Add(5. * work_us, 1, matcher_dependencies);
+    const size_t local_a = dag.Add(work_us, 2, {matcher});
+    const size_t local_b = dag.Add(work_us, 2, {matcher});
+    const size_t local_c = dag.Add(work_us, 2, {matcher});
+    const size_t global = dag.Add(4. * work_us, 3, {matcher});
+    finished_nodes.push_back(
+        dag.Add(0.5 * work_us, 4, {local_a, local_b, local_c, global}));
+    if (finished_nodes.size() == kNodesPerOptimization &&
+        static_cast<int>(dag.nodes.size()) < num_tasks) {
+      last_optimization = dag.Add(40. * work_us, 5, finished_nodes);
+      has_optimization = true;
+      finished_nodes.clear();
+    }
+  }
+  return dag;
+}
+
+Dag MakeDag(const std::string& name, const int num_tasks, const double work_us) {
+  if (name == "chain") return MakeChain(num_tasks, work_us);
+  if (name == "fanout") return MakeFanOut(num_tasks, work_us);
+  if (name == "fanin") return MakeFanIn(num_tasks, work_us);
+  if (name == "layered") return MakeLayered(num_tasks, work_us);
+  if (name == "mixed") return MakeMixed(num_tasks, work_us);
+  std::fprintf(stderr, "Unknown graph '%s'.\n", name.c_str());
+  std::exit(EXIT_FAILURE);
+}
+
+// Counts completed runs of a graph; its sink task signals it.
+struct RunCounter {
+    absl::Mutex mutex;
+    int runs GUARDED_BY(mutex) = 0;
+    // Runs of each node, every slot is only written by its own task.
+    std::vector<int> node_runs;
+};
+
+// Builds 'dag' with a sink that depends on every node without dependents.
+std::unique_ptr<TaskGraphTemplate> BuildTemplate(const Dag& dag,
+                                                 RunCounter* counter) {
+  TaskGraph graph;
+  graph.Reserve(dag.nodes.size() + 1, dag.nodes.size() * 2);
+  counter->node_runs.assign(dag.nodes.size(), 0);
+  std::vector<bool> has_dependents(dag.nodes.size(), false);
+  for (const Dag::Node& node : dag.nodes) {
+    const double work_us = node.work_us;
+    int* const node_runs = &counter->node_runs[graph.size()];
+    const TaskGraph::NodeId id = graph.AddTask(
+        [work_us, node_runs]() {
+          Spin(work_us);
+          ++*node_runs;
+        },
+        "", node.type);
+    for (size_t dependency : node.dependencies) {
+      graph.AddDependency(id, dependency);
+      has_dependents[dependency] = true;
+    }
+  }
+  const TaskGraph::NodeId sink = graph.AddTask([counter]() {
+    absl::MutexLock locker(&counter->mutex);
+    ++counter->runs;
+  });
+  for (size_t i = 0; i != dag.nodes.size(); ++i) {
+    if (!has_dependents[i]) graph.AddDependency(sink, i);
+  }
+  return std::unique_ptr<TaskGraphTemplate>(new TaskGraphTemplate(std::move(graph)));
+}
+
+std::unique_ptr<ThreadPoolInterface> MakePool(const std::string& backend,
+                                              const int num_threads) {
+  if (backend == "threadpool") {
+    return std::unique_ptr<ThreadPoolInterface>(
+        new ThreadPool(ThreadPoolOptions::Foreground("bench", num_threads)));
+  }
+  if (backend == "ctpl") {
+    return std::unique_ptr<ThreadPoolInterface>(new CtplThreadPool(num_threads));
+  }
+  if (backend == "inline") {
+    return std::unique_ptr<ThreadPoolInterface>(new InlineThreadPool());
+  }
+  std::fprintf(stderr, "Unknown backend '%s'.\n", backend.c_str());
+  std::exit(EXIT_FAILURE);
+}
+
+// Every node must have run once per run of the graph, or the measured
+// makespan means nothing.
+void CheckEveryNodeRan(RunCounter* counter) {
+  int runs;
+  {
+    absl::MutexLock locker(&counter->mutex);
+    runs = counter->runs;
+  }
+  for (size_t i = 0; i != counter->node_runs.size(); ++i) {
+    if (counter->node_runs[i] != runs) {
+      std::fprintf(stderr, "Node %zu ran %d times in %d runs.\n", i,
+                   counter->node_runs[i], runs);
+      std::exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Best makespan in seconds over 'repeats' runs, after one warm-up run.
+double MeasureMakespan(ThreadPoolInterface* pool, TaskGraphTemplate* graph,
+                       RunCounter* counter, const int repeats) {
+  double best = 0.;
+  for (int run = 0; run <= repeats; ++run) {
+    int target;
+    {
+      absl::MutexLock locker(&counter->mutex);
+      target = counter->runs + 1;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    pool->Schedule(graph);
+    {
+      absl::MutexLock locker(&counter->mutex);
+      const auto done = [counter, target]() EXCLUSIVE_LOCKS_REQUIRED(counter->mutex) {
+        return counter->runs >= target;
+      };
+      counter->mutex.Await(absl::Condition(&done));
+    }
+    const double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count();
+    // The sink may finish before the last tasks are marked completed.
+    while (!graph->IsDone()) {
+      std::this_thread::yield();
+    }
+    CheckEveryNodeRan(counter);
+    if (run > 0 && (best == 0. || seconds < best)) best = seconds;
+  }
+  return best;
+}
+
+std::vector<std::string> Split(const std::string& value) {
+  std::vector<std::string> parts;
+  std::stringstream stream(value);
+  std::string part;
+  while (std::getline(stream, part, ',')) {
+    if (!part.empty()) parts.push_back(part);
+  }
+  return parts;
+}
+
+Flags ParseFlags(const int argc, char** argv) {
+  Flags flags;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const size_t equals = arg.find('=');
+    const std::string name = arg.substr(0, equals);
+    const std::string value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (name == "--graphs") {
+      flags.graphs = Split(value);
+    } else if (name == "--tasks") {
+      flags.tasks = std::atoi(value.c_str());
+    } else if (name == "--work_us") {
+      flags.work_us = std::atof(value.c_str());
+    } else if (name == "--threads") {
+      flags.threads.clear();
+      for (const std::string& threads : Split(value)) {
+        flags.threads.push_back(std::atoi(threads.c_str()));
+      }
+    } else if (name == "--repeats") {
+      flags.repeats = std::atoi(value.c_str());
+    } else if (name == "--backend") {
+      flags.backend = value;
+    } else {
+      std::fprintf(stderr,
+                   "Usage: %s [--graphs=chain,fanout,fanin,layered,mixed] "
+                   "[--tasks=N] [--work_us=US] [--threads=1,2,4] [--repeats=N] "
+                   "[--backend=threadpool|ctpl|inline]\n",
+                   argv[0]);
+      std::exit(EXIT_FAILURE);
+    }
+  }
+  if (flags.backend == "inline") flags.threads = {1};
+  return flags;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const Flags flags = ParseFlags(argc, argv);
+  std::printf("backend %s, %d tasks of %.1fus, best of %d runs\n",
+              flags.backend.c_str(), flags.tasks, flags.work_us, flags.repeats);
+  std::printf("%-8s %7s %7s %12s %12s %6s %8s %14s\n", "graph", "tasks",
+              "threads", "makespan_ms", "ideal_ms", "eff", "speedup",
+              "overhead_us/t");
+  for (const std::string& graph_name : flags.graphs) {
+    const Dag dag = MakeDag(graph_name, flags.tasks, flags.work_us);
+    const double total_work_sec = dag.TotalWorkUs() * 1e-6;
+    const double critical_path_sec = dag.CriticalPathUs() * 1e-6;
+    const int num_tasks = static_cast<int>(dag.nodes.size());
+
+    RunCounter counter;
+    const auto build_start = std::chrono::steady_clock::now();
+    std::unique_ptr<TaskGraphTemplate> graph = BuildTemplate(dag, &counter);
+    const double build_us =
+        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() -
+                                                  build_start).count();
+
+    double first_makespan = 0.;
+    for (const int num_threads : flags.threads) {
+      std::unique_ptr<ThreadPoolInterface> pool = MakePool(flags.backend, num_threads);
+      const double makespan =
+          MeasureMakespan(pool.get(), graph.get(), &counter, flags.repeats);
+      const double ideal =
+          std::max(total_work_sec / num_threads, critical_path_sec);
+      if (first_makespan == 0.) first_makespan = makespan;
+      std::printf("%-8s %7d %7d %12.3f %12.3f %6.2f %8.2f %14.3f\n",
+                  graph_name.c_str(), num_tasks, num_threads, makespan * 1e3,
+                  ideal * 1e3, makespan > 0. ? ideal / makespan : 0.,
+                  makespan > 0. ? first_makespan / makespan : 0.,
+                  (makespan - ideal) * num_threads / num_tasks * 1e6);
+    }
+    std::printf("%-8s build and link: %.3fus per task\n", graph_name.c_str(),
+                build_us / num_tasks);
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef CARTOGRAPHER_COMMON_CTPL_THREAD_POOL_H_
+#define CARTOGRAPHER_COMMON_CTPL_THREAD_POOL_H_
+
+#include <memory>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "ctpl_stl.h"
+#include "task.h"
+#include "thread_pool.h"
+
+
+// Runs tasks on a ctpl::thread_pool (../CTPL/include/ctpl_stl.h): every task
+// that becomes ready is pushed to the ctpl queue, so ready tasks run in FIFO
+// order instead of by critical path. Meant to compare the scheduling overhead
+// and behavior of both pools on the same task graphs.
+//
+// As with ThreadPool, all scheduled tasks must have completed before the
+// destructor is called.
+// 基于 ctpl::thread_pool 执行任务图
+class CtplThreadPool : public ThreadPoolInterface {
+public:
+    // 'governor', if set, limits the threads running tasks together with the
+    // other pools sharing it, see ctpl::thread_pool::set_governor().
+    explicit CtplThreadPool(int num_threads,
+                            ctpl::cpu_governor* governor = nullptr);
+    ~CtplThreadPool();
+
+    CtplThreadPool(const CtplThreadPool&) = delete;
+    CtplThreadPool& operator=(const CtplThreadPool&) = delete;
+
+    std::weak_ptr<Task> Schedule(std::unique_ptr<Task> task)
+        LOCKS_EXCLUDED(mutex_) override;
+    using ThreadPoolInterface::Schedule;
+
+    int num_threads() { return pool_.size(); }
+
+private:
+    void ScheduleTasks(const std::vector<std::shared_ptr<Task>>& tasks,
+                       const std::vector<bool>* shared)
+        LOCKS_EXCLUDED(mutex_) override;
+    void NotifyDependenciesCompleted(Task* task) LOCKS_EXCLUDED(mutex_) override;
+    void ReleaseCancelledTasks(const std::vector<Task*>& tasks)
+        LOCKS_EXCLUDED(mutex_) override;
+
+    // Hands 'task', which is ready, to 'pool_'.
+    void Push(std::shared_ptr<Task> task);
+
+    absl::Mutex mutex_;
+    absl::flat_hash_map<Task*, std::shared_ptr<Task>> tasks_not_ready_
+        GUARDED_BY(mutex_);
+    ctpl::thread_pool pool_;
+};
+#endif
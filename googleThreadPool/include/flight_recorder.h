@@ -0,0 +1,94 @@
+#ifndef CARTOGRAPHER_COMMON_FLIGHT_RECORDER_H_
+#define CARTOGRAPHER_COMMON_FLIGHT_RECORDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+// Always-on record of what the thread pools did last: every thread appends
+// compact binary events to its own lock-free ring buffer, overwriting the
+// oldest ones. Recording an event costs a clock read and a few relaxed
+// stores, so it can stay enabled in production. The buffers are dumped on
+// demand, with Dump() or by a signal (InstallSignalHandler()), and decoded
+// with tools/flight_recorder_decode.
+//
+//   FlightRecorder::InstallSignalHandler(SIGUSR2, "/tmp/pool.flight");
+//   $ kill -USR2 <pid> && flight_recorder_decode /tmp/pool.flight
+// 线程池事件的"黑匣子"：常开的每线程无锁环形缓冲区，可通过 API 或信号导出
+class FlightRecorder {
+public:
+    enum EventKind : uint8_t {
+        SCHEDULE = 1,  // The task was handed to a pool. 'arg': 0.
+        READY,         // Its dependencies completed. 'arg': ready queue size.
+        START,         // Its work item starts. 'arg': task type.
+        END,           // Its work item returned. 'arg': task type.
+        STEAL,         // A waiting thread took it, see ThreadPool::Wait(). 'arg': 0.
+        PARK,          // A worker found no work and sleeps. 'arg': worker id.
+        UNPARK,        // The worker woke up. 'arg': worker id.
+        CANCEL,        // The task was cancelled before it ran. 'arg': 0.
+    };
+
+    // Events per thread; the last ones of every thread are kept.
+    static constexpr uint32_t kEventsPerThread = 4096;
+
+    // Recording is on by default.
+    static void SetEnabled(bool enabled) {
+        enabled_.store(enabled, std::memory_order_relaxed);
+    }
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Appends an event to the calling thread's buffer. 'arg' is truncated to
+    // 56 bits.
+    static void Record(EventKind kind, const void* object, uint64_t arg = 0) {
+        if (enabled()) RecordEvent(kind, object, arg);
+    }
+
+    // Writes all buffers to 'path' in the format below. Returns false if the
+    // file can not be written.
+    static bool Dump(const std::string& path);
+
+    // Dumps to 'path' whenever 'signal_number' is received. Only async-signal
+    // safe calls are made in the handler.
+    static void InstallSignalHandler(int signal_number, const std::string& path);
+
+    // Dump file format, little endian as written by the process: a FileHeader,
+    // then for every thread a ThreadHeader followed by 'capacity' Events. The
+    // events of a thread are a ring: event i, for 'head' - 'capacity' <= i <
+    // 'head', is at index i % 'capacity'.
+    // 导出文件格式
+    static constexpr uint32_t kMagic = 0x52465054;  // "TPFR"
+    static constexpr uint32_t kVersion = 1;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t event_size;
+        uint32_t num_threads;
+        uint64_t dump_time_ns;  // Same clock as the event timestamps.
+    };
+
+    struct ThreadHeader {
+        uint32_t thread_index;  // In order of the first recorded event.
+        uint32_t capacity;
+        uint64_t head;  // Number of events recorded by the thread so far.
+        char name[16];  // Thread name, as set by ThreadPoolOptions.
+    };
+
+    struct Event {
+        uint64_t time_ns;  // CLOCK_MONOTONIC.
+        uint64_t object;   // Task address.
+        uint64_t kind_and_arg;  // kind | arg << 8
+
+        EventKind kind() const { return static_cast<EventKind>(kind_and_arg & 0xff); }
+        uint64_t arg() const { return kind_and_arg >> 8; }
+    };
+
+    static const char* KindName(EventKind kind);
+
+private:
+    static void RecordEvent(EventKind kind, const void* object, uint64_t arg);
+
+    static std::atomic<bool> enabled_;
+};
+#endif
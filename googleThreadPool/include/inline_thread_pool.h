@@ -0,0 +1,53 @@
+#ifndef CARTOGRAPHER_COMMON_INLINE_THREAD_POOL_H_
+#define CARTOGRAPHER_COMMON_INLINE_THREAD_POOL_H_
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "task.h"
+#include "thread_pool.h"
+
+
+// Runs tasks synchronously on the thread that schedules them, without any
+// worker thread. Schedule() returns once the scheduled tasks and everything
+// they made ready have run, in the order they became ready. This makes runs
+// deterministic and free of threading overhead, e.g. to benchmark the work of
+// a task graph apart from the scheduling cost of ThreadPool.
+//
+// Tasks scheduled from a work item are queued and run by the outermost
+// Schedule(). Tasks made ready by tasks of other pools are run by the next
+// Schedule() or RunPending() on any thread.
+// 同步执行任务的线程池：在调用 Schedule() 的线程上依次执行所有就绪任务
+class InlineThreadPool : public ThreadPoolInterface {
+public:
+    InlineThreadPool() = default;
+    ~InlineThreadPool();
+
+    InlineThreadPool(const InlineThreadPool&) = delete;
+    InlineThreadPool& operator=(const InlineThreadPool&) = delete;
+
+    std::weak_ptr<Task> Schedule(std::unique_ptr<Task> task)
+        LOCKS_EXCLUDED(mutex_) override;
+    using ThreadPoolInterface::Schedule;
+
+    // Runs the tasks that are ready, unless another thread is doing so.
+    void RunPending() LOCKS_EXCLUDED(mutex_);
+
+private:
+    void ScheduleTasks(const std::vector<std::shared_ptr<Task>>& tasks,
+                       const std::vector<bool>* shared)
+        LOCKS_EXCLUDED(mutex_) override;
+    void NotifyDependenciesCompleted(Task* task) LOCKS_EXCLUDED(mutex_) override;
+    void ReleaseCancelledTasks(const std::vector<Task*>& tasks)
+        LOCKS_EXCLUDED(mutex_) override;
+
+    absl::Mutex mutex_;
+    bool running_tasks_ GUARDED_BY(mutex_) = false;  // 某个线程正在执行就绪任务
+    std::deque<std::shared_ptr<Task>> task_queue_ GUARDED_BY(mutex_);  // 就绪任务，先进先出
+    absl::flat_hash_map<Task*, std::shared_ptr<Task>> tasks_not_ready_
+        GUARDED_BY(mutex_);
+};
+#endif
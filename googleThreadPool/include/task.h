@@ -1,10 +1,16 @@
 #ifndef CARTOGRAPHER_COMMON_TASK_H_
 #define CARTOGRAPHER_COMMON_TASK_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <set>
+#include <vector>
 #include "absl/synchronization/mutex.h"
 #include "glog/logging.h"
+#include "task_metrics.h"
 #include "thread_pool.h"
+#include "work_item.h"
 
 
 class ThreadPoolInterface;
@@ -12,17 +18,21 @@ class ThreadPoolInterface;
 class Task {
 public:
     friend class ThreadPoolInterface;
+    friend class ThreadPool;
+    friend class TaskGraph;
+    friend class TaskGraphTemplate;
 
-    using WorkItem = std::function<void()>;
+    // Move-only, see work_item.h. Lambdas and std::functions convert to it.
+    using WorkItem = ::WorkItem;
     enum State { NEW, DISPATCHED, DEPENDENCIES_COMPLETED, RUNNING, COMPLETED };
 
     Task() = default;
-    ~Task();
+    virtual ~Task();  // TypedTask<T> stores results in derived classes.
 
     State GetState() LOCKS_EXCLUDED(mutex_);  // 返回本Task当前状态
 
-    // State must be 'NEW'.
-    void SetWorkItem(const WorkItem& work_item) LOCKS_EXCLUDED(mutex_);  // 设置Task 执行的任务 （函数）
+    // State must be 'NEW'. The callable is moved in, never copied.
+    void SetWorkItem(WorkItem&& work_item) LOCKS_EXCLUDED(mutex_);  // 设置Task 执行的任务 （函数）
 
     // State must be 'NEW'. 'dependency' may be nullptr, in which case it is
     // assumed completed.
@@ -31,9 +41,39 @@ public:
     void AddDependency(std::weak_ptr<Task> dependency) LOCKS_EXCLUDED(mutex_);
     void AddTaskInfo(const std::string& task_info, const int type=0) LOCKS_EXCLUDED(mutex_);
     std::string getTaskInfo() LOCKS_EXCLUDED(mutex_);
+    bool IsCancelled() const { return cancelled_.load(std::memory_order_acquire); }
+    // Same as GetState() == COMPLETED, without taking the lock, so that it can
+    // be checked in the condition of another mutex.
+    bool IsCompleted() const { return completed_.load(std::memory_order_acquire); }
+
+    // Estimated cost in seconds of the longest path from the start of this task
+    // to the end of the graph below it: the estimated run time of this task plus
+    // the largest critical path cost among its dependents. Ready tasks with the
+    // largest value are dispatched first.
+    // 关键路径代价估计：本任务的估计运行时间 + 下游依赖任务中最长的关键路径代价
+    // 'type_' is only written by AddTaskInfo() before the task is scheduled.
+    double CriticalPathCost() const NO_THREAD_SAFETY_ANALYSIS;
+
+    // Per-type run time estimate used for critical path costs. It starts at
+    // 'kDefaultRunTimeSec' and is refined with the observed run times of
+    // executed tasks of the same 'type_'.
+    static constexpr int kMaxTaskTypes = TaskMetrics::kMaxTaskTypes;
+    static constexpr double kDefaultRunTimeSec = 1e-3;
+    static double EstimatedRunTime(int type);
+    static void RecordRunTime(int type, double run_time_sec);
+
+    // AddDependency() raises the cost of the new dependency right away, but the
+    // raise reaches the tasks further upstream, and the ready queues of the
+    // raised ready tasks, only here. Pools call this before picking a ready
+    // task. Collecting the raises makes building a chain top-down linear: the
+    // newest raise walks the chain once, and the older ones stop at their
+    // first dependency, whose cost did not change.
+    // 批量向上游传播关键路径代价
+    static void PropagateCriticalPathCosts();
 
 private:
-    // Allowed in all states.
+    // Allowed in all states. If this task was cancelled, 'dependent_task' is
+    // cancelled too instead of being added.
     // AddDependency 功能具体实现函数
     // 添加依赖本Task的Task，如b依赖a，则a-->b， a.AddDependentTask(b), 根据a的状态，改变b的状态
     // 如果a完成，则b的依赖-1；（并把当前任务b，加入到依赖任务a的 dependent_tasks_ 列表中，以便执行a后，对应更改b的状态）。
@@ -41,26 +81,88 @@ private:
 
     // State must be 'DEPENDENCIES_COMPLETED' and becomes 'COMPLETED'.
     // 执行当前任务，比如当前任务为a，并依此更新依赖a的任务dependent_tasks_中所有任务状态，如依赖a的b。
-    void Execute() LOCKS_EXCLUDED(mutex_);
-    void  Remove()  LOCKS_EXCLUDED(mutex_);
+    // If 'continuation_pool' is not null and exactly one dependent of that
+    // pool becomes ready, the pool is not notified and the dependent is
+    // returned instead, for the caller to run it right away.
+    // 若恰好只有一个依赖任务就绪，则直接返回它，由当前线程接着执行
+    Task* Execute(ThreadPoolInterface* continuation_pool = nullptr)
+        LOCKS_EXCLUDED(mutex_);
+    // Cancels this task unless it is already 'RUNNING' or 'COMPLETED'. The
+    // work item will not run and dependents are not notified; they are
+    // appended to 'dependents' so the caller can remove them as well.
+    // A 'DISPATCHED' task becomes 'COMPLETED' right away and '*thread_pool'
+    // is set to the pool that still owns it. A 'NEW' task stays 'NEW' and
+    // becomes 'COMPLETED' without running when it is scheduled, a
+    // 'DEPENDENCIES_COMPLETED' one when the pool gets to it. Returns false if
+    // it was too late or already cancelled.
+    // 取消当前任务（不执行 work_item_，也不通知依赖它的任务）
+    bool Remove(std::vector<Task*>* dependents, ThreadPoolInterface** thread_pool)
+        LOCKS_EXCLUDED(mutex_);
+    // Removes this cancelled task from the 'dependent_tasks_' of its
+    // dependencies, which may still complete and must not touch it anymore.
+    // Tasks of a TaskGraphTemplate stay linked: the template keeps them alive
+    // and runs them again.
+    void UnlinkFromDependencies() LOCKS_EXCLUDED(mutex_);
     // State must be 'NEW' and becomes 'DISPATCHED' or 'DEPENDENCIES_COMPLETED'.
     // 当前任务进入线程待执行队列
     void SetThreadPool(ThreadPoolInterface* thread_pool) LOCKS_EXCLUDED(mutex_);
+    // Same as SetThreadPool(), but leaves notifying the thread pool to the
+    // caller. Returns true if the task became 'DEPENDENCIES_COMPLETED'.
+    bool Dispatch(ThreadPoolInterface* thread_pool) LOCKS_EXCLUDED(mutex_);
+    // Same as Dispatch(), without taking 'mutex_', for a task that nobody
+    // else can reach yet.
+    bool DispatchUnlocked(ThreadPoolInterface* thread_pool)
+        NO_THREAD_SAFETY_ANALYSIS;
 
     // State must be 'NEW' or 'DISPATCHED'. If 'DISPATCHED', may become
-    // 'DEPENDENCIES_COMPLETED'.
+    // 'DEPENDENCIES_COMPLETED'. The thread pool is notified unless it is
+    // 'deferring_pool', in which case true is returned and notifying it is up
+    // to the caller.
     // 当前任务的依赖任务完成时候，当前任务状态随之改变
-    void OnDependenyCompleted();
+    bool OnDependenyCompleted(ThreadPoolInterface* deferring_pool = nullptr);
+
+    // State must be 'NEW' or 'COMPLETED' and becomes 'NEW', waiting for
+    // 'num_dependencies' dependencies again. The dependents and dependencies
+    // of the template are kept and a cancellation of the previous run is
+    // cleared. Used to run a TaskGraphTemplate again.
+    void Reset(unsigned int num_dependencies) LOCKS_EXCLUDED(mutex_);
+
+    // Raises the downstream cost of this task to 'dependent_cost' if it is
+    // larger and returns whether it did. Allowed in all states.
+    // 新增依赖任务后，提高本任务的下游代价
+    bool RaiseDownstreamCost(double dependent_cost);
+    // Queues the raise of 'task' for PropagateCriticalPathCosts(), unless it
+    // is queued already.
+    static void DeferCostPropagation(const std::shared_ptr<Task>& task);
+
+    // Sets 'state_' to 'COMPLETED' and publishes it to IsCompleted().
+    void SetCompleted() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
     WorkItem work_item_ GUARDED_BY(mutex_);  // 任务具体执行过程
     ThreadPoolInterface* thread_pool_to_notify_ GUARDED_BY(mutex_) = nullptr;  // 执行当前任务的线程池
     State state_ GUARDED_BY(mutex_) = NEW;  // 初始化状态为 NEW
     unsigned int uncompleted_dependencies_ GUARDED_BY(mutex_) = 0;  // 当前任务依赖的任务的数量
     std::set<Task*> dependent_tasks_ GUARDED_BY(mutex_);  // 依赖当前任务的任务列表
+    // Dependents from outside of the TaskGraphTemplate of this task, also in
+    // 'dependent_tasks_'. Dropped once this task completed.
+    std::set<Task*> outside_dependents_ GUARDED_BY(mutex_);
+    std::vector<std::weak_ptr<Task>> dependencies_ GUARDED_BY(mutex_);  // 当前任务依赖的任务列表
+    std::atomic<double> downstream_cost_{0.};  // 下游关键路径代价（秒）
+    std::atomic<bool> cost_propagation_deferred_{false};  // 已排队等待向上游传播
+    std::atomic<bool> cancelled_{false};  // 任务已被取消
+    std::atomic<bool> completed_{false};  // state_ == COMPLETED，无锁读取
 
     std::chrono::steady_clock::time_point add_time_;
+    std::chrono::steady_clock::time_point dispatch_time_ GUARDED_BY(mutex_);  // 进入 DISPATCHED 的时间
+    std::chrono::steady_clock::time_point ready_time_ GUARDED_BY(mutex_);  // 进入 DEPENDENCIES_COMPLETED 的时间
+    // Priority and sequence number of the live entry of this task in the ready
+    // queue of a ThreadPool, guarded by the mutex of that pool. The priority is
+    // < 0 if the task is not queued.
+    double ready_priority_ = -1.;
+    uint64_t ready_sequence_ = 0;
+    bool in_template_ GUARDED_BY(mutex_) = false;  // 属于 TaskGraphTemplate，可重复执行
     std::string info_ GUARDED_BY(mutex_);
-    int         type_ GUARDED_BY(mutex_);//0:default; 1:create fast matcher; 2: local constrain; 3: global constrain 4: finish one node; 5: spa
+    int         type_ GUARDED_BY(mutex_) = 0;//0:default; 1:create fast matcher; 2: local constrain; 3: global constrain 4: finish one node; 5: spa
     absl::Mutex mutex_;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#ifndef CARTOGRAPHER_COMMON_TASK_GRAPH_H_
+#define CARTOGRAPHER_COMMON_TASK_GRAPH_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "task.h"
+#include "typed_task.h"
+
+
+// Collects tasks and the dependencies between them without taking any lock,
+// so a whole graph can be handed to ThreadPoolInterface::Schedule(TaskGraph)
+// in one step. Nodes are identified by the index returned from AddTask().
+// 先在本地构建整张任务图（不加锁），再一次性提交给线程池
+class TaskGraph {
+public:
+    using NodeId = size_t;
+
+    TaskGraph() = default;
+    TaskGraph(TaskGraph&&) = default;
+    TaskGraph& operator=(TaskGraph&&) = default;
+
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    // Adds a new task running 'work_item'. 'task_info' and 'type' have the same
+    // meaning as in Task::AddTaskInfo().
+    NodeId AddTask(Task::WorkItem work_item, const std::string& task_info = "",
+                   int type = 0);
+
+    // Adds a task built by the caller. It must be 'NEW' and may already depend
+    // on tasks outside of the graph.
+    NodeId AddTask(std::unique_ptr<Task> task);
+
+    // A node whose TypedTask produces a 'T'.
+    template <typename T>
+    struct Output {
+        NodeId node;
+    };
+
+    // Adds a TypedTask running 'function' with the results of 'inputs' as
+    // arguments, in order, after they completed. If the new task is the only
+    // consumer of every input and 'function' accepts rvalues, e.g. by value
+    // or by const reference, the results are moved out of the input tasks.
+    // Otherwise the arguments are lvalue references to the results stored in
+    // the input tasks, so 'function' may take them by const reference, or
+    // move from them if it is their only consumer. Inputs returning void can
+    // not be passed; order them with AddDependency() instead.
+    // 数据流任务：上游任务的返回值作为参数传入
+    //   auto a = graph.AddTypedTask([] { return LoadScan(); });
+    //   auto b = graph.AddTypedTask([] { return LoadMap(); });
+    //   graph.AddTypedTask([](const Scan& scan, const Map& map) {
+    //     return Match(scan, map); }, a, b);
+    template <typename F, typename... Inputs>
+    Output<typename std::decay<typename std::result_of<F&(Inputs&...)>::type>::type>
+    AddTypedTask(F function, Output<Inputs>... inputs);
+
+    // The task of 'output', e.g. to call AddTaskInfo() or to read its result
+    // once it completed. Keeping it also keeps the result alive, and no
+    // dependent moves it out then.
+    template <typename T>
+    std::shared_ptr<TypedTask<T>> GetTask(Output<T> output) const {
+        std::shared_ptr<TypedTask<T>> task = TypedTaskOf(output);
+        task->Share();
+        return task;
+    }
+
+    // 'dependent' runs after 'dependency' has completed, like
+    // dependent->AddDependency(dependency) for scheduled tasks.
+    void AddDependency(NodeId dependent, NodeId dependency);
+
+    void Reserve(size_t num_tasks, size_t num_dependencies);
+    size_t size() const { return tasks_.size(); }
+    bool empty() const { return tasks_.empty(); }
+
+private:
+    friend class ThreadPoolInterface;
+    friend class TaskGraphTemplate;
+
+    // Checks that the graph is acyclic, links the tasks to each other and
+    // computes their critical path costs. The graph is empty afterwards. The
+    // returned tasks are indexed by NodeId. If 'shared' is not null, it is set
+    // to whether each task can be reached from outside the graph, through an
+    // outside dependency of a task added with AddTask(std::unique_ptr<Task>)
+    // or of a task upstream of it.
+    std::vector<std::shared_ptr<Task>> Link(std::vector<bool>* shared = nullptr);
+
+    template <typename T>
+    std::shared_ptr<TypedTask<T>> TypedTaskOf(Output<T> output) const {
+        CHECK_LT(output.node, tasks_.size());
+        return std::static_pointer_cast<TypedTask<T>>(tasks_[output.node]);
+    }
+    // The task of 'input', counting the new dependent as a consumer.
+    template <typename T>
+    std::shared_ptr<TypedTask<T>> Consume(Output<T> input) {
+        std::shared_ptr<TypedTask<T>> task = TypedTaskOf(input);
+        task->AddConsumer();
+        return task;
+    }
+
+    std::vector<std::shared_ptr<Task>> tasks_;
+    std::vector<std::pair<NodeId, NodeId>> dependencies_;  // (dependency, dependent)
+    std::vector<NodeId> adopted_nodes_;  // added with AddTask(std::unique_ptr<Task>)
+};
+
+template <typename F, typename... Inputs>
+TaskGraph::Output<typename std::decay<typename std::result_of<F&(Inputs&...)>::type>::type>
+TaskGraph::AddTypedTask(F function, Output<Inputs>... inputs) {
+  using Result =
+      typename std::decay<typename std::result_of<F&(Inputs&...)>::type>::type;
+  using Producer = typed_task_internal::Producer<Result, F, Inputs...>;
+  static_assert(std::is_move_constructible<F>::value,
+                "The work item must be movable.");
+  auto task = std::make_shared<TypedTask<Result>>();
+  task->SetWorkItem(Producer(task.get(), std::move(function), Consume(inputs)...));
+  tasks_.push_back(std::move(task));
+  const NodeId node = tasks_.size() - 1;
+  const NodeId input_nodes[] = {inputs.node..., node};
+  for (size_t i = 0; i + 1 < sizeof(input_nodes) / sizeof(input_nodes[0]); ++i) {
+    // A fan-in may use the same input twice, it is still one dependency.
+    bool repeated = false;
+    for (size_t j = 0; j != i; ++j) {
+      repeated |= input_nodes[j] == input_nodes[i];
+    }
+    if (!repeated) {
+      AddDependency(node, input_nodes[i]);
+    }
+  }
+  return Output<Result>{node};
+}
+#endif
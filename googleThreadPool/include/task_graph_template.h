@@ -0,0 +1,43 @@
+#ifndef CARTOGRAPHER_COMMON_TASK_GRAPH_TEMPLATE_H_
+#define CARTOGRAPHER_COMMON_TASK_GRAPH_TEMPLATE_H_
+
+#include <memory>
+#include <vector>
+
+#include "task.h"
+#include "task_graph.h"
+
+
+// A TaskGraph that is linked once and then run any number of times through
+// ThreadPoolInterface::Schedule(TaskGraphTemplate*). Tasks, work items and
+// dependency sets are reused; each run only resets the dependency counters
+// and queues the roots. Work items read their inputs from state owned by the
+// caller (e.g. a struct they capture by pointer), which is updated between
+// runs. Cancelling one of its tasks only affects the current run.
+// 可重复执行的任务图模板：只构建一次，每次执行只重置依赖计数
+class TaskGraphTemplate {
+public:
+    explicit TaskGraphTemplate(TaskGraph graph);
+
+    TaskGraphTemplate(const TaskGraphTemplate&) = delete;
+    TaskGraphTemplate& operator=(const TaskGraphTemplate&) = delete;
+
+    // True if every task of the last run has completed, or it was never run.
+    bool IsDone() const;
+
+    // The task of 'node' as added to the TaskGraph. Its weak pointer does not
+    // expire between runs, use Task::GetState() instead. An outside task
+    // depending on it waits for the current or next run only.
+    std::weak_ptr<Task> task(TaskGraph::NodeId node) const { return tasks_[node]; }
+    size_t size() const { return tasks_.size(); }
+
+private:
+    friend class ThreadPoolInterface;
+
+    // Brings every task back to 'NEW'. The previous run must be done.
+    void Reset();
+
+    std::vector<std::shared_ptr<Task>> tasks_;
+    std::vector<unsigned int> num_dependencies_;  // 每个任务在图内的依赖数量
+};
+#endif
@@ -0,0 +1,80 @@
+#ifndef CARTOGRAPHER_COMMON_TASK_METRICS_H_
+#define CARTOGRAPHER_COMMON_TASK_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+// Histogram of durations with power-of-two buckets in microseconds. Add() is
+// lock-free and may be called from any thread.
+// 无锁的耗时直方图
+class DurationHistogram {
+public:
+    // Bucket 0 counts durations below 1us, bucket i > 0 durations in
+    // [2^(i-1), 2^i) us. The last bucket also takes everything above.
+    static constexpr int kNumBuckets = 32;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        double sum_sec = 0.;
+        double max_sec = 0.;
+        std::array<uint64_t, kNumBuckets> buckets{};
+
+        double Mean() const { return count == 0 ? 0. : sum_sec / count; }
+        // Upper bound of the bucket containing the 'quantile' (in [0, 1]).
+        double Percentile(double quantile) const;
+    };
+
+    DurationHistogram() = default;
+    DurationHistogram(const DurationHistogram&) = delete;
+    DurationHistogram& operator=(const DurationHistogram&) = delete;
+
+    void Add(double duration_sec);
+    Snapshot GetSnapshot() const;
+    void Reset();
+
+private:
+    std::array<std::atomic<uint64_t>, kNumBuckets> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_ns_{0};
+    std::atomic<uint64_t> max_ns_{0};
+};
+
+// Per-type timing of the tasks executed by one thread pool, filled in by
+// Task::Execute(). 'type' is the one given to Task::AddTaskInfo().
+// 按任务类型统计的各阶段耗时
+class TaskMetrics {
+public:
+    static constexpr int kMaxTaskTypes = 16;
+
+    enum Stage {
+        DISPATCHED,              // Scheduled until its dependencies completed.
+        DEPENDENCIES_COMPLETED,  // Waiting in the ready queue.
+        RUNNING,                 // Running the work item.
+        kNumStages
+    };
+
+    using Snapshot =
+        std::array<std::array<DurationHistogram::Snapshot, kNumStages>, kMaxTaskTypes>;
+
+    TaskMetrics() = default;
+    TaskMetrics(const TaskMetrics&) = delete;
+    TaskMetrics& operator=(const TaskMetrics&) = delete;
+
+    void Record(int type, Stage stage, double duration_sec);
+
+    Snapshot GetSnapshot() const;
+    void Reset();
+
+    // One line per type and stage that saw any task: count, mean, p50, p90,
+    // p99 and max in microseconds.
+    std::string ToString() const;
+
+    static const char* StageName(Stage stage);
+
+private:
+    std::array<std::array<DurationHistogram, kNumStages>, kMaxTaskTypes> histograms_;
+};
+#endif
@@ -0,0 +1,68 @@
+#ifndef CARTOGRAPHER_COMMON_TASK_TRACER_H_
+#define CARTOGRAPHER_COMMON_TASK_TRACER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+
+
+// Records when each task became ready, started and finished, and on which
+// thread, and exports it as Chrome trace-event JSON that chrome://tracing and
+// https://ui.perfetto.dev can open. Arrows connect each task to the
+// dependents it released.
+//
+// Every thread writes to its own ring buffer, so the pools do not contend on
+// the tracer; once a buffer is full the oldest events are overwritten. The
+// tracer is attached with ThreadPoolInterface::SetTracer() and must outlive
+// the tasks executed while it is attached.
+// 任务执行轨迹记录（每个线程一个环形缓冲区），导出为 Chrome trace 格式
+class TaskTracer {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    // 'events_per_thread' is the ring buffer size of every thread.
+    explicit TaskTracer(size_t events_per_thread = 1 << 16);
+    ~TaskTracer();
+
+    TaskTracer(const TaskTracer&) = delete;
+    TaskTracer& operator=(const TaskTracer&) = delete;
+
+    // Called by the executing thread, from Task::Execute().
+    void RecordExecution(const void* task, int type, const std::string& info,
+                         TimePoint dispatch_time, TimePoint ready_time,
+                         TimePoint start_time, TimePoint end_time);
+    // 'dependency' completed and released 'dependent'.
+    void RecordDependency(const void* dependency, const void* dependent);
+
+    // Drops all recorded events, e.g. between two runs.
+    void Clear() LOCKS_EXCLUDED(mutex_);
+
+    // Number of events lost because a ring buffer was full.
+    uint64_t NumDroppedEvents() const LOCKS_EXCLUDED(mutex_);
+
+    // The trace as a JSON object with a "traceEvents" array. Safe to call
+    // while tasks are running; events recorded concurrently may be missing.
+    std::string ToChromeTraceJson() const LOCKS_EXCLUDED(mutex_);
+    // Writes ToChromeTraceJson() to 'filename', returns false on failure.
+    bool WriteChromeTrace(const std::string& filename) const;
+
+private:
+    struct Event;
+    struct ThreadBuffer;
+
+    ThreadBuffer* GetThreadBuffer() LOCKS_EXCLUDED(mutex_);
+    void Append(const Event& event);
+
+    const size_t events_per_thread_;
+    const uint64_t id_;  // Distinguishes tracers reusing the same address.
+    const TimePoint origin_;  // Timestamps are relative to construction.
+
+    mutable absl::Mutex mutex_;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_ GUARDED_BY(mutex_);
+};
+#endif
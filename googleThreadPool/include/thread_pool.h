@@ -1,18 +1,28 @@
 #ifndef CARTOGRAPHER_COMMON_THREAD_POOL_H_
 #define CARTOGRAPHER_COMMON_THREAD_POOL_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <memory>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/synchronization/mutex.h"
+#include "ctpl_governor.h"
 #include "task.h"
+#include "task_metrics.h"
+#include "task_tracer.h"
 
 
 class Task;
+class TaskGraph;
+class TaskGraphTemplate;
 
 class ThreadPoolInterface {
 public:
@@ -20,25 +30,134 @@ public:
     virtual ~ThreadPoolInterface() {}
     virtual std::weak_ptr<Task> Schedule(std::unique_ptr<Task> task) = 0;
 
+    // Schedules all tasks of 'graph' in one step, after checking that it has
+    // no cycles. The returned weak pointers are indexed by TaskGraph::NodeId.
+    // 一次性提交整张任务图
+    std::vector<std::weak_ptr<Task>> Schedule(TaskGraph graph);
+
+    // Runs 'graph_template' once more. Its previous run must be done, see
+    // TaskGraphTemplate::IsDone().
+    // 重新执行一次任务图模板
+    void Schedule(TaskGraphTemplate* graph_template);
+
+    // Cancels 'task' and everything that depends on it, directly or not,
+    // before they run. Work is done only for the cancelled tasks. Returns
+    // false if 'task' has already started, completed or expired.
+    // 取消任务及其所有下游任务
+    bool Cancel(std::weak_ptr<Task> task);
+
+    // Timing of the tasks executed by this pool, recorded without locking.
+    // 本线程池执行任务的耗时统计
+    const TaskMetrics& metrics() const { return metrics_; }
+    TaskMetrics& metrics() { return metrics_; }
+
+    // Records the tasks executed by this pool into 'tracer' from now on, or
+    // stops recording if it is nullptr. Off by default.
+    // 设置任务轨迹记录器
+    void SetTracer(TaskTracer* tracer) {
+        tracer_.store(tracer, std::memory_order_release);
+    }
+
 protected:
     void Execute(Task* task);
+    // Executes 'task' and returns the single dependent it made ready, if any.
+    // That dependent is still waiting to be dispatched by this pool and has
+    // to be run by the caller next.
+    Task* ExecuteWithContinuation(Task* task);
     void SetThreadPool(Task* task);
+    // Like SetThreadPool(), but instead of notifying the pool returns whether
+    // the task is ready to run.
+    bool DispatchTask(Task* task);
+    // Same as DispatchTask(), for a task only reachable from the graph being
+    // scheduled, which is not locked.
+    bool DispatchPrivateTask(Task* task);
+    // For a task found cancelled after SetThreadPool() or DispatchTask(),
+    // instead of dropping it: its dependencies forget it, its dependents are
+    // cancelled as well rather than waiting for it forever, and the pool's
+    // reference is released.
+    void CancelDownstream(Task* task);
 
 private:
     friend class Task;
 
+    // Takes over 'tasks', which are linked to each other but not dispatched.
+    // 'shared' is indexed like 'tasks' and tells which of them other tasks
+    // may already notify, see TaskGraph::Link(). All of them if nullptr.
+    virtual void ScheduleTasks(const std::vector<std::shared_ptr<Task>>& tasks,
+                               const std::vector<bool>* shared) = 0;
     virtual void NotifyDependenciesCompleted(Task* task) = 0;
+    // Drops the pool's reference to cancelled tasks that were not ready yet.
+    // Tasks it does not know anymore are skipped.
+    virtual void ReleaseCancelledTasks(const std::vector<Task*>& tasks) = 0;
+    // Cancels the tasks of 'pending' and their dependents, after 'task' was
+    // cancelled. 'task' is released from 'thread_pool' if it is not null.
+    // Called with the cancellation mutex held.
+    static void CancelSubgraph(Task* task, ThreadPoolInterface* thread_pool,
+                               std::vector<Task*> pending);
+    // Called when the critical path of a queued task grew because dependents
+    // were added after it became ready.
+    virtual void NotifyPriorityRaised(const std::shared_ptr<Task>& /*task*/) {}
+
+    TaskMetrics metrics_;
+    std::atomic<TaskTracer*> tracer_{nullptr};
 };
 
-// A fixed number of threads working on tasks. Adding a task does not block.
+// How the worker threads of a ThreadPool are set up. Scheduling settings only
+// take effect on Linux.
+// 线程池的线程类别、调度策略、CPU 亲和性等配置
+struct ThreadPoolOptions {
+    enum ThreadClass { FOREGROUND, BACKGROUND };
+
+    // Foreground threads keep the default nice level, background threads are
+    // niced by 10 so they do not take CPU away from foreground work.
+    static ThreadPoolOptions Foreground(const std::string& name, int num_threads);
+    static ThreadPoolOptions Background(const std::string& name, int num_threads);
+
+    std::string name;  // Worker threads are named "<name>/<worker id>".
+    int num_threads = 1;
+    ThreadClass thread_class = BACKGROUND;
+    int nice_increment = 10;  // Passed to nice() by every worker thread.
+    // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, or with the required privileges
+    // SCHED_FIFO and SCHED_RR with 'sched_priority'.
+    int sched_policy = 0;
+    int sched_priority = 0;
+    std::vector<int> cpu_affinity;  // CPUs the workers may run on, empty for all.
+
+    // Automatic sizing, enabled if 'max_threads' > 0: a controller thread adds
+    // a worker whenever the oldest ready task has waited longer than
+    // 'grow_queue_wait_sec', and retires one whenever some worker was idle
+    // for 'idle_timeout_sec', staying within [min_threads, max_threads].
+    // 根据就绪队列的等待时间自动增减线程
+    int min_threads = 1;
+    int max_threads = 0;
+    double grow_queue_wait_sec = 2e-3;
+    double idle_timeout_sec = 1.;
+
+    // If set, workers hold one of its CPU tokens while they run tasks and give
+    // it back while parked or waiting in Wait(). Other threads helping in
+    // Wait() or WaitForIdle() hold one only while they run a task, see
+    // ../CTPL/include/ctpl_governor.h. Pools sharing a governor, e.g.
+    // ctpl::cpu_governor::global(), together run at most as many tasks as it
+    // has tokens. Not owned, must outlive the pool.
+    // 多个线程池共享的 CPU 令牌，防止线程总数超过核数
+    ctpl::cpu_governor* governor = nullptr;
+};
+
+// A pool of threads working on tasks. Adding a task does not block.
 // Tasks may be added whether or not their dependencies are completed.
 // When all dependencies of a task are completed, it is queued up for execution
-// in a background thread. The queue must be empty before calling the
-// destructor. The thread pool will then wait for the currently executing work
-// items to finish and then destroy the threads.
+// in a background thread. Ready tasks with the longest remaining critical path
+// (see Task::CriticalPathCost()) are executed first, ties in arrival order.
+// The number of threads can be changed at any time, see SetNumThreads() and
+// ThreadPoolOptions::max_threads.
+//
+// The queue must be empty before calling the destructor, e.g. by calling
+// WaitForIdle(). The thread pool will then wait for the currently executing
+// work items to finish and then destroy the threads.
 class ThreadPool : public ThreadPoolInterface {
 public:
     explicit ThreadPool(int num_threads);  // 初始化一个线程数量固定的线程池
+    explicit ThreadPool(const ThreadPoolOptions& options);
     ~ThreadPool();
 
     ThreadPool(const ThreadPool&) = delete;
@@ -49,16 +168,111 @@ public:
     std::weak_ptr<Task> Schedule(std::unique_ptr<Task> task)
         LOCKS_EXCLUDED(mutex_) override;  // 添加想要ThreadPool执行的task，插入tasks_not_ready_,
     // 如果任务满足执行要求，直接插入task_queue_准备执行
+    using ThreadPoolInterface::Schedule;
+
+    const ThreadPoolOptions& options() const { return options_; }
+
+    // Changes the number of worker threads. Missing workers are started right
+    // away; workers with an id >= 'num_threads' retire after their current
+    // task.
+    // 运行时增减线程数
+    void SetNumThreads(int num_threads) LOCKS_EXCLUDED(mutex_);
+    int NumThreads() LOCKS_EXCLUDED(mutex_);
+
+    // Blocks until 'task' has completed or was cancelled. Meanwhile the calling
+    // thread, a worker of any pool or not, runs ready tasks of this pool
+    // instead of sleeping. 'task' must have been scheduled, on this or
+    // another pool; an expired 'task' has completed already.
+    // 等待任务完成，等待期间当前线程帮助执行本线程池中就绪的任务
+    void Wait(std::weak_ptr<Task> task) LOCKS_EXCLUDED(mutex_);
+
+    // Blocks until no task of this pool is queued, waiting for dependencies or
+    // running, helping like Wait(). Must not be called from a task of this
+    // pool, which would wait for itself.
+    // 等待线程池空闲
+    void WaitForIdle() LOCKS_EXCLUDED(mutex_);
+
+    // Id in [0, num_threads) of the calling worker thread of any ThreadPool,
+    // or -1 if the caller is not a worker.
+    static int CurrentWorkerId();
 
 private:
-    void DoWork(); // 每个线程初始化时,执行DoWork()函数. 与线程绑定
-    void DoWork(const int thread_id);
+    // Entry of the ready queue. The priority is taken when the task becomes
+    // ready. NotifyPriorityRaised() adds another entry with the raised
+    // priority, the outdated one is dropped when it reaches the top.
+    struct ReadyTask {
+        double priority;
+        uint64_t sequence;
+        std::shared_ptr<Task> task;
+    };
+    struct ReadyTaskCompare {
+        bool operator()(const ReadyTask& a, const ReadyTask& b) const {
+            if (a.priority != b.priority) return a.priority < b.priority;
+            return a.sequence > b.sequence;
+        }
+    };
+
+    // A worker runs at most this many tasks in a row by inline continuation
+    // before handing the next one to the ready queue, so one long chain can
+    // not starve everything else.
+    static constexpr int kMaxInlineContinuations = 64;
+
+    // Runs 'task' and then, without queueing, the chain of single dependents
+    // it makes ready.
+    void ExecuteChain(std::shared_ptr<Task> task) LOCKS_EXCLUDED(mutex_);
+    // Removes 'task', which is ready, from 'tasks_not_ready_' without queueing
+    // it.
+    std::shared_ptr<Task> TakeContinuation(Task* task) LOCKS_EXCLUDED(mutex_);
+    // Moves 'task' from 'tasks_not_ready_' to the ready queue.
+    void PushReadyTask(Task* task) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    std::shared_ptr<Task> PopReadyTask() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    bool HasReadyTasks() const EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+        return task_queue_.size() > num_outdated_entries_;
+    }
+
+    // Runs ready tasks on the calling thread until 'done', which is evaluated
+    // with 'mutex_' held, returns true. If 'poll', 'done' is also checked
+    // every millisecond, for conditions that change without 'mutex_'.
+    void HelpUntil(const std::function<bool()>& done, bool poll)
+        LOCKS_EXCLUDED(mutex_);
+
+    // Applies 'options_' to the calling worker thread.
+    void SetUpWorkerThread(int thread_id);
+    void DoWork(const int thread_id); // 每个线程初始化时,执行DoWork()函数. 与线程绑定
+    // Workers that retired before are moved to 'retired_threads_', to be
+    // joined by the caller once 'mutex_' is released.
+    void SetNumThreadsLocked(int num_threads) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    // Body of the controller thread, see ThreadPoolOptions::max_threads.
+    void ControlNumThreads() LOCKS_EXCLUDED(mutex_);
+    void ScheduleTasks(const std::vector<std::shared_ptr<Task>>& tasks,
+                       const std::vector<bool>* shared)
+        LOCKS_EXCLUDED(mutex_) override;
     void NotifyDependenciesCompleted(Task* task) LOCKS_EXCLUDED(mutex_) override;
+    void ReleaseCancelledTasks(const std::vector<Task*>& tasks)
+        LOCKS_EXCLUDED(mutex_) override;
+    void NotifyPriorityRaised(const std::shared_ptr<Task>& task)
+        LOCKS_EXCLUDED(mutex_) override;
 
+    const ThreadPoolOptions options_;
     absl::Mutex mutex_;
     bool running_ GUARDED_BY(mutex_) = true;  // running_只是一个监视哨,只有线程池在running_状态时,才能往work_queue_加入函数.
-    std::vector<std::thread> pool_ GUARDED_BY(mutex_);
-    std::deque<std::shared_ptr<Task>> task_queue_ GUARDED_BY(mutex_);  // 准备执行的task
+    std::vector<std::thread> pool_ GUARDED_BY(mutex_);  // 下标即 worker id
+    std::vector<bool> worker_alive_ GUARDED_BY(mutex_);  // worker 线程是否还在运行
+    std::vector<std::thread> retired_threads_ GUARDED_BY(mutex_);  // 已退出、待在锁外 join 的线程
+    int num_threads_ GUARDED_BY(mutex_) = 0;  // 期望的线程数，id 不小于它的线程空闲时退出
+    int num_idle_workers_ GUARDED_BY(mutex_) = 0;
+    int num_executing_ GUARDED_BY(mutex_) = 0;  // 正在执行任务链的线程数（包括帮忙的线程）
+    std::thread controller_;
+    std::vector<ReadyTask> task_queue_ GUARDED_BY(mutex_);  // 准备执行的task，按 ReadyTaskCompare 组织的堆
+    uint64_t next_sequence_ GUARDED_BY(mutex_) = 0;
+    size_t num_outdated_entries_ GUARDED_BY(mutex_) = 0;  // 优先级提高后被取代的旧条目
+    // Ready time of the tasks by sequence number, starting at
+    // 'first_ready_sequence_', and whether they are still queued. The front is
+    // the oldest queued task, for ControlNumThreads().
+    // 按入队顺序记录就绪时间，队首即等待最久的任务
+    std::deque<std::pair<std::chrono::steady_clock::time_point, bool>> ready_times_
+        GUARDED_BY(mutex_);
+    uint64_t first_ready_sequence_ GUARDED_BY(mutex_) = 0;
     absl::flat_hash_map<Task*, std::shared_ptr<Task>> tasks_not_ready_
         GUARDED_BY(mutex_);  // 未准备好的 task，task可能有依赖还未完成
 };
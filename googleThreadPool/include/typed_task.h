@@ -0,0 +1,159 @@
+#ifndef CARTOGRAPHER_COMMON_TYPED_TASK_H_
+#define CARTOGRAPHER_COMMON_TYPED_TASK_H_
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "glog/logging.h"
+#include "task.h"
+
+
+// A task whose work item returns a 'T', which is stored in the task itself.
+// Dependents created with TaskGraph::AddTypedTask() receive it as an argument
+// of their work item, by reference or moved out if they are its only
+// consumer, so no promise or shared state is allocated to pass results along
+// the graph.
+// 带返回值的任务：结果保存在任务节点中，直接作为参数传给下游任务
+template <typename T>
+class TypedTask : public Task {
+public:
+    TypedTask() = default;
+    ~TypedTask() override { ClearResult(); }
+
+    // True once the work item returned, until the only consumer took the
+    // result. A TaskGraphTemplate keeps the result of the last run until the
+    // task runs again.
+    bool has_result() const { return has_result_; }
+
+    // The task must be 'COMPLETED' and not cancelled. Dependents may move the
+    // result out if they are its only consumer.
+    T& result() {
+        CHECK(has_result_);
+        return *reinterpret_cast<T*>(&storage_);
+    }
+
+    // Moves the result out and destroys what is left of it.
+    T TakeResult() {
+        T taken(std::move(result()));
+        ClearResult();
+        return taken;
+    }
+
+    // True if a single dependent reads the result and nobody else asked for
+    // the task, see TaskGraph::GetTask(). Only changes while the graph is
+    // built.
+    bool has_only_consumer() const { return num_consumers_ == 1 && !shared_; }
+    void AddConsumer() { ++num_consumers_; }
+    void Share() { shared_ = true; }
+
+    // Runs 'function' with 'args' and stores its return value. Called by the
+    // work item on the worker thread.
+    template <typename F, typename... Args>
+    void Emplace(F& function, Args&&... args) {
+        ClearResult();
+        new (&storage_) T(function(std::forward<Args>(args)...));
+        has_result_ = true;
+    }
+
+private:
+    void ClearResult() {
+        if (has_result_) {
+            reinterpret_cast<T*>(&storage_)->~T();
+            has_result_ = false;
+        }
+    }
+
+    // Written by the work item only; the task's state transitions order it
+    // with its dependents and with GetState().
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+    bool has_result_ = false;
+    int num_consumers_ = 0;  // 以本任务结果为参数的下游任务数量
+    bool shared_ = false;  // 已通过 TaskGraph::GetTask() 交给调用方
+};
+
+// Typed tasks without a result, e.g. the sinks of a graph.
+template <>
+class TypedTask<void> : public Task {
+public:
+    template <typename F, typename... Args>
+    void Emplace(F& function, Args&&... args) {
+        function(std::forward<Args>(args)...);
+    }
+};
+
+namespace typed_task_internal {
+
+template <size_t... Indices>
+struct IndexSequence {};
+
+template <size_t N, size_t... Indices>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indices...> {};
+
+template <size_t... Indices>
+struct MakeIndexSequence<0, Indices...> {
+    using type = IndexSequence<Indices...>;
+};
+
+// Whether 'F' can be called with 'Args'.
+template <typename F, typename... Args>
+struct IsCallable {
+    template <typename G>
+    static auto Test(int)
+        -> decltype((void)std::declval<G&>()(std::declval<Args>()...),
+                    std::true_type());
+    template <typename G>
+    static std::false_type Test(...);
+    static constexpr bool value = decltype(Test<F>(0))::value;
+};
+
+// The work item of a TypedTask<Result>: calls 'function' with the results of
+// 'inputs' and stores its return value in 'task'. If it is the only consumer
+// of all of them and 'function' takes rvalues, the results are moved out of
+// the inputs, otherwise it gets lvalue references to them. Holding the
+// inputs keeps their results alive after the pool released them, until the
+// work item ran. A TaskGraphTemplate keeps them alive for the next runs.
+template <typename Result, typename F, typename... Inputs>
+class Producer {
+public:
+    Producer(TypedTask<Result>* task, F&& function,
+             std::shared_ptr<TypedTask<Inputs>>... inputs)
+        : task_(task), function_(std::move(function)), inputs_(inputs.get()...),
+          owned_inputs_(std::move(inputs)...) {}
+
+    void operator()() {
+        using Indices = typename MakeIndexSequence<sizeof...(Inputs)>::type;
+        Run(Indices(), std::integral_constant<bool, IsCallable<F, Inputs...>::value>());
+        // 释放上游任务，链式数据流的内存不随链长增长
+        owned_inputs_ = std::tuple<std::shared_ptr<TypedTask<Inputs>>...>();
+    }
+
+private:
+    template <size_t... Indices>
+    void Run(IndexSequence<Indices...> indices, std::true_type /*takes_rvalues*/) {
+        const bool only_consumer[] = {true, std::get<Indices>(inputs_)->has_only_consumer()...};
+        for (const bool only : only_consumer) {
+            if (!only) {
+                Run(indices, std::false_type());
+                return;
+            }
+        }
+        task_->Emplace(function_, std::get<Indices>(inputs_)->TakeResult()...);
+    }
+
+    template <size_t... Indices>
+    void Run(IndexSequence<Indices...>, std::false_type /*takes_rvalues*/) {
+        task_->Emplace(function_, std::get<Indices>(inputs_)->result()...);
+    }
+
+    TypedTask<Result>* task_;
+    F function_;
+    std::tuple<TypedTask<Inputs>*...> inputs_;
+    std::tuple<std::shared_ptr<TypedTask<Inputs>>...> owned_inputs_;
+};
+
+}  // namespace typed_task_internal
+#endif
@@ -0,0 +1,160 @@
+#ifndef CARTOGRAPHER_COMMON_WORK_ITEM_H_
+#define CARTOGRAPHER_COMMON_WORK_ITEM_H_
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+// A move-only 'void()' callable. Callables of up to 'kInlineSize' bytes that
+// can be moved without throwing are stored inline, larger ones in a single
+// heap allocation. Unlike std::function it never copies the callable, so
+// lambdas may capture large or move-only state (e.g. a point cloud moved in
+// with an init capture or std::bind) for free.
+// 只能移动的任务函数，小对象直接存放在内部缓冲区，避免拷贝和堆分配
+class WorkItem {
+public:
+    static constexpr size_t kInlineSize = 6 * sizeof(void*);
+
+    WorkItem() noexcept : ops_(nullptr) {}
+    WorkItem(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+    template <typename F,
+              typename = typename std::enable_if<!std::is_same<
+                  typename std::decay<F>::type, WorkItem>::value>::type>
+    WorkItem(F&& function) : ops_(nullptr) {
+        using Function = typename std::decay<F>::type;
+        if (IsEmpty(function)) return;
+        Construct<Function>(std::forward<F>(function),
+                            std::integral_constant<bool, kIsInline<Function>()>());
+    }
+
+    WorkItem(WorkItem&& other) noexcept : ops_(other.ops_) {
+        if (ops_ != nullptr) {
+            ops_->move(&other.storage_, &storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    WorkItem& operator=(WorkItem&& other) noexcept {
+        if (this != &other) {
+            Clear();
+            if (other.ops_ != nullptr) {
+                other.ops_->move(&other.storage_, &storage_);
+                ops_ = other.ops_;
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    WorkItem& operator=(std::nullptr_t) noexcept {
+        Clear();
+        return *this;
+    }
+
+    WorkItem(const WorkItem&) = delete;
+    WorkItem& operator=(const WorkItem&) = delete;
+
+    ~WorkItem() { Clear(); }
+
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    // Must not be empty. The callable stays, it may be called again.
+    void operator()() { ops_->invoke(&storage_); }
+
+    // Whether the callable is stored without a heap allocation.
+    bool is_inline() const noexcept { return ops_ != nullptr && ops_->is_inline; }
+
+private:
+    using Storage =
+        typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type;
+
+    struct Ops {
+        void (*invoke)(Storage* storage);
+        // Moves the callable from 'from' to the uninitialized 'to' and leaves
+        // 'from' destroyed.
+        void (*move)(Storage* from, Storage* to);
+        void (*destroy)(Storage* storage);
+        bool is_inline;
+    };
+
+    template <typename Function>
+    static constexpr bool kIsInline() {
+        return sizeof(Function) <= kInlineSize &&
+               alignof(std::max_align_t) % alignof(Function) == 0 &&
+               std::is_nothrow_move_constructible<Function>::value;
+    }
+
+    template <typename Function>
+    struct InlineOps {
+        static Function* Get(Storage* storage) {
+            return reinterpret_cast<Function*>(storage);
+        }
+        static void Invoke(Storage* storage) { (*Get(storage))(); }
+        static void Move(Storage* from, Storage* to) {
+            new (to) Function(std::move(*Get(from)));
+            Get(from)->~Function();
+        }
+        static void Destroy(Storage* storage) { Get(storage)->~Function(); }
+        static const Ops ops;
+    };
+
+    template <typename Function>
+    struct HeapOps {
+        static Function*& Get(Storage* storage) {
+            return *reinterpret_cast<Function**>(storage);
+        }
+        static void Invoke(Storage* storage) { (*Get(storage))(); }
+        static void Move(Storage* from, Storage* to) {
+            new (to) Function*(Get(from));
+        }
+        static void Destroy(Storage* storage) { delete Get(storage); }
+        static const Ops ops;
+    };
+
+    template <typename Function, typename F>
+    void Construct(F&& function, std::true_type /* inline */) {
+        new (&storage_) Function(std::forward<F>(function));
+        ops_ = &InlineOps<Function>::ops;
+    }
+
+    template <typename Function, typename F>
+    void Construct(F&& function, std::false_type /* inline */) {
+        new (&storage_) Function*(new Function(std::forward<F>(function)));
+        ops_ = &HeapOps<Function>::ops;
+    }
+
+    // Empty std::functions and null function pointers give an empty WorkItem.
+    template <typename F>
+    static bool IsEmpty(const F&) { return false; }
+    template <typename Signature>
+    static bool IsEmpty(const std::function<Signature>& function) {
+        return !function;
+    }
+    template <typename Result>
+    static bool IsEmpty(Result (*function)()) { return function == nullptr; }
+
+    void Clear() noexcept {
+        if (ops_ != nullptr) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    const Ops* ops_;
+    Storage storage_;
+};
+
+template <typename Function>
+const WorkItem::Ops WorkItem::InlineOps<Function>::ops = {
+    &InlineOps<Function>::Invoke, &InlineOps<Function>::Move,
+    &InlineOps<Function>::Destroy, true};
+
+template <typename Function>
+const WorkItem::Ops WorkItem::HeapOps<Function>::ops = {
+    &HeapOps<Function>::Invoke, &HeapOps<Function>::Move,
+    &HeapOps<Function>::Destroy, false};
+#endif
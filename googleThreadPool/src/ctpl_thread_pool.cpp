@@ -0,0 +1,112 @@
+#include "ctpl_thread_pool.h"
+
+#include "glog/logging.h"
+
+
+CtplThreadPool::CtplThreadPool(const int num_threads,
+                               ctpl::cpu_governor* const governor)
+    : pool_(num_threads) {
+  CHECK_GT(num_threads, 0);
+  pool_.set_governor(governor);
+}
+
+CtplThreadPool::~CtplThreadPool() {
+  // Runs what is still queued and joins the threads while 'this' is intact.
+  pool_.stop(true);
+  absl::MutexLock locker(&mutex_);
+  LOG_IF(WARNING, !tasks_not_ready_.empty())
+      << "~CtplThreadPool: " << tasks_not_ready_.size()
+      << " tasks never became ready.";
+}
+
+void CtplThreadPool::Push(std::shared_ptr<Task> task) {
+  // The task is owned by the queued function until it has run.
+  pool_.post([this, task](int /* thread id */) {
+    // Keeps the deferred cost raises from piling up until kMaxDeferredCosts.
+    Task::PropagateCriticalPathCosts();
+    Execute(task.get());
+  });
+}
+
+std::weak_ptr<Task> CtplThreadPool::Schedule(std::unique_ptr<Task> task) {
+  std::shared_ptr<Task> shared_task;
+  {
+    absl::MutexLock locker(&mutex_);
+    auto insert_result =
+        tasks_not_ready_.insert(std::make_pair(task.get(), std::move(task)));
+    CHECK(insert_result.second) << "Schedule called twice";
+    shared_task = insert_result.first->second;
+  }
+  SetThreadPool(shared_task.get());
+  if (shared_task->IsCancelled()) {
+    CancelDownstream(shared_task.get());
+  }
+  return shared_task;
+}
+
+void CtplThreadPool::ScheduleTasks(
+    const std::vector<std::shared_ptr<Task>>& tasks,
+    const std::vector<bool>* /*shared*/) {
+  {
+    absl::MutexLock locker(&mutex_);
+    tasks_not_ready_.reserve(tasks_not_ready_.size() + tasks.size());
+    for (const std::shared_ptr<Task>& task : tasks) {
+      CHECK(tasks_not_ready_.insert(std::make_pair(task.get(), task)).second)
+          << "Schedule called twice";
+    }
+  }
+  std::vector<std::shared_ptr<Task>> ready_tasks;
+  {
+    std::vector<Task*> dispatched_tasks;
+    std::vector<Task*> cancelled_tasks;
+    for (const std::shared_ptr<Task>& task : tasks) {
+      if (DispatchTask(task.get())) {
+        dispatched_tasks.push_back(task.get());
+      } else if (task->IsCancelled()) {
+        cancelled_tasks.push_back(task.get());
+      }
+    }
+    for (Task* task : cancelled_tasks) {
+      CancelDownstream(task);
+    }
+    absl::MutexLock locker(&mutex_);
+    for (Task* task : dispatched_tasks) {
+      auto it = tasks_not_ready_.find(task);
+      CHECK(it != tasks_not_ready_.end());
+      ready_tasks.push_back(std::move(it->second));
+      tasks_not_ready_.erase(it);
+    }
+  }
+  for (std::shared_ptr<Task>& task : ready_tasks) {
+    Push(std::move(task));
+  }
+}
+
+void CtplThreadPool::NotifyDependenciesCompleted(Task* task) {
+  std::shared_ptr<Task> ready_task;
+  {
+    absl::MutexLock locker(&mutex_);
+    auto it = tasks_not_ready_.find(task);
+    CHECK(it != tasks_not_ready_.end());
+    ready_task = std::move(it->second);
+    tasks_not_ready_.erase(it);
+  }
+  Push(std::move(ready_task));
+}
+
+void CtplThreadPool::ReleaseCancelledTasks(const std::vector<Task*>& tasks) {
+  std::vector<std::shared_ptr<Task>> released_tasks;
+  released_tasks.reserve(tasks.size());
+  {
+    absl::MutexLock locker(&mutex_);
+    for (Task* task : tasks) {
+      auto it = tasks_not_ready_.find(task);
+      if (it == tasks_not_ready_.end()) {
+        continue;  // Cancelled right after it was dispatched, released already.
+      }
+      released_tasks.push_back(std::move(it->second));
+      tasks_not_ready_.erase(it);
+    }
+  }
+  // The tasks are destroyed here, outside of the lock.
+}
@@ -0,0 +1,212 @@
+#include "flight_recorder.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include "glog/logging.h"
+
+
+constexpr uint32_t FlightRecorder::kEventsPerThread;
+constexpr uint32_t FlightRecorder::kMagic;
+constexpr uint32_t FlightRecorder::kVersion;
+
+std::atomic<bool> FlightRecorder::enabled_{true};
+
+namespace {
+
+constexpr int kWordsPerEvent = 3;
+static_assert(sizeof(FlightRecorder::Event) == kWordsPerEvent * sizeof(uint64_t),
+              "Events are written word by word.");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "Buffers are dumped as raw memory.");
+
+// Written by its thread only. Readers may see an event half written, which
+// the 'head' published after the event makes unlikely and which only affects
+// the oldest and newest entries of a dump.
+struct ThreadBuffer {
+  uint32_t index = 0;
+  char name[16] = {};
+  std::atomic<bool> in_use{true};
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> words[FlightRecorder::kEventsPerThread * kWordsPerEvent];
+  ThreadBuffer* next = nullptr;  // Immutable once published.
+};
+
+// Buffers are never freed, so that a dump can be taken at any time, even from
+// a signal handler. Buffers of exited threads are reused by new threads.
+std::atomic<ThreadBuffer*> buffers{nullptr};
+std::atomic<uint32_t> num_buffers{0};
+
+// Gives the buffer of the current thread back when the thread exits.
+struct BufferOwner {
+  ThreadBuffer* buffer = nullptr;
+  ~BufferOwner() {
+    if (buffer != nullptr) {
+      buffer->in_use.store(false, std::memory_order_release);
+    }
+  }
+};
+thread_local BufferOwner buffer_owner;
+
+void SetThreadName(ThreadBuffer* buffer) {
+  std::memset(buffer->name, 0, sizeof(buffer->name));
+#ifdef __linux__
+  pthread_getname_np(pthread_self(), buffer->name, sizeof(buffer->name));
+#endif
+}
+
+ThreadBuffer* AcquireBuffer() {
+  for (ThreadBuffer* buffer = buffers.load(std::memory_order_acquire);
+       buffer != nullptr; buffer = buffer->next) {
+    bool in_use = false;
+    if (buffer->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire)) {
+      // The events of the exited thread must not show up under the new name.
+      buffer->head.store(0, std::memory_order_release);
+      for (auto& word : buffer->words) {
+        word.store(0, std::memory_order_relaxed);
+      }
+      SetThreadName(buffer);
+      return buffer;
+    }
+  }
+  ThreadBuffer* buffer = new ThreadBuffer();
+  for (auto& word : buffer->words) {
+    word.store(0, std::memory_order_relaxed);
+  }
+  buffer->index = num_buffers.fetch_add(1, std::memory_order_relaxed);
+  SetThreadName(buffer);
+  buffer->next = buffers.load(std::memory_order_relaxed);
+  while (!buffers.compare_exchange_weak(buffer->next, buffer,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+  return buffer;
+}
+
+uint64_t NowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000u + now.tv_nsec;
+}
+
+// Only async-signal safe calls from here on, Dump() is used by the handler.
+bool WriteAll(const int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool DumpToFile(const char* path) {
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  FlightRecorder::FileHeader file_header;
+  std::memset(&file_header, 0, sizeof(file_header));
+  file_header.magic = FlightRecorder::kMagic;
+  file_header.version = FlightRecorder::kVersion;
+  file_header.event_size = sizeof(FlightRecorder::Event);
+  ThreadBuffer* const first = buffers.load(std::memory_order_acquire);
+  for (ThreadBuffer* buffer = first; buffer != nullptr; buffer = buffer->next) {
+    ++file_header.num_threads;
+  }
+  file_header.dump_time_ns = NowNs();
+  bool ok = WriteAll(fd, &file_header, sizeof(file_header));
+  for (ThreadBuffer* buffer = first; ok && buffer != nullptr;
+       buffer = buffer->next) {
+    FlightRecorder::ThreadHeader thread_header;
+    std::memset(&thread_header, 0, sizeof(thread_header));
+    thread_header.thread_index = buffer->index;
+    thread_header.capacity = FlightRecorder::kEventsPerThread;
+    thread_header.head = buffer->head.load(std::memory_order_acquire);
+    std::memcpy(thread_header.name, buffer->name, sizeof(thread_header.name));
+    ok = WriteAll(fd, &thread_header, sizeof(thread_header)) &&
+         WriteAll(fd, buffer->words, sizeof(buffer->words));
+  }
+  return close(fd) == 0 && ok;
+}
+
+char signal_dump_path[4096];
+
+void DumpOnSignal(int /* signal_number */) {
+  const int saved_errno = errno;
+  DumpToFile(signal_dump_path);
+  errno = saved_errno;
+}
+
+}  // namespace
+
+void FlightRecorder::RecordEvent(const EventKind kind, const void* object,
+                                 const uint64_t arg) {
+  ThreadBuffer* buffer = buffer_owner.buffer;
+  if (buffer == nullptr) {
+    buffer = buffer_owner.buffer = AcquireBuffer();
+  }
+  const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  std::atomic<uint64_t>* const event =
+      &buffer->words[(head % kEventsPerThread) * kWordsPerEvent];
+  event[0].store(NowNs(), std::memory_order_relaxed);
+  event[1].store(reinterpret_cast<uintptr_t>(object), std::memory_order_relaxed);
+  event[2].store(static_cast<uint64_t>(kind) | arg << 8,
+                 std::memory_order_relaxed);
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+bool FlightRecorder::Dump(const std::string& path) {
+  const bool ok = DumpToFile(path.c_str());
+  LOG_IF(WARNING, !ok) << "Failed to dump the flight recorder to " << path;
+  return ok;
+}
+
+void FlightRecorder::InstallSignalHandler(const int signal_number,
+                                          const std::string& path) {
+  CHECK_LT(path.size(), sizeof(signal_dump_path));
+  std::memcpy(signal_dump_path, path.c_str(), path.size() + 1);
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = &DumpOnSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  CHECK_EQ(sigaction(signal_number, &action, nullptr), 0);
+}
+
+const char* FlightRecorder::KindName(const EventKind kind) {
+  switch (kind) {
+    case SCHEDULE:
+      return "schedule";
+    case READY:
+      return "ready";
+    case START:
+      return "start";
+    case END:
+      return "end";
+    case STEAL:
+      return "steal";
+    case PARK:
+      return "park";
+    case UNPARK:
+      return "unpark";
+    case CANCEL:
+      return "cancel";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,117 @@
+#include "inline_thread_pool.h"
+
+#include "glog/logging.h"
+
+
+InlineThreadPool::~InlineThreadPool() {
+  absl::MutexLock locker(&mutex_);
+  CHECK(task_queue_.empty());
+  LOG_IF(WARNING, !tasks_not_ready_.empty())
+      << "~InlineThreadPool: " << tasks_not_ready_.size()
+      << " tasks never became ready.";
+}
+
+std::weak_ptr<Task> InlineThreadPool::Schedule(std::unique_ptr<Task> task) {
+  std::shared_ptr<Task> shared_task;
+  {
+    absl::MutexLock locker(&mutex_);
+    auto insert_result =
+        tasks_not_ready_.insert(std::make_pair(task.get(), std::move(task)));
+    CHECK(insert_result.second) << "Schedule called twice";
+    shared_task = insert_result.first->second;
+  }
+  SetThreadPool(shared_task.get());
+  if (shared_task->IsCancelled()) {
+    CancelDownstream(shared_task.get());
+  }
+  RunPending();
+  return shared_task;
+}
+
+void InlineThreadPool::ScheduleTasks(
+    const std::vector<std::shared_ptr<Task>>& tasks,
+    const std::vector<bool>* /*shared*/) {
+  {
+    absl::MutexLock locker(&mutex_);
+    tasks_not_ready_.reserve(tasks_not_ready_.size() + tasks.size());
+    for (const std::shared_ptr<Task>& task : tasks) {
+      CHECK(tasks_not_ready_.insert(std::make_pair(task.get(), task)).second)
+          << "Schedule called twice";
+    }
+  }
+  std::vector<Task*> ready_tasks;
+  std::vector<Task*> cancelled_tasks;
+  for (const std::shared_ptr<Task>& task : tasks) {
+    if (DispatchTask(task.get())) {
+      ready_tasks.push_back(task.get());
+    } else if (task->IsCancelled()) {
+      cancelled_tasks.push_back(task.get());
+    }
+  }
+  for (Task* task : cancelled_tasks) {
+    CancelDownstream(task);
+  }
+  {
+    absl::MutexLock locker(&mutex_);
+    for (Task* task : ready_tasks) {
+      auto it = tasks_not_ready_.find(task);
+      CHECK(it != tasks_not_ready_.end());
+      task_queue_.push_back(std::move(it->second));
+      tasks_not_ready_.erase(it);
+    }
+  }
+  RunPending();
+}
+
+void InlineThreadPool::RunPending() {
+  {
+    absl::MutexLock locker(&mutex_);
+    if (running_tasks_) {
+      // An outer call on this or another thread picks up the new tasks.
+      return;
+    }
+    running_tasks_ = true;
+  }
+  for (;;) {
+    // The queue is FIFO, but the costs of tasks scheduled elsewhere are
+    // still raised in time, as ThreadPool does before picking a task.
+    Task::PropagateCriticalPathCosts();
+    std::shared_ptr<Task> task;
+    {
+      absl::MutexLock locker(&mutex_);
+      if (task_queue_.empty()) {
+        running_tasks_ = false;
+        return;
+      }
+      task = std::move(task_queue_.front());
+      task_queue_.pop_front();
+    }
+    Execute(task.get());
+  }
+}
+
+void InlineThreadPool::NotifyDependenciesCompleted(Task* task) {
+  // Called with the lock of 'task' held, so it can not run here.
+  absl::MutexLock locker(&mutex_);
+  auto it = tasks_not_ready_.find(task);
+  CHECK(it != tasks_not_ready_.end());
+  task_queue_.push_back(std::move(it->second));
+  tasks_not_ready_.erase(it);
+}
+
+void InlineThreadPool::ReleaseCancelledTasks(const std::vector<Task*>& tasks) {
+  std::vector<std::shared_ptr<Task>> released_tasks;
+  released_tasks.reserve(tasks.size());
+  {
+    absl::MutexLock locker(&mutex_);
+    for (Task* task : tasks) {
+      auto it = tasks_not_ready_.find(task);
+      if (it == tasks_not_ready_.end()) {
+        continue;  // Cancelled right after it was dispatched, released already.
+      }
+      released_tasks.push_back(std::move(it->second));
+      tasks_not_ready_.erase(it);
+    }
+  }
+  // The tasks are destroyed here, outside of the lock.
+}
@@ -1,6 +1,59 @@
 #include "task.h"
 #include "iostream"
 
+#include "flight_recorder.h"
+
+constexpr int Task::kMaxTaskTypes;
+constexpr double Task::kDefaultRunTimeSec;
+
+namespace {
+
+// Exponentially weighted moving average of the run time of each task type.
+// A negative value means no task of this type has been observed yet.
+constexpr double kRunTimeSmoothing = 0.125;
+
+struct RunTimeEstimate {
+  std::atomic<double> sec{-1.};
+};
+RunTimeEstimate estimated_run_time[Task::kMaxTaskTypes];
+
+// Tasks whose downstream cost was raised and not yet propagated upstream, see
+// Task::PropagateCriticalPathCosts(). Beyond 'kMaxDeferredCosts' the raises
+// are propagated right away, in case no pool picks tasks for a while.
+constexpr size_t kMaxDeferredCosts = 4096;
+ABSL_CONST_INIT absl::Mutex deferred_costs_mutex(absl::kConstInit);
+std::vector<std::weak_ptr<Task>>* deferred_costs
+    GUARDED_BY(deferred_costs_mutex) = nullptr;
+std::atomic<size_t> num_deferred_costs{0};
+
+std::atomic<double>& RunTimeSlot(const int type) {
+  return estimated_run_time[(type >= 0 && type < Task::kMaxTaskTypes) ? type : 0]
+      .sec;
+}
+
+}  // namespace
+
+double Task::EstimatedRunTime(const int type) {
+  const double estimate = RunTimeSlot(type).load(std::memory_order_relaxed);
+  return estimate < 0. ? kDefaultRunTimeSec : estimate;
+}
+
+void Task::RecordRunTime(const int type, const double run_time_sec) {
+  std::atomic<double>& slot = RunTimeSlot(type);
+  double estimate = slot.load(std::memory_order_relaxed);
+  double updated;
+  do {
+    updated = estimate < 0. ? run_time_sec
+                            : estimate + kRunTimeSmoothing * (run_time_sec - estimate);
+  } while (!slot.compare_exchange_weak(estimate, updated,
+                                       std::memory_order_relaxed));
+}
+
+double Task::CriticalPathCost() const {
+  return EstimatedRunTime(type_) +
+         downstream_cost_.load(std::memory_order_relaxed);
+}
+
 Task::~Task() {
   // TODO(gaschler): Relax some checks after testing.
   if (state_ != NEW && state_ != COMPLETED) {
@@ -17,6 +70,11 @@ Task::~Task() {
   }
 }
 
+void Task::SetCompleted() {
+  state_ = COMPLETED;
+  completed_.store(true, std::memory_order_release);
+}
+
 void Task::AddTaskInfo(const std::string& task_info, const int type)
 {
     absl::MutexLock locker(&mutex_);
@@ -38,10 +96,10 @@ Task::State Task::GetState() {
   return state_;
 }
 
-void Task::SetWorkItem(const WorkItem& work_item) {
+void Task::SetWorkItem(WorkItem&& work_item) {
   absl::MutexLock locker(&mutex_);
   CHECK_EQ(state_, NEW);
-  work_item_ = work_item;
+  work_item_ = std::move(work_item);
 }
 
 void Task::AddDependency(std::weak_ptr<Task> dependency) {
@@ -54,87 +112,307 @@ void Task::AddDependency(std::weak_ptr<Task> dependency) {
     }
   }
   if (shared_dependency) {
+    {
+      absl::MutexLock locker(&mutex_);
+      dependencies_.push_back(shared_dependency);
+    }
     shared_dependency->AddDependentTask(this);
+    if (shared_dependency->RaiseDownstreamCost(CriticalPathCost())) {
+      DeferCostPropagation(shared_dependency);
+    }
+  }
+}
+
+bool Task::RaiseDownstreamCost(const double dependent_cost) {
+  double current = downstream_cost_.load(std::memory_order_relaxed);
+  while (dependent_cost > current) {
+    if (downstream_cost_.compare_exchange_weak(current, dependent_cost,
+                                               std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Task::DeferCostPropagation(const std::shared_ptr<Task>& task) {
+  if (task->cost_propagation_deferred_.exchange(true)) {
+    return;
+  }
+  size_t num_deferred;
+  {
+    absl::MutexLock locker(&deferred_costs_mutex);
+    if (deferred_costs == nullptr) {
+      deferred_costs = new std::vector<std::weak_ptr<Task>>();
+    }
+    deferred_costs->push_back(task);
+    num_deferred = deferred_costs->size();
+    num_deferred_costs.store(num_deferred, std::memory_order_release);
+  }
+  if (num_deferred > kMaxDeferredCosts) {
+    PropagateCriticalPathCosts();
+  }
+}
+
+void Task::PropagateCriticalPathCosts() {
+  if (num_deferred_costs.load(std::memory_order_acquire) == 0) {
+    return;
+  }
+  std::vector<std::weak_ptr<Task>> deferred;
+  {
+    absl::MutexLock locker(&deferred_costs_mutex);
+    deferred.swap(*deferred_costs);
+    num_deferred_costs.store(0, std::memory_order_relaxed);
+  }
+  // Walk upwards iteratively, deep chains would overflow the stack otherwise,
+  // and only as long as costs rise. The pools are notified after the task
+  // locks are released.
+  std::vector<std::pair<std::shared_ptr<Task>, ThreadPoolInterface*>>
+      raised_ready_tasks;
+  std::vector<std::shared_ptr<Task>> pending;
+  for (auto it = deferred.rbegin(); it != deferred.rend(); ++it) {
+    std::shared_ptr<Task> task = it->lock();
+    if (!task) {
+      continue;
+    }
+    // Raises from now on are deferred again.
+    task->cost_propagation_deferred_.store(false);
+    pending.push_back(std::move(task));
+    while (!pending.empty()) {
+      const std::shared_ptr<Task> raised_task = std::move(pending.back());
+      pending.pop_back();
+      absl::MutexLock locker(&raised_task->mutex_);
+      // Once a task is ready all its dependencies are completed, so only the
+      // queue it waits in needs to know.
+      if (raised_task->state_ == DEPENDENCIES_COMPLETED) {
+        CHECK(raised_task->thread_pool_to_notify_);
+        raised_ready_tasks.emplace_back(raised_task,
+                                        raised_task->thread_pool_to_notify_);
+      } else if (raised_task->state_ == NEW || raised_task->state_ == DISPATCHED) {
+        const double cost = raised_task->CriticalPathCost();
+        for (const std::weak_ptr<Task>& dependency : raised_task->dependencies_) {
+          std::shared_ptr<Task> shared_dependency = dependency.lock();
+          if (shared_dependency && shared_dependency->RaiseDownstreamCost(cost)) {
+            pending.push_back(std::move(shared_dependency));
+          }
+        }
+      }
+    }
+  }
+  for (const auto& raised_ready_task : raised_ready_tasks) {
+    raised_ready_task.second->NotifyPriorityRaised(raised_ready_task.first);
   }
 }
 
 void Task::SetThreadPool(ThreadPoolInterface* thread_pool) {
   absl::MutexLock locker(&mutex_);
   CHECK_EQ(state_, NEW);
+  if (cancelled_) {
+    SetCompleted();
+    return;
+  }
   state_ = DISPATCHED;
   thread_pool_to_notify_ = thread_pool;
+  dispatch_time_ = std::chrono::steady_clock::now();
   if (uncompleted_dependencies_ == 0) {
     state_ = DEPENDENCIES_COMPLETED;
+    ready_time_ = dispatch_time_;
     CHECK(thread_pool_to_notify_);
     thread_pool_to_notify_->NotifyDependenciesCompleted(this);
   }
 }
 
+void Task::Reset(const unsigned int num_dependencies) {
+  absl::MutexLock locker(&mutex_);
+  CHECK(state_ == NEW || state_ == COMPLETED);
+  cancelled_.store(false, std::memory_order_relaxed);
+  state_ = NEW;
+  completed_.store(false, std::memory_order_relaxed);
+  uncompleted_dependencies_ = num_dependencies;
+  thread_pool_to_notify_ = nullptr;
+}
+
+bool Task::Dispatch(ThreadPoolInterface* thread_pool) {
+  absl::MutexLock locker(&mutex_);
+  return DispatchUnlocked(thread_pool);
+}
+
+bool Task::DispatchUnlocked(ThreadPoolInterface* thread_pool) {
+  CHECK_EQ(state_, NEW);
+  if (cancelled_) {
+    SetCompleted();
+    return false;
+  }
+  state_ = DISPATCHED;
+  thread_pool_to_notify_ = thread_pool;
+  dispatch_time_ = std::chrono::steady_clock::now();
+  if (uncompleted_dependencies_ == 0) {
+    state_ = DEPENDENCIES_COMPLETED;
+    ready_time_ = dispatch_time_;
+    return true;
+  }
+  return false;
+}
 
 void Task::AddDependentTask(Task* dependent_task) {
   absl::MutexLock locker(&mutex_);
+  if (cancelled_) {
+    // A cancelled task never notifies its dependents, and must not look like
+    // it completed either. The late dependent is cancelled as well.
+    absl::MutexLock dependent_locker(&dependent_task->mutex_);
+    CHECK_EQ(dependent_task->state_, NEW);
+    dependent_task->cancelled_.store(true, std::memory_order_release);
+    return;
+  }
   if (state_ == COMPLETED) {
     dependent_task->OnDependenyCompleted();
     return;
   }
   bool inserted = dependent_tasks_.insert(dependent_task).second;
   CHECK(inserted) << "Given dependency is already a dependency.";
+  if (in_template_) {
+    // The tasks of the template are linked before 'in_template_' is set.
+    outside_dependents_.insert(dependent_task);
+  }
 }
 
-void Task::OnDependenyCompleted() {
+bool Task::OnDependenyCompleted(ThreadPoolInterface* deferring_pool) {
   absl::MutexLock locker(&mutex_);
+  if (cancelled_) {
+    return false;
+  }
   CHECK(state_ == NEW || state_ == DISPATCHED);
   --uncompleted_dependencies_;
   if (uncompleted_dependencies_ == 0 && state_ == DISPATCHED) {
     state_ = DEPENDENCIES_COMPLETED;
+    ready_time_ = std::chrono::steady_clock::now();
     CHECK(thread_pool_to_notify_);
+    if (thread_pool_to_notify_ == deferring_pool) {
+      return true;
+    }
     thread_pool_to_notify_->NotifyDependenciesCompleted(this);
   }
+  return false;
 }
 
-void Task::Execute() {
+Task* Task::Execute(ThreadPoolInterface* continuation_pool) {
+  const std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  int type;
+  ThreadPoolInterface* thread_pool;
+  std::chrono::steady_clock::time_point dispatch_time;
+  std::chrono::steady_clock::time_point ready_time;
+  TaskTracer* tracer;
+  std::string info;
   {
     absl::MutexLock locker(&mutex_);
     CHECK_EQ(state_, DEPENDENCIES_COMPLETED);
+    if (cancelled_) {
+      // Cancelled after it became ready; its dependents are gone already.
+      SetCompleted();
+      return nullptr;
+    }
     state_ = RUNNING;
+    type = type_;
+    thread_pool = thread_pool_to_notify_;
+    dispatch_time = dispatch_time_;
+    ready_time = ready_time_;
+    tracer = thread_pool->tracer_.load(std::memory_order_acquire);
+    if (tracer != nullptr) {
+      info = info_;
+    }
   }
 
-    // Execute the work item.
+  // Execute the work item.
+  FlightRecorder::Record(FlightRecorder::START, this, type);
   if (work_item_) {
-      std::chrono::steady_clock::time_point start_calc_time = std::chrono::steady_clock::now();
-      work_item_();
-      if(!info_.empty())
-      {
-          double time_cost_sec = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start_calc_time).count();
-          double stay_cost_sec = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - add_time_).count();
-          //LOG(INFO)<<"==> RUN Task: type "<<type_<<" time_cost: "<<time_cost_sec<<"  info: "<<info_<<" |stay_time "<<stay_cost_sec;
-          //std::cout<<"==> RUN task: "<<info_<<std::endl;;
-      }
+    work_item_();
+  }
+  FlightRecorder::Record(FlightRecorder::END, this, type);
+  const std::chrono::steady_clock::time_point end_time =
+      std::chrono::steady_clock::now();
+
+  // 记录各阶段耗时，不在线程池的锁内打印日志
+  const auto seconds = [](const std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::duration<double>>(duration)
+        .count();
+  };
+  const double time_cost_sec = seconds(end_time - start_time);
+  RecordRunTime(type, time_cost_sec);
+  TaskMetrics& metrics = thread_pool->metrics_;
+  metrics.Record(type, TaskMetrics::DISPATCHED,
+                 seconds(ready_time - dispatch_time));
+  metrics.Record(type, TaskMetrics::DEPENDENCIES_COMPLETED,
+                 seconds(start_time - ready_time));
+  metrics.Record(type, TaskMetrics::RUNNING, time_cost_sec);
+  if (tracer != nullptr) {
+    tracer->RecordExecution(this, type, info, dispatch_time, ready_time,
+                            start_time, end_time);
   }
 
   absl::MutexLock locker(&mutex_);
-  state_ = COMPLETED;
+  SetCompleted();
+  if (tracer != nullptr) {
+    for (Task* dependent_task : dependent_tasks_) {
+      tracer->RecordDependency(this, dependent_task);
+    }
+  }
+  // Without a 'continuation_pool' no dependent is returned.
+  std::vector<Task*> ready_tasks;
   for (Task* dependent_task : dependent_tasks_) {
-    dependent_task->OnDependenyCompleted();
+    if (dependent_task->OnDependenyCompleted(continuation_pool)) {
+      ready_tasks.push_back(dependent_task);
+    }
+  }
+  // Outside dependents of a TaskGraphTemplate task only wait for this run,
+  // they may be gone before the next one.
+  for (Task* outside_dependent : outside_dependents_) {
+    dependent_tasks_.erase(outside_dependent);
   }
+  outside_dependents_.clear();
+  if (ready_tasks.size() == 1) {
+    return ready_tasks.front();
+  }
+  for (Task* ready_task : ready_tasks) {
+    continuation_pool->NotifyDependenciesCompleted(ready_task);
+  }
+  return nullptr;
 }
 
 
-void Task::Remove() {
-  state_ = RUNNING;
-    // Execute the work item.
-  if (work_item_) {
-      //work_item_();
-      if(!info_.empty())
-      {
-          //LOG(INFO)<<"==>SKIP RUN task: "<<info_;
-          std::cout<<"==>SKIP RUN task: "<<info_<<std::endl;
-      }
+bool Task::Remove(std::vector<Task*>* dependents,
+                  ThreadPoolInterface** thread_pool) {
+  absl::MutexLock locker(&mutex_);
+  if (cancelled_ || state_ == RUNNING || state_ == COMPLETED) {
+    return false;
+  }
+  cancelled_.store(true, std::memory_order_release);
+  if (state_ == DISPATCHED) {
+    *thread_pool = thread_pool_to_notify_;
   }
+  if (state_ != DEPENDENCIES_COMPLETED && state_ != NEW) {
+    SetCompleted();
+  }
+  //LOG(INFO)<<"==>SKIP RUN task: "<<info_;
+  dependents->insert(dependents->end(), dependent_tasks_.begin(),
+                     dependent_tasks_.end());
+  return true;
+}
 
-  absl::MutexLock locker(&mutex_);
-  state_ = COMPLETED;
-  for (Task* dependent_task : dependent_tasks_) {
-    dependent_task->OnDependenyCompleted();
+void Task::UnlinkFromDependencies() {
+  std::vector<std::weak_ptr<Task>> dependencies;
+  {
+    absl::MutexLock locker(&mutex_);
+    if (in_template_) {
+      return;
+    }
+    dependencies.swap(dependencies_);
+  }
+  for (const std::weak_ptr<Task>& dependency : dependencies) {
+    std::shared_ptr<Task> shared_dependency = dependency.lock();
+    if (shared_dependency) {
+      absl::MutexLock locker(&shared_dependency->mutex_);
+      shared_dependency->dependent_tasks_.erase(this);
+      shared_dependency->outside_dependents_.erase(this);
+    }
   }
 }
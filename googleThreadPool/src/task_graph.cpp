@@ -0,0 +1,162 @@
+#include "task_graph.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "glog/logging.h"
+
+
+TaskGraph::NodeId TaskGraph::AddTask(Task::WorkItem work_item,
+                                     const std::string& task_info,
+                                     const int type) {
+  // The task is not shared with anyone yet, so there is nothing to lock.
+  auto task = std::make_shared<Task>();
+  task->work_item_ = std::move(work_item);
+  task->info_ = task_info;
+  task->type_ = type;
+  task->add_time_ = std::chrono::steady_clock::now();
+  tasks_.push_back(std::move(task));
+  return tasks_.size() - 1;
+}
+
+TaskGraph::NodeId TaskGraph::AddTask(std::unique_ptr<Task> task) {
+  CHECK(task);
+  CHECK_EQ(task->GetState(), Task::NEW);
+  tasks_.push_back(std::move(task));
+  adopted_nodes_.push_back(tasks_.size() - 1);
+  return tasks_.size() - 1;
+}
+
+void TaskGraph::AddDependency(const NodeId dependent, const NodeId dependency) {
+  CHECK_LT(dependent, tasks_.size());
+  CHECK_LT(dependency, tasks_.size());
+  dependencies_.emplace_back(dependency, dependent);
+}
+
+void TaskGraph::Reserve(const size_t num_tasks, const size_t num_dependencies) {
+  tasks_.reserve(num_tasks);
+  dependencies_.reserve(num_dependencies);
+}
+
+std::vector<std::shared_ptr<Task>> TaskGraph::Link(std::vector<bool>* shared) {
+  const size_t num_tasks = tasks_.size();
+
+  // Adjacency in compressed form: the dependents of node 'i' are
+  // dependents[first_dependent[i]] .. dependents[first_dependent[i + 1] - 1],
+  // and likewise for its dependencies.
+  std::vector<size_t> first_dependent(num_tasks + 1, 0);
+  std::vector<size_t> first_dependency(num_tasks + 1, 0);
+  for (const auto& edge : dependencies_) {
+    ++first_dependent[edge.first + 1];
+    ++first_dependency[edge.second + 1];
+  }
+  for (size_t i = 0; i != num_tasks; ++i) {
+    first_dependent[i + 1] += first_dependent[i];
+    first_dependency[i + 1] += first_dependency[i];
+  }
+  std::vector<NodeId> dependents(dependencies_.size());
+  std::vector<NodeId> dependencies(dependencies_.size());
+  {
+    std::vector<size_t> next_dependent(first_dependent.begin(),
+                                       first_dependent.end() - 1);
+    std::vector<size_t> next_dependency(first_dependency.begin(),
+                                        first_dependency.end() - 1);
+    for (const auto& edge : dependencies_) {
+      dependents[next_dependent[edge.first]++] = edge.second;
+      dependencies[next_dependency[edge.second]++] = edge.first;
+    }
+  }
+
+  // Kahn's algorithm, which also rejects cycles.
+  std::vector<NodeId> order;
+  order.reserve(num_tasks);
+  {
+    std::vector<size_t> remaining(num_tasks);
+    for (NodeId i = 0; i != num_tasks; ++i) {
+      remaining[i] = first_dependency[i + 1] - first_dependency[i];
+      if (remaining[i] == 0) order.push_back(i);
+    }
+    for (size_t head = 0; head != order.size(); ++head) {
+      const NodeId node = order[head];
+      for (size_t j = first_dependent[node]; j != first_dependent[node + 1]; ++j) {
+        if (--remaining[dependents[j]] == 0) order.push_back(dependents[j]);
+      }
+    }
+  }
+  CHECK_EQ(order.size(), num_tasks) << "TaskGraph contains a cycle.";
+
+  // Critical path costs, from the sinks upwards.
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    const NodeId node = *it;
+    double downstream_cost =
+        tasks_[node]->downstream_cost_.load(std::memory_order_relaxed);
+    for (size_t j = first_dependent[node]; j != first_dependent[node + 1]; ++j) {
+      downstream_cost =
+          std::max(downstream_cost, tasks_[dependents[j]]->CriticalPathCost());
+    }
+    tasks_[node]->downstream_cost_.store(downstream_cost,
+                                         std::memory_order_relaxed);
+  }
+
+  std::vector<std::shared_ptr<Task>> tasks;
+  tasks.swap(tasks_);
+
+  // Tasks added with AddTask(std::unique_ptr<Task>) may already be known to
+  // their outside dependencies, and once linked so are the tasks downstream
+  // of them, e.g. to cancel them. These are linked under their own lock.
+  // Nobody else knows the other tasks yet.
+  std::vector<bool> reachable(num_tasks, false);
+  for (const NodeId node : adopted_nodes_) {
+    reachable[node] = true;
+  }
+  for (const NodeId node : order) {
+    if (reachable[node]) {
+      for (size_t j = first_dependent[node]; j != first_dependent[node + 1]; ++j) {
+        reachable[dependents[j]] = true;
+      }
+    }
+  }
+  std::vector<std::pair<std::shared_ptr<Task>, double>> outside_dependencies;
+  for (NodeId node = 0; node != num_tasks; ++node) {
+    Task* task = tasks[node].get();
+    if (reachable[node]) {
+      task->mutex_.Lock();
+    }
+    for (const std::weak_ptr<Task>& dependency : task->dependencies_) {
+      std::shared_ptr<Task> shared_dependency = dependency.lock();
+      if (shared_dependency) {
+        outside_dependencies.emplace_back(std::move(shared_dependency),
+                                          task->CriticalPathCost());
+      }
+    }
+    task->uncompleted_dependencies_ +=
+        first_dependency[node + 1] - first_dependency[node];
+    task->dependencies_.reserve(task->dependencies_.size() +
+                                first_dependency[node + 1] -
+                                first_dependency[node]);
+    for (size_t j = first_dependency[node]; j != first_dependency[node + 1]; ++j) {
+      task->dependencies_.push_back(tasks[dependencies[j]]);
+    }
+    for (size_t j = first_dependent[node]; j != first_dependent[node + 1]; ++j) {
+      bool inserted =
+          task->dependent_tasks_.insert(tasks[dependents[j]].get()).second;
+      CHECK(inserted) << "Given dependency is already a dependency.";
+    }
+    if (reachable[node]) {
+      task->mutex_.Unlock();
+    }
+  }
+  // Outside dependencies keep their old downstream cost otherwise.
+  for (const auto& dependency : outside_dependencies) {
+    if (dependency.first->RaiseDownstreamCost(dependency.second)) {
+      Task::DeferCostPropagation(dependency.first);
+    }
+  }
+
+  if (shared != nullptr) {
+    shared->swap(reachable);
+  }
+  dependencies_.clear();
+  adopted_nodes_.clear();
+  return tasks;
+}
@@ -0,0 +1,35 @@
+#include "task_graph_template.h"
+
+#include "glog/logging.h"
+
+
+TaskGraphTemplate::TaskGraphTemplate(TaskGraph graph) {
+  for (const std::shared_ptr<Task>& task : graph.tasks_) {
+    absl::MutexLock locker(&task->mutex_);
+    CHECK(task->dependencies_.empty())
+        << "Tasks of a TaskGraphTemplate can not depend on outside tasks.";
+  }
+  tasks_ = graph.Link();
+  num_dependencies_.reserve(tasks_.size());
+  for (const std::shared_ptr<Task>& task : tasks_) {
+    absl::MutexLock locker(&task->mutex_);
+    task->in_template_ = true;
+    num_dependencies_.push_back(task->uncompleted_dependencies_);
+  }
+}
+
+bool TaskGraphTemplate::IsDone() const {
+  for (const std::shared_ptr<Task>& task : tasks_) {
+    const Task::State state = task->GetState();
+    if (state != Task::NEW && state != Task::COMPLETED) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TaskGraphTemplate::Reset() {
+  for (size_t i = 0; i != tasks_.size(); ++i) {
+    tasks_[i]->Reset(num_dependencies_[i]);
+  }
+}
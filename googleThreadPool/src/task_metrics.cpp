@@ -0,0 +1,134 @@
+#include "task_metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+
+constexpr int DurationHistogram::kNumBuckets;
+constexpr int TaskMetrics::kMaxTaskTypes;
+
+namespace {
+
+int BucketIndex(const uint64_t duration_ns) {
+  const uint64_t duration_us = duration_ns / 1000;
+  int index = 0;
+  while (index + 1 < DurationHistogram::kNumBuckets &&
+         (duration_us >> index) != 0) {
+    ++index;
+  }
+  return index;
+}
+
+double BucketUpperBoundSec(const int index) {
+  return static_cast<double>(uint64_t{1} << index) * 1e-6;
+}
+
+}  // namespace
+
+double DurationHistogram::Snapshot::Percentile(const double quantile) const {
+  if (count == 0) return 0.;
+  const double rank = quantile * count;
+  uint64_t seen = 0;
+  for (int i = 0; i != kNumBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank && buckets[i] != 0) {
+      return i + 1 == kNumBuckets ? max_sec
+                                  : std::min(BucketUpperBoundSec(i), max_sec);
+    }
+  }
+  return max_sec;
+}
+
+void DurationHistogram::Add(const double duration_sec) {
+  const uint64_t duration_ns =
+      duration_sec > 0. ? static_cast<uint64_t>(duration_sec * 1e9) : 0;
+  buckets_[BucketIndex(duration_ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(duration_ns, std::memory_order_relaxed);
+  uint64_t max_ns = max_ns_.load(std::memory_order_relaxed);
+  while (duration_ns > max_ns &&
+         !max_ns_.compare_exchange_weak(max_ns, duration_ns,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+DurationHistogram::Snapshot DurationHistogram::GetSnapshot() const {
+  // The fields are read one by one, so a snapshot taken while tasks finish
+  // may be off by the tasks recorded in between.
+  Snapshot snapshot;
+  snapshot.count = count_.load(std::memory_order_relaxed);
+  snapshot.sum_sec = sum_ns_.load(std::memory_order_relaxed) * 1e-9;
+  snapshot.max_sec = max_ns_.load(std::memory_order_relaxed) * 1e-9;
+  for (int i = 0; i != kNumBuckets; ++i) {
+    snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+void DurationHistogram::Reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_ns_.store(0, std::memory_order_relaxed);
+  max_ns_.store(0, std::memory_order_relaxed);
+}
+
+void TaskMetrics::Record(const int type, const Stage stage,
+                         const double duration_sec) {
+  const int index = (type >= 0 && type < kMaxTaskTypes) ? type : 0;
+  histograms_[index][stage].Add(duration_sec);
+}
+
+TaskMetrics::Snapshot TaskMetrics::GetSnapshot() const {
+  Snapshot snapshot;
+  for (int type = 0; type != kMaxTaskTypes; ++type) {
+    for (int stage = 0; stage != kNumStages; ++stage) {
+      snapshot[type][stage] = histograms_[type][stage].GetSnapshot();
+    }
+  }
+  return snapshot;
+}
+
+void TaskMetrics::Reset() {
+  for (auto& stages : histograms_) {
+    for (DurationHistogram& histogram : stages) {
+      histogram.Reset();
+    }
+  }
+}
+
+const char* TaskMetrics::StageName(const Stage stage) {
+  switch (stage) {
+    case DISPATCHED:
+      return "dispatched";
+    case DEPENDENCIES_COMPLETED:
+      return "queued";
+    case RUNNING:
+      return "running";
+    default:
+      return "unknown";
+  }
+}
+
+std::string TaskMetrics::ToString() const {
+  const Snapshot snapshot = GetSnapshot();
+  std::string result;
+  char line[256];
+  for (int type = 0; type != kMaxTaskTypes; ++type) {
+    for (int stage = 0; stage != kNumStages; ++stage) {
+      const DurationHistogram::Snapshot& histogram = snapshot[type][stage];
+      if (histogram.count == 0) continue;
+      std::snprintf(line, sizeof(line),
+                    "type %2d %-10s count %8llu mean %10.1fus p50 %10.1fus "
+                    "p90 %10.1fus p99 %10.1fus max %10.1fus\n",
+                    type, StageName(static_cast<Stage>(stage)),
+                    static_cast<unsigned long long>(histogram.count),
+                    histogram.Mean() * 1e6, histogram.Percentile(0.5) * 1e6,
+                    histogram.Percentile(0.9) * 1e6,
+                    histogram.Percentile(0.99) * 1e6, histogram.max_sec * 1e6);
+      result += line;
+    }
+  }
+  return result;
+}
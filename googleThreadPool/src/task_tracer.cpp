@@ -0,0 +1,307 @@
+#include "task_tracer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include "glog/logging.h"
+
+
+namespace {
+
+std::atomic<uint64_t> next_tracer_id{1};
+
+// The buffer the current thread used last, to skip the lookup in 'buffers_'.
+struct CachedBuffer {
+  uint64_t tracer_id = 0;
+  void* buffer = nullptr;
+};
+thread_local CachedBuffer cached_buffer;
+
+std::string CurrentThreadName(const int tid) {
+#ifdef __linux__
+  char name[16];
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0 &&
+      name[0] != '\0') {
+    return name;
+  }
+#endif
+  return "thread " + std::to_string(tid);
+}
+
+void AppendJsonString(const char* value, std::string* out) {
+  out->push_back('"');
+  for (const char* c = value; *c != '\0'; ++c) {
+    switch (*c) {
+      case '"':
+        *out += "\\\"";
+        break;
+      case '\\':
+        *out += "\\\\";
+        break;
+      case '\n':
+        *out += "\\n";
+        break;
+      default:
+        if (static_cast<unsigned char>(*c) < 0x20) {
+          char escaped[8];
+          std::snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+          *out += escaped;
+        } else {
+          out->push_back(*c);
+        }
+    }
+  }
+  out->push_back('"');
+}
+
+// Trace timestamps are in microseconds.
+std::string Micros(const int64_t ns) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.3f", ns * 1e-3);
+  return buffer;
+}
+
+}  // namespace
+
+struct TaskTracer::Event {
+  enum Kind { EXECUTION, DEPENDENCY };
+
+  Kind kind;
+  const void* task;
+  const void* dependent;  // Only for 'DEPENDENCY'.
+  int type;
+  char info[32];  // Truncated Task::info_, enough to tell tasks apart.
+  // Nanoseconds since 'origin_'.
+  int64_t dispatch_ns;
+  int64_t ready_ns;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+struct TaskTracer::ThreadBuffer {
+  ThreadBuffer(const size_t size, const int tid)
+      : thread_id(std::this_thread::get_id()),
+        tid(tid),
+        thread_name(CurrentThreadName(tid)),
+        events(size) {}
+
+  const std::thread::id thread_id;
+  const int tid;  // "tid" in the trace.
+  const std::string thread_name;
+
+  // Only contended while the trace is exported.
+  absl::Mutex mutex;
+  std::vector<Event> events GUARDED_BY(mutex);
+  uint64_t num_recorded GUARDED_BY(mutex) = 0;  // Including overwritten ones.
+};
+
+TaskTracer::TaskTracer(const size_t events_per_thread)
+    : events_per_thread_(events_per_thread),
+      id_(next_tracer_id.fetch_add(1, std::memory_order_relaxed)),
+      origin_(std::chrono::steady_clock::now()) {
+  CHECK_GT(events_per_thread_, 0);
+}
+
+TaskTracer::~TaskTracer() {}
+
+TaskTracer::ThreadBuffer* TaskTracer::GetThreadBuffer() {
+  if (cached_buffer.tracer_id == id_) {
+    return static_cast<ThreadBuffer*>(cached_buffer.buffer);
+  }
+  absl::MutexLock locker(&mutex_);
+  ThreadBuffer* buffer = nullptr;
+  for (const auto& thread_buffer : buffers_) {
+    if (thread_buffer->thread_id == std::this_thread::get_id()) {
+      buffer = thread_buffer.get();
+    }
+  }
+  if (buffer == nullptr) {
+    buffers_.emplace_back(new ThreadBuffer(events_per_thread_,
+                                           static_cast<int>(buffers_.size())));
+    buffer = buffers_.back().get();
+  }
+  cached_buffer.tracer_id = id_;
+  cached_buffer.buffer = buffer;
+  return buffer;
+}
+
+void TaskTracer::Append(const Event& event) {
+  ThreadBuffer* const buffer = GetThreadBuffer();
+  absl::MutexLock locker(&buffer->mutex);
+  buffer->events[buffer->num_recorded % buffer->events.size()] = event;
+  ++buffer->num_recorded;
+}
+
+void TaskTracer::RecordExecution(const void* task, const int type,
+                                 const std::string& info,
+                                 const TimePoint dispatch_time,
+                                 const TimePoint ready_time,
+                                 const TimePoint start_time,
+                                 const TimePoint end_time) {
+  const auto nanoseconds = [this](const TimePoint time) -> int64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time - origin_)
+        .count();
+  };
+  Event event;
+  event.kind = Event::EXECUTION;
+  event.task = task;
+  event.dependent = nullptr;
+  event.type = type;
+  const size_t length = std::min(info.size(), sizeof(event.info) - 1);
+  std::memcpy(event.info, info.data(), length);
+  event.info[length] = '\0';
+  event.dispatch_ns = nanoseconds(dispatch_time);
+  event.ready_ns = nanoseconds(ready_time);
+  event.start_ns = nanoseconds(start_time);
+  event.end_ns = nanoseconds(end_time);
+  Append(event);
+}
+
+void TaskTracer::RecordDependency(const void* dependency,
+                                  const void* dependent) {
+  Event event;
+  event.kind = Event::DEPENDENCY;
+  event.task = dependency;
+  event.dependent = dependent;
+  event.type = 0;
+  event.info[0] = '\0';
+  event.dispatch_ns = event.ready_ns = event.start_ns = event.end_ns = 0;
+  Append(event);
+}
+
+void TaskTracer::Clear() {
+  absl::MutexLock locker(&mutex_);
+  for (const auto& buffer : buffers_) {
+    absl::MutexLock buffer_locker(&buffer->mutex);
+    buffer->num_recorded = 0;
+  }
+}
+
+uint64_t TaskTracer::NumDroppedEvents() const {
+  absl::MutexLock locker(&mutex_);
+  uint64_t num_dropped = 0;
+  for (const auto& buffer : buffers_) {
+    absl::MutexLock buffer_locker(&buffer->mutex);
+    if (buffer->num_recorded > buffer->events.size()) {
+      num_dropped += buffer->num_recorded - buffer->events.size();
+    }
+  }
+  return num_dropped;
+}
+
+std::string TaskTracer::ToChromeTraceJson() const {
+  struct Execution {
+    int64_t start_ns;
+    int64_t end_ns;
+    int tid;
+  };
+  struct Flow {
+    const void* dependent;
+    int64_t dependency_start_ns;
+    int64_t dependency_end_ns;
+    int tid;
+  };
+
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  const auto begin_event = [&json, &first]() {
+    if (!first) json += ",\n";
+    first = false;
+  };
+
+  // Slices are written right away, arrows once every execution is known.
+  std::unordered_map<const void*, std::vector<Execution>> executions;
+  std::vector<Flow> flows;
+  {
+    absl::MutexLock locker(&mutex_);
+    for (const auto& buffer : buffers_) {
+      begin_event();
+      json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+              std::to_string(buffer->tid) + ",\"args\":{\"name\":";
+      AppendJsonString(buffer->thread_name.c_str(), &json);
+      json += "}}";
+
+      absl::MutexLock buffer_locker(&buffer->mutex);
+      const uint64_t size = buffer->events.size();
+      const uint64_t begin =
+          buffer->num_recorded > size ? buffer->num_recorded - size : 0;
+      // The last execution of each task in this buffer, in recording order.
+      std::unordered_map<const void*, const Event*> last_execution;
+      for (uint64_t i = begin; i != buffer->num_recorded; ++i) {
+        const Event& event = buffer->events[i % size];
+        if (event.kind == Event::DEPENDENCY) {
+          const auto it = last_execution.find(event.task);
+          if (it != last_execution.end()) {
+            flows.push_back(Flow{event.dependent, it->second->start_ns,
+                                 it->second->end_ns, buffer->tid});
+          }
+          continue;
+        }
+        last_execution[event.task] = &event;
+        executions[event.task].push_back(
+            Execution{event.start_ns, event.end_ns, buffer->tid});
+        begin_event();
+        json += "{\"name\":";
+        AppendJsonString(event.info[0] != '\0' ? event.info : "task", &json);
+        json += ",\"cat\":\"type " + std::to_string(event.type) +
+                "\",\"ph\":\"X\",\"pid\":1,\"tid\":" +
+                std::to_string(buffer->tid) + ",\"ts\":" +
+                Micros(event.start_ns) + ",\"dur\":" +
+                Micros(event.end_ns - event.start_ns) +
+                ",\"args\":{\"type\":" + std::to_string(event.type) +
+                ",\"waiting_for_dependencies_us\":" +
+                Micros(event.ready_ns - event.dispatch_ns) +
+                ",\"queued_us\":" + Micros(event.start_ns - event.ready_ns) +
+                "}}";
+      }
+    }
+  }
+
+  for (auto& entry : executions) {
+    std::sort(entry.second.begin(), entry.second.end(),
+              [](const Execution& a, const Execution& b) {
+                return a.start_ns < b.start_ns;
+              });
+  }
+  uint64_t flow_id = 0;
+  for (const Flow& flow : flows) {
+    // A TaskGraphTemplate runs the same task many times: the dependent's run
+    // released by this one is the first that started after it finished.
+    const auto it = executions.find(flow.dependent);
+    if (it == executions.end()) continue;
+    const auto dependent = std::lower_bound(
+        it->second.begin(), it->second.end(), flow.dependency_end_ns,
+        [](const Execution& execution, const int64_t time) {
+          return execution.start_ns < time;
+        });
+    if (dependent == it->second.end()) continue;
+    const std::string id = std::to_string(++flow_id);
+    begin_event();
+    json += "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"s\","
+            "\"id\":" + id + ",\"pid\":1,\"tid\":" + std::to_string(flow.tid) +
+            ",\"ts\":" + Micros(flow.dependency_start_ns) + "}";
+    begin_event();
+    json += "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"f\","
+            "\"bp\":\"e\",\"id\":" + id + ",\"pid\":1,\"tid\":" +
+            std::to_string(dependent->tid) + ",\"ts\":" +
+            Micros(dependent->start_ns) + "}";
+  }
+  json += "]}\n";
+  return json;
+}
+
+bool TaskTracer::WriteChromeTrace(const std::string& filename) const {
+  std::ofstream file(filename);
+  file << ToChromeTraceJson();
+  file.close();
+  LOG_IF(WARNING, !file) << "Failed to write the trace to " << filename;
+  return static_cast<bool>(file);
+}
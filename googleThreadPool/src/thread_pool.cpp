@@ -3,51 +3,455 @@
 #ifndef WIN32
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <numeric>
 
 #include "absl/memory/memory.h"
+#include "flight_recorder.h"
 #include "task.h"
+#include "task_graph.h"
+#include "task_graph_template.h"
 #include "glog/logging.h"
 
 
+namespace {
+
+// Cancellations walk raw pointers to tasks that another cancellation could
+// release, so they are done one at a time.
+ABSL_CONST_INIT absl::Mutex cancel_mutex(absl::kConstInit);
+
+}  // namespace
 
 void ThreadPoolInterface::Execute(Task* task) {
     task->Execute();
   //LOG(INFO)<<"Execute finish: ";//<<task->getTaskInfo() ;
 }
 
+Task* ThreadPoolInterface::ExecuteWithContinuation(Task* task) {
+  return task->Execute(this);
+}
+
 void ThreadPoolInterface::SetThreadPool(Task* task) {
   task->SetThreadPool(this);
 }
 
-ThreadPool::ThreadPool(int num_threads) {
+bool ThreadPoolInterface::DispatchTask(Task* task) {
+  return task->Dispatch(this);
+}
+
+bool ThreadPoolInterface::DispatchPrivateTask(Task* task) {
+  return task->DispatchUnlocked(this);
+}
+
+std::vector<std::weak_ptr<Task>> ThreadPoolInterface::Schedule(TaskGraph graph) {
+  std::vector<bool> shared;
+  std::vector<std::shared_ptr<Task>> tasks = graph.Link(&shared);
+  std::vector<std::weak_ptr<Task>> handles(tasks.begin(), tasks.end());
+  ScheduleTasks(tasks, &shared);
+  return handles;
+}
+
+void ThreadPoolInterface::Schedule(TaskGraphTemplate* graph_template) {
+  graph_template->Reset();
+  // The tasks of a template can be reached through TaskGraphTemplate::task().
+  ScheduleTasks(graph_template->tasks_, nullptr);
+}
+
+namespace {
+
+thread_local int current_worker_id = -1;
+thread_local const ThreadPool* current_pool = nullptr;  // 当前 worker 所属线程池
+
+// Gives the CPU token of the calling thread back, if it holds one.
+void ReleaseCpuToken() {
+  ctpl::cpu_governor* const governor = ctpl::cpu_governor::current();
+  if (governor != nullptr) {
+    governor->release();
+  }
+}
+
+}  // namespace
+
+ThreadPoolOptions ThreadPoolOptions::Foreground(const std::string& name,
+                                                const int num_threads) {
+  ThreadPoolOptions options;
+  options.name = name;
+  options.num_threads = num_threads;
+  options.thread_class = FOREGROUND;
+  options.nice_increment = 0;
+  return options;
+}
+
+ThreadPoolOptions ThreadPoolOptions::Background(const std::string& name,
+                                                const int num_threads) {
+  ThreadPoolOptions options;
+  options.name = name;
+  options.num_threads = num_threads;
+  options.thread_class = BACKGROUND;
+  options.nice_increment = 10;
+  return options;
+}
+
+ThreadPool::ThreadPool(int num_threads)
+    : ThreadPool(ThreadPoolOptions::Background("pool", num_threads)) {}
+
+ThreadPool::ThreadPool(const ThreadPoolOptions& options) : options_(options) {
   absl::MutexLock locker(&mutex_);
-  for (int i = 0; i != num_threads; ++i) {
-    pool_.emplace_back([this]() { static int id = 0; ThreadPool::DoWork(id++);});
+  SetNumThreadsLocked(options_.num_threads);
+  if (options_.max_threads > 0) {
+    CHECK_GE(options_.min_threads, 1);
+    CHECK_LE(options_.min_threads, options_.max_threads);
+    controller_ = std::thread([this]() { ControlNumThreads(); });
   }
 }
 
 ThreadPool::~ThreadPool() {
-  LOG(INFO)<<" ~ThreadPool "<<running_<< "  task_queue_: "<<task_queue_.size();
   {
     absl::MutexLock locker(&mutex_);
     CHECK(running_);
+    if (num_threads_ == 0) {
+      // Someone has to drain the queue.
+      SetNumThreadsLocked(1);
+    }
     running_ = false;
   }
+  if (controller_.joinable()) {
+    controller_.join();
+  }
   for (std::thread& thread : pool_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  for (std::thread& thread : retired_threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::SetNumThreads(const int num_threads) {
+  std::vector<std::thread> retired_threads;
+  {
+    absl::MutexLock locker(&mutex_);
+    CHECK(running_);
+    SetNumThreadsLocked(num_threads);
+    retired_threads.swap(retired_threads_);
+  }
+  for (std::thread& thread : retired_threads) {
     thread.join();
-    LOG(INFO)<<" join "<<&thread<<" "<<running_;
   }
 }
 
+int ThreadPool::NumThreads() {
+  absl::MutexLock locker(&mutex_);
+  return num_threads_;
+}
+
+void ThreadPool::SetNumThreadsLocked(const int num_threads) {
+  CHECK_GE(num_threads, 0);
+  if (static_cast<int>(pool_.size()) < num_threads) {
+    pool_.resize(num_threads);
+    worker_alive_.resize(num_threads, false);
+  }
+  // Workers that are still retiring see the new count and stay.
+  for (int i = num_threads_; i < num_threads; ++i) {
+    if (worker_alive_[i]) continue;
+    if (pool_[i].joinable()) {
+      // Already returned from DoWork(), joined outside of 'mutex_'.
+      retired_threads_.push_back(std::move(pool_[i]));
+    }
+    worker_alive_[i] = true;
+    pool_[i] = std::thread([this, i]() { ThreadPool::DoWork(i); });
+  }
+  num_threads_ = num_threads;
+}
+
+void ThreadPool::ControlNumThreads() {
+  const auto stopped = [this]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return !running_;
+  };
+  const auto grow_wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(options_.grow_queue_wait_sec));
+  const auto idle_timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(options_.idle_timeout_sec));
+  // Checked a few times per threshold, but not busy-looping on tiny ones.
+  const absl::Duration period = absl::Microseconds(std::max(
+      200., 1e6 * std::min(options_.grow_queue_wait_sec,
+                           options_.idle_timeout_sec) / 4.));
+
+  absl::MutexLock locker(&mutex_);
+  auto busy_time = std::chrono::steady_clock::now();
+  while (!mutex_.AwaitWithTimeout(absl::Condition(&stopped), period)) {
+    const auto now = std::chrono::steady_clock::now();
+    const auto oldest_ready_time =
+        ready_times_.empty() ? now : ready_times_.front().first;
+    if (now - oldest_ready_time > grow_wait &&
+        num_threads_ < options_.max_threads) {
+      SetNumThreadsLocked(num_threads_ + 1);
+      busy_time = now;
+    }
+    if (num_idle_workers_ == 0 || HasReadyTasks()) {
+      busy_time = now;
+    } else if (now - busy_time > idle_timeout &&
+               num_threads_ > options_.min_threads) {
+      SetNumThreadsLocked(num_threads_ - 1);
+      busy_time = now;
+    }
+    if (!retired_threads_.empty()) {
+      std::vector<std::thread> retired_threads;
+      retired_threads.swap(retired_threads_);
+      mutex_.Unlock();
+      for (std::thread& thread : retired_threads) {
+        thread.join();
+      }
+      mutex_.Lock();
+    }
+  }
+}
+
+int ThreadPool::CurrentWorkerId() { return current_worker_id; }
+
+void ThreadPool::Wait(std::weak_ptr<Task> task) {
+  const std::shared_ptr<Task> shared_task = task.lock();
+  if (!shared_task) {
+    return;
+  }
+  const Task* const waited_task = shared_task.get();
+  // Tasks of other pools complete without touching 'mutex_', so poll.
+  HelpUntil([waited_task]() { return waited_task->IsCompleted(); },
+            /*poll=*/true);
+}
+
+void ThreadPool::WaitForIdle() {
+  CHECK(current_pool != this) << "WaitForIdle() called from a task of the pool.";
+  HelpUntil([this]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return !HasReadyTasks() && tasks_not_ready_.empty() &&
+           num_executing_ == 0;
+  }, /*poll=*/false);
+}
+
+void ThreadPool::HelpUntil(const std::function<bool()>& done, const bool poll) {
+  const auto predicate = [this, &done]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return HasReadyTasks() || done();
+  };
+  // A worker waiting from a task keeps its CPU token only while it helps. A
+  // thread holding no token, e.g. one outside of the pools, takes one of
+  // 'options_.governor' while it runs tasks and gives it back at the end.
+  ctpl::cpu_governor* const held_governor = ctpl::cpu_governor::current();
+  ctpl::cpu_governor* const governor =
+      held_governor != nullptr ? held_governor : options_.governor;
+  bool executed = false;
+  for (;;) {
+    Task::PropagateCriticalPathCosts();
+    std::shared_ptr<Task> task;
+    bool finished = false;
+    {
+      absl::MutexLock locker(&mutex_);
+      if (executed) {
+        --num_executing_;
+      }
+      if (governor != nullptr && !predicate()) {
+        governor->release();
+      }
+      if (poll) {
+        mutex_.AwaitWithTimeout(absl::Condition(&predicate),
+                                absl::Milliseconds(1));
+      } else {
+        mutex_.Await(absl::Condition(&predicate));
+      }
+      finished = done();
+      executed = !finished && HasReadyTasks();
+      if (executed) {
+        task = PopReadyTask();
+        ++num_executing_;
+      }
+    }
+    // Not under 'mutex_', the token may take a while.
+    if (governor != nullptr && (executed || held_governor != nullptr)) {
+      governor->acquire();
+    }
+    if (finished) {
+      if (governor != nullptr && held_governor == nullptr) {
+        governor->release();
+      }
+      return;
+    }
+    if (!executed) {
+      continue;
+    }
+    FlightRecorder::Record(FlightRecorder::STEAL, task.get());
+    ExecuteChain(std::move(task));
+  }
+}
+
+void ThreadPool::SetUpWorkerThread(const int thread_id) {
+  current_worker_id = thread_id;
+#ifdef __linux__
+  // Thread names are limited to 15 characters.
+  const std::string thread_name =
+      (options_.name + "/" + std::to_string(thread_id)).substr(0, 15);
+  pthread_setname_np(pthread_self(), thread_name.c_str());
+
+  // This changes the per-thread nice level of the current thread on Linux. We
+  // do this so that the background work done by the thread pool is not taking
+  // away CPU resources from more important foreground threads.
+  if (options_.nice_increment != 0) {
+    errno = 0;
+    CHECK(nice(options_.nice_increment) != -1 || errno == 0);
+  }
+  if (options_.sched_policy != SCHED_OTHER) {
+    sched_param param;
+    param.sched_priority = options_.sched_priority;
+    const int error =
+        pthread_setschedparam(pthread_self(), options_.sched_policy, &param);
+    // Real-time policies need privileges we may not have, keep going without.
+    LOG_IF(WARNING, error != 0)
+        << options_.name << ": sched policy " << options_.sched_policy
+        << " not applied, error " << error;
+  }
+  if (!options_.cpu_affinity.empty()) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (const int cpu : options_.cpu_affinity) {
+      CHECK_GE(cpu, 0);
+      CHECK_LT(cpu, CPU_SETSIZE);
+      CPU_SET(cpu, &cpu_set);
+    }
+    CHECK_EQ(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set),
+             0);
+  }
+#endif
+}
+
 void ThreadPool::NotifyDependenciesCompleted(Task* task) {
   absl::MutexLock locker(&mutex_);
+  PushReadyTask(task);
+}
+
+constexpr int ThreadPool::kMaxInlineContinuations;
+
+bool ThreadPoolInterface::Cancel(std::weak_ptr<Task> task) {
+  std::shared_ptr<Task> shared_task = task.lock();
+  if (!shared_task) {
+    return false;
+  }
+  absl::MutexLock locker(&cancel_mutex);
+  std::vector<Task*> dependents;
+  ThreadPoolInterface* thread_pool = nullptr;
+  if (!shared_task->Remove(&dependents, &thread_pool)) {
+    return false;
+  }
+  FlightRecorder::Record(FlightRecorder::CANCEL, shared_task.get());
+  CancelSubgraph(shared_task.get(), thread_pool, std::move(dependents));
+  return true;
+}
+
+void ThreadPoolInterface::CancelDownstream(Task* task) {
+  absl::MutexLock locker(&cancel_mutex);
+  std::vector<Task*> dependents;
+  {
+    absl::MutexLock task_locker(&task->mutex_);
+    dependents.assign(task->dependent_tasks_.begin(),
+                      task->dependent_tasks_.end());
+  }
+  CancelSubgraph(task, this, std::move(dependents));
+}
+
+void ThreadPoolInterface::CancelSubgraph(Task* task,
+                                         ThreadPoolInterface* thread_pool,
+                                         std::vector<Task*> pending) {
+  // Only tasks downstream of a task that has not run yet are visited, they
+  // are kept alive by their pools until released below.
+  std::vector<Task*> cancelled_tasks = {task};
+  std::vector<std::pair<ThreadPoolInterface*, Task*>> tasks_to_release;
+  if (thread_pool != nullptr) {
+    tasks_to_release.emplace_back(thread_pool, task);
+  }
+  while (!pending.empty()) {
+    Task* pending_task = pending.back();
+    pending.pop_back();
+    ThreadPoolInterface* pending_pool = nullptr;
+    if (!pending_task->Remove(&pending, &pending_pool)) {
+      continue;
+    }
+    cancelled_tasks.push_back(pending_task);
+    FlightRecorder::Record(FlightRecorder::CANCEL, pending_task);
+    if (pending_pool != nullptr) {
+      tasks_to_release.emplace_back(pending_pool, pending_task);
+    }
+  }
+  for (Task* cancelled_task : cancelled_tasks) {
+    cancelled_task->UnlinkFromDependencies();
+  }
+  std::sort(tasks_to_release.begin(), tasks_to_release.end());
+  for (auto begin = tasks_to_release.begin(); begin != tasks_to_release.end();) {
+    auto end = begin;
+    std::vector<Task*> tasks;
+    for (; end != tasks_to_release.end() && end->first == begin->first; ++end) {
+      tasks.push_back(end->second);
+    }
+    begin->first->ReleaseCancelledTasks(tasks);
+    begin = end;
+  }
+}
+
+void ThreadPool::ExecuteChain(std::shared_ptr<Task> task) {
+  for (int depth = 0;; ++depth) {
+    CHECK_EQ(task->GetState(), Task::DEPENDENCIES_COMPLETED);
+    if (depth == kMaxInlineContinuations) {
+      Execute(task.get());
+      return;
+    }
+    Task* continuation = ExecuteWithContinuation(task.get());
+    if (continuation == nullptr) {
+      return;
+    }
+    task = TakeContinuation(continuation);
+  }
+}
+
+std::shared_ptr<Task> ThreadPool::TakeContinuation(Task* task) {
+  absl::MutexLock locker(&mutex_);
+  auto it = tasks_not_ready_.find(task);
+  CHECK(it != tasks_not_ready_.end());
+  std::shared_ptr<Task> shared_task = std::move(it->second);
+  tasks_not_ready_.erase(it);
+  return shared_task;
+}
+
+void ThreadPool::ReleaseCancelledTasks(const std::vector<Task*>& tasks) {
+  std::vector<std::shared_ptr<Task>> released_tasks;
+  released_tasks.reserve(tasks.size());
+  {
+    absl::MutexLock locker(&mutex_);
+    for (Task* task : tasks) {
+      auto it = tasks_not_ready_.find(task);
+      if (it == tasks_not_ready_.end()) {
+        continue;  // Cancelled right after it was dispatched, released already.
+      }
+      released_tasks.push_back(std::move(it->second));
+      tasks_not_ready_.erase(it);
+    }
+  }
+  // The tasks are destroyed here, outside of the lock.
+}
+
+void ThreadPool::PushReadyTask(Task* task) {
   auto it = tasks_not_ready_.find(task);
   CHECK(it != tasks_not_ready_.end());
   //LOG(INFO)<<"NotifyDependenciesCompleted task_queue_: "<<task_queue_.size()<<" ready: "<<tasks_not_ready_.size();// <<" |task_info: "<<task->getTaskInfo();
-  task_queue_.push_back(it->second);  // 压入任务的时候就会唤醒等待任务的线程{ mutex_.Await(absl::Condition(&predicate)); }， 然后执行任务
+  task->ready_priority_ = task->CriticalPathCost();
+  task->ready_sequence_ = next_sequence_++;
+  task_queue_.push_back(
+      ReadyTask{task->ready_priority_, task->ready_sequence_, std::move(it->second)});
+  ready_times_.emplace_back(std::chrono::steady_clock::now(), true);
+  std::push_heap(task_queue_.begin(), task_queue_.end(), ReadyTaskCompare());
+  FlightRecorder::Record(FlightRecorder::READY, task, task_queue_.size());  // 压入任务的时候就会唤醒等待任务的线程{ mutex_.Await(absl::Condition(&predicate)); }， 然后执行任务
   tasks_not_ready_.erase(it);
   //LOG(INFO)<<"==>==>: "<<task_queue_.size()<<" ready: "<< tasks_not_ready_.size() ;
 }
@@ -60,82 +464,147 @@ std::weak_ptr<Task> ThreadPool::Schedule(std::unique_ptr<Task> task) {
         tasks_not_ready_.insert(std::make_pair(task.get(), std::move(task)));
     CHECK(insert_result.second) << "Schedule called twice";
     shared_task = insert_result.first->second;
+    FlightRecorder::Record(FlightRecorder::SCHEDULE, shared_task.get());
     //LOG(INFO)<<"ThreadPool Schedule: "<<task_queue_.size()<<" ready:"<<tasks_not_ready_.size();// <<" |task_info: "<<task->getTaskInfo();
   }
   SetThreadPool(shared_task.get());
+  if (shared_task->IsCancelled()) {
+    // It depended on a cancelled task and completes without running.
+    CancelDownstream(shared_task.get());
+  }
   return shared_task;
 }
 
-void ThreadPool::DoWork() {
-#ifdef __linux__
-  // This changes the per-thread nice level of the current thread on Linux. We
-  // do this so that the background work done by the thread pool is not taking
-  // away CPU resources from more important foreground threads.
-  CHECK_NE(nice(10), -1);
-#endif
-  const auto predicate = [this]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
-    return !task_queue_.empty() || !running_;
-  };
-  for (;;) {
-    std::shared_ptr<Task> task;
-    {
-      absl::MutexLock locker(&mutex_);
-      mutex_.Await(absl::Condition(&predicate));
-      if (!task_queue_.empty()) {
-        task = std::move(task_queue_.front());
-        task_queue_.pop_front();
-        //LOG(INFO)<<" task_queue_: "<<task_queue_.size();
-      } else if (!running_) {
-        return;
+void ThreadPool::ScheduleTasks(const std::vector<std::shared_ptr<Task>>& tasks,
+                               const std::vector<bool>* shared) {
+  std::vector<Task*> shared_tasks;
+  {
+    absl::MutexLock locker(&mutex_);
+    tasks_not_ready_.reserve(tasks_not_ready_.size() + tasks.size());
+    for (const std::shared_ptr<Task>& task : tasks) {
+      CHECK(tasks_not_ready_.insert(std::make_pair(task.get(), task)).second)
+          << "Schedule called twice";
+      FlightRecorder::Record(FlightRecorder::SCHEDULE, task.get());
+    }
+    // Only the tasks of the graph can notify the private ones, and none of
+    // them runs before 'mutex_' is released, so they are dispatched and
+    // queued right here without taking their locks. Nobody can cancel them.
+    for (size_t i = 0; i != tasks.size(); ++i) {
+      Task* task = tasks[i].get();
+      if (shared == nullptr || (*shared)[i]) {
+        shared_tasks.push_back(task);
+      } else if (DispatchPrivateTask(task)) {
+        PushReadyTask(task);
       }
     }
-    CHECK(task);
-    CHECK_EQ(task->GetState(), Task::DEPENDENCIES_COMPLETED);
-    Execute(task.get());
+  }
+  if (shared_tasks.empty()) {
+    return;
+  }
+  // The others take their own lock, which is never taken under 'mutex_'.
+  // Tasks that became ready stay in 'tasks_not_ready_' until they are queued
+  // below under a single lock.
+  std::vector<Task*> ready_tasks;
+  std::vector<Task*> cancelled_tasks;
+  for (Task* task : shared_tasks) {
+    if (DispatchTask(task)) {
+      ready_tasks.push_back(task);
+    } else if (task->IsCancelled()) {
+      cancelled_tasks.push_back(task);
+    }
+  }
+  for (Task* task : cancelled_tasks) {
+    CancelDownstream(task);
+  }
+  absl::MutexLock locker(&mutex_);
+  for (Task* task : ready_tasks) {
+    PushReadyTask(task);
   }
 }
 
+void ThreadPool::NotifyPriorityRaised(const std::shared_ptr<Task>& task) {
+  const double priority = task->CriticalPathCost();
+  absl::MutexLock locker(&mutex_);
+  if (task->ready_priority_ < 0. || priority <= task->ready_priority_) {
+    return;  // Not queued anymore, or raised already.
+  }
+  // Re-keyed by a second entry, which keeps its place among equal priorities.
+  task->ready_priority_ = priority;
+  ++num_outdated_entries_;
+  task_queue_.push_back(ReadyTask{priority, task->ready_sequence_, task});
+  std::push_heap(task_queue_.begin(), task_queue_.end(), ReadyTaskCompare());
+}
+
+std::shared_ptr<Task> ThreadPool::PopReadyTask() {
+  for (;;) {
+    std::pop_heap(task_queue_.begin(), task_queue_.end(), ReadyTaskCompare());
+    ReadyTask ready_task = std::move(task_queue_.back());
+    task_queue_.pop_back();
+    if (ready_task.priority != ready_task.task->ready_priority_) {
+      --num_outdated_entries_;
+      continue;
+    }
+    ready_task.task->ready_priority_ = -1.;
+    ready_times_[ready_task.sequence - first_ready_sequence_].second = false;
+    while (!ready_times_.empty() && !ready_times_.front().second) {
+      ready_times_.pop_front();
+      ++first_ready_sequence_;
+    }
+    return std::move(ready_task.task);
+  }
+}
 
 void ThreadPool::DoWork(const int thread_id) {
-#ifdef __linux__
-  // This changes the per-thread nice level of the current thread on Linux. We
-  // do this so that the background work done by the thread pool is not taking
-  // away CPU resources from more important foreground threads.
-  CHECK_NE(nice(10), -1);
-#endif
-  const auto predicate = [this]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
-    return !task_queue_.empty() || !running_;
+  SetUpWorkerThread(thread_id);
+  const auto predicate = [this, thread_id]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    return HasReadyTasks() || !running_ || thread_id >= num_threads_;
   };
+  current_pool = this;
+  bool executed = false;
   for (;;) {
+    Task::PropagateCriticalPathCosts();
     std::shared_ptr<Task> task;
     {
       absl::MutexLock locker(&mutex_);
+      if (executed) {
+        --num_executing_;
+      }
+      ++num_idle_workers_;
+      const bool park = !predicate();
+      if (park) {
+        ReleaseCpuToken();
+        FlightRecorder::Record(FlightRecorder::PARK, this, thread_id);
+      }
       mutex_.Await(absl::Condition(&predicate));
-/*      if (!running_) {
-          LOG(WARNING)<<"DoWork:  running_"<<thread_id;
+      if (park) {
+        FlightRecorder::Record(FlightRecorder::UNPARK, this, thread_id);
+      }
+      --num_idle_workers_;
+      if (thread_id >= num_threads_) {
+          // Retired by SetNumThreads().
+          ReleaseCpuToken();
+          worker_alive_[thread_id] = false;
           return;
       }
-      else*/
-      if (!task_queue_.empty()) {
-          task = std::move(task_queue_.front());
-          //if(!task->getTaskInfo().empty())
-          static int last_read_size = 0;
-          if((task_queue_.size()>4 ||tasks_not_ready_.size()>8 ) && (tasks_not_ready_.size()- last_read_size)%10 == 0)
-          {
-              last_read_size = tasks_not_ready_.size();
-              LOG(WARNING)<<"thread_id: "<<thread_id<<" task_queue_: "<<task_queue_.size()<<" ready_queue:"<<tasks_not_ready_.size() ;//<<" | "<<task->getTaskInfo();
-          }
-
-          task_queue_.pop_front();
+      if (HasReadyTasks()) {
+          task = PopReadyTask();
+          ++num_executing_;
           //LOG(INFO)<<"==>==>:task_queue_:  "<<task_queue_.size()<<" ready_queue: "<< tasks_not_ready_.size() ;
       }
       else if (!running_) {
-          LOG(WARNING)<<"DoWork:  running_"<<thread_id;
+          ReleaseCpuToken();
+          worker_alive_[thread_id] = false;
           return;
       }
     }
     CHECK(task);
-    CHECK_EQ(task->GetState(), Task::DEPENDENCIES_COMPLETED);
-    Execute(task.get());
+    if (options_.governor != nullptr) {
+      options_.governor->acquire();  // Kept from one task to the next.
+    }
+    ExecuteChain(std::move(task));
+    if (options_.governor != nullptr) {
+      options_.governor->yield();
+    }
+    executed = true;
   }
 }
@@ -0,0 +1,90 @@
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "ctpl_thread_pool.h"
+#include "gtest/gtest.h"
+#include "inline_thread_pool.h"
+#include "task.h"
+#include "task_graph.h"
+#include "test_util.h"
+
+namespace {
+
+// Builds a <- b <- c top-down, so that the raise of the cost of 'b' by 'c'
+// only reaches 'a' through Task::PropagateCriticalPathCosts(), then runs a
+// task on 'pool' and checks that 'a' got the raise.
+void CheckPropagatesCosts(ThreadPoolInterface* pool) {
+  constexpr int kType = Task::kMaxTaskTypes - 1;  // Never run, not refined.
+  std::vector<std::shared_ptr<Task>> chain;
+  for (int i = 0; i != 3; ++i) {
+    chain.push_back(std::make_shared<Task>());
+    chain.back()->AddTaskInfo("chain", kType);
+    if (i > 0) {
+      chain[i]->AddDependency(chain[i - 1]);
+    }
+  }
+  const double run_time = Task::EstimatedRunTime(kType);
+  EXPECT_DOUBLE_EQ(2 * run_time, chain[0]->CriticalPathCost());
+
+  absl::Notification done;
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([&done]() { done.Notify(); });
+  pool->Schedule(std::move(task));
+  done.WaitForNotification();
+  EXPECT_DOUBLE_EQ(3 * run_time, chain[0]->CriticalPathCost());
+}
+
+TEST(InlineThreadPoolTest, RunsOnTheSchedulingThread) {
+  InlineThreadPool pool;
+  Receiver receiver;
+  std::thread::id thread_id;
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([&thread_id]() { thread_id = std::this_thread::get_id(); });
+  std::weak_ptr<Task> handle = pool.Schedule(std::move(task));
+  // Schedule() only returns after the task has run.
+  EXPECT_TRUE(handle.expired());
+  EXPECT_EQ(std::this_thread::get_id(), thread_id);
+
+  pool.Schedule(MakeChain(&receiver));
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), receiver.received_numbers());
+}
+
+TEST(InlineThreadPoolTest, QueuesTasksScheduledFromWorkItems) {
+  InlineThreadPool pool;
+  Receiver receiver;
+  auto outer = absl::make_unique<Task>();
+  outer->SetWorkItem([&pool, &receiver]() {
+    auto inner = absl::make_unique<Task>();
+    inner->SetWorkItem([&receiver]() { receiver.Receive(2); });
+    pool.Schedule(std::move(inner));
+    // Run by the outermost Schedule() once this one is done.
+    receiver.Receive(1);
+  });
+  pool.Schedule(std::move(outer));
+  EXPECT_EQ(std::vector<int>({1, 2}), receiver.received_numbers());
+}
+
+TEST(InlineThreadPoolTest, PropagatesCriticalPathCosts) {
+  InlineThreadPool pool;
+  CheckPropagatesCosts(&pool);
+}
+
+TEST(CtplThreadPoolTest, RunsInDependencyOrder) {
+  CtplThreadPool pool(2);
+  EXPECT_EQ(2, pool.num_threads());
+  Receiver receiver;
+  absl::Notification done;
+  pool.Schedule(MakeChain(&receiver, &done));
+  done.WaitForNotification();
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), receiver.received_numbers());
+}
+
+TEST(CtplThreadPoolTest, PropagatesCriticalPathCosts) {
+  CtplThreadPool pool(2);
+  CheckPropagatesCosts(&pool);
+}
+
+}  // namespace
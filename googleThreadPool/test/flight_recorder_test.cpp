@@ -0,0 +1,201 @@
+#include "flight_recorder.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "task.h"
+#include "thread_pool.h"
+
+namespace {
+
+uint64_t NowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000u + now.tv_nsec;
+}
+
+std::string DumpPath() {
+  return "/tmp/flight_recorder_test." + std::to_string(getpid());
+}
+
+// Reads a dump and returns the events of all threads, ordered by time.
+std::vector<FlightRecorder::Event> ReadDump(const std::string& path) {
+  std::vector<FlightRecorder::Event> events;
+  std::ifstream file(path, std::ios::binary);
+  FlightRecorder::FileHeader file_header;
+  if (!file.read(reinterpret_cast<char*>(&file_header), sizeof(file_header))) {
+    ADD_FAILURE() << "Can not read " << path;
+    return events;
+  }
+  EXPECT_EQ(FlightRecorder::kMagic, file_header.magic);
+  EXPECT_EQ(FlightRecorder::kVersion, file_header.version);
+  EXPECT_EQ(sizeof(FlightRecorder::Event), file_header.event_size);
+  for (uint32_t i = 0; i != file_header.num_threads; ++i) {
+    FlightRecorder::ThreadHeader thread_header;
+    file.read(reinterpret_cast<char*>(&thread_header), sizeof(thread_header));
+    std::vector<FlightRecorder::Event> ring(thread_header.capacity);
+    file.read(reinterpret_cast<char*>(ring.data()),
+              ring.size() * sizeof(FlightRecorder::Event));
+    const uint64_t begin = thread_header.head > thread_header.capacity
+                               ? thread_header.head - thread_header.capacity
+                               : 0;
+    for (uint64_t j = begin; j != thread_header.head; ++j) {
+      events.push_back(ring[j % thread_header.capacity]);
+    }
+  }
+  EXPECT_TRUE(static_cast<bool>(file));
+  std::stable_sort(events.begin(), events.end(),
+                   [](const FlightRecorder::Event& a,
+                      const FlightRecorder::Event& b) {
+                     return a.time_ns < b.time_ns;
+                   });
+  return events;
+}
+
+// Kinds of the events recorded for 'object' since 'since_ns'.
+std::vector<FlightRecorder::EventKind> KindsOf(
+    const std::vector<FlightRecorder::Event>& events, const void* object,
+    const uint64_t since_ns) {
+  std::vector<FlightRecorder::EventKind> kinds;
+  for (const FlightRecorder::Event& event : events) {
+    if (event.time_ns >= since_ns &&
+        event.object == reinterpret_cast<uint64_t>(object)) {
+      kinds.push_back(event.kind());
+    }
+  }
+  return kinds;
+}
+
+// Runs one task of 'type' on a worker and returns its address, only to
+// match events.
+const void* RunTask(ThreadPool* pool, const int type) {
+  absl::Notification done;
+  auto task = absl::make_unique<Task>();
+  task->AddTaskInfo("recorded", type);
+  task->SetWorkItem([&done]() { done.Notify(); });
+  const void* const address = task.get();
+  pool->Schedule(std::move(task));
+  done.WaitForNotification();
+  pool->WaitForIdle();
+  return address;
+}
+
+TEST(FlightRecorderTest, RecordsTaskLifecycle) {
+  ThreadPool pool(1);
+  const uint64_t start_ns = NowNs();
+  const void* const task = RunTask(&pool, 5);
+  const std::string path = DumpPath();
+  ASSERT_TRUE(FlightRecorder::Dump(path));
+  const std::vector<FlightRecorder::Event> events = ReadDump(path);
+  std::remove(path.c_str());
+
+  EXPECT_EQ(std::vector<FlightRecorder::EventKind>(
+                {FlightRecorder::SCHEDULE, FlightRecorder::READY,
+                 FlightRecorder::START, FlightRecorder::END}),
+            KindsOf(events, task, start_ns));
+  for (const FlightRecorder::Event& event : events) {
+    if (event.time_ns >= start_ns &&
+        event.object == reinterpret_cast<uint64_t>(task) &&
+        event.kind() == FlightRecorder::START) {
+      EXPECT_EQ(5u, event.arg());
+    }
+  }
+}
+
+TEST(FlightRecorderTest, RecordsStolenTasks) {
+  ThreadPool pool(1);
+  // Keep the only worker busy, so that Wait() runs the task itself.
+  absl::Notification started;
+  absl::Notification release;
+  auto blocker = absl::make_unique<Task>();
+  blocker->SetWorkItem([&started, &release]() {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  pool.Schedule(std::move(blocker));
+  started.WaitForNotification();
+
+  const uint64_t start_ns = NowNs();
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([]() {});
+  const void* const address = task.get();
+  pool.Wait(pool.Schedule(std::move(task)));
+  release.Notify();
+  pool.WaitForIdle();
+  const std::string path = DumpPath();
+  ASSERT_TRUE(FlightRecorder::Dump(path));
+  const std::vector<FlightRecorder::Event> events = ReadDump(path);
+  std::remove(path.c_str());
+  EXPECT_EQ(std::vector<FlightRecorder::EventKind>(
+                {FlightRecorder::SCHEDULE, FlightRecorder::READY,
+                 FlightRecorder::STEAL, FlightRecorder::START,
+                 FlightRecorder::END}),
+            KindsOf(events, address, start_ns));
+}
+
+TEST(FlightRecorderTest, RecordsNothingWhenDisabled) {
+  ThreadPool pool(1);
+  FlightRecorder::SetEnabled(false);
+  const uint64_t start_ns = NowNs();
+  const void* const task = RunTask(&pool, 0);
+  FlightRecorder::SetEnabled(true);
+  const std::string path = DumpPath();
+  ASSERT_TRUE(FlightRecorder::Dump(path));
+  const std::vector<FlightRecorder::Event> events = ReadDump(path);
+  std::remove(path.c_str());
+  EXPECT_TRUE(KindsOf(events, task, start_ns).empty());
+}
+
+TEST(FlightRecorderTest, ForgetsEventsOfExitedThreads) {
+  const int exited_object = 0;
+  std::thread([&exited_object]() {
+    FlightRecorder::Record(FlightRecorder::SCHEDULE, &exited_object);
+  }).join();
+
+  // As many threads as there are buffers take all of them, the one of the
+  // exited thread included.
+  const std::string path = DumpPath();
+  ASSERT_TRUE(FlightRecorder::Dump(path));
+  FlightRecorder::FileHeader file_header;
+  {
+    std::ifstream file(path, std::ios::binary);
+    ASSERT_TRUE(static_cast<bool>(
+        file.read(reinterpret_cast<char*>(&file_header), sizeof(file_header))));
+  }
+  const int num_threads = file_header.num_threads;
+  const int new_object = 0;
+  std::atomic<int> num_started(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i != num_threads; ++i) {
+    threads.emplace_back([&new_object, &num_started, num_threads]() {
+      FlightRecorder::Record(FlightRecorder::SCHEDULE, &new_object);
+      ++num_started;
+      while (num_started < num_threads) {
+        std::this_thread::yield();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ASSERT_TRUE(FlightRecorder::Dump(path));
+  const std::vector<FlightRecorder::Event> events = ReadDump(path);
+  std::remove(path.c_str());
+  EXPECT_EQ(static_cast<size_t>(num_threads),
+            KindsOf(events, &new_object, 0).size());
+  EXPECT_TRUE(KindsOf(events, &exited_object, 0).empty());
+}
+
+}  // namespace
@@ -0,0 +1,76 @@
+#include "task_graph_template.h"
+
+#include <memory>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "test_util.h"
+#include "thread_pool.h"
+
+namespace {
+
+TEST(TaskGraphTemplateTest, RunsRepeatedly) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  TaskGraphTemplate graph_template(MakeChain(&receiver));
+  EXPECT_TRUE(graph_template.IsDone());
+  for (int run = 0; run != 3; ++run) {
+    pool.Schedule(&graph_template);
+    pool.WaitForIdle();
+    EXPECT_TRUE(graph_template.IsDone());
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 0, 1, 2, 0, 1, 2}),
+            receiver.received_numbers());
+}
+
+TEST(TaskGraphTemplateTest, RunsAgainAfterCancel) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  TaskGraphTemplate graph_template(MakeChain(&receiver));
+
+  // Keep the only worker busy so that the first run can be cancelled.
+  absl::Notification started;
+  absl::Notification release;
+  auto blocker = absl::make_unique<Task>();
+  blocker->SetWorkItem([&started, &release]() {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  pool.Schedule(std::move(blocker));
+  started.WaitForNotification();
+  pool.Schedule(&graph_template);
+  EXPECT_TRUE(pool.Cancel(graph_template.task(1)));
+  release.Notify();
+  pool.WaitForIdle();
+  EXPECT_TRUE(graph_template.IsDone());
+  EXPECT_EQ(std::vector<int>({0}), receiver.received_numbers());
+
+  // The cancelled tasks are still part of the template.
+  pool.Schedule(&graph_template);
+  pool.WaitForIdle();
+  EXPECT_EQ(std::vector<int>({0, 0, 1, 2}), receiver.received_numbers());
+}
+
+TEST(TaskGraphTemplateTest, ForgetsOutsideDependentsAfterTheirRun) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  TaskGraphTemplate graph_template(MakeChain(&receiver));
+  auto outside = absl::make_unique<Task>();
+  outside->SetWorkItem([&receiver]() { receiver.Receive(3); });
+  outside->AddDependency(graph_template.task(2));
+  std::weak_ptr<Task> outside_handle = pool.Schedule(std::move(outside));
+  pool.Schedule(&graph_template);
+  pool.WaitForIdle();
+  // The outside task is destroyed, the next runs must not notify it.
+  EXPECT_TRUE(outside_handle.expired());
+  for (int run = 0; run != 2; ++run) {
+    pool.Schedule(&graph_template);
+    pool.WaitForIdle();
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 0, 1, 2, 0, 1, 2}),
+            receiver.received_numbers());
+}
+
+}  // namespace
@@ -0,0 +1,134 @@
+#include "task_graph.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "test_util.h"
+#include "thread_pool.h"
+
+namespace {
+
+TEST(TaskGraphTest, RunsInDependencyOrder) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  TaskGraph graph;
+  const auto add = [&graph, &receiver](int number) {
+    return graph.AddTask([&receiver, number]() { receiver.Receive(number); });
+  };
+  // Diamond 0 -> {1, 2} -> 3.
+  const TaskGraph::NodeId node_0 = add(0);
+  const TaskGraph::NodeId node_1 = add(1);
+  const TaskGraph::NodeId node_2 = add(2);
+  const TaskGraph::NodeId node_3 = add(3);
+  graph.AddDependency(node_1, node_0);
+  graph.AddDependency(node_2, node_0);
+  graph.AddDependency(node_3, node_1);
+  graph.AddDependency(node_3, node_2);
+  const std::vector<std::weak_ptr<Task>> handles = pool.Schedule(std::move(graph));
+  ASSERT_EQ(4u, handles.size());
+  pool.WaitForIdle();
+  const std::vector<int> numbers = receiver.received_numbers();
+  ASSERT_EQ(4u, numbers.size());
+  EXPECT_EQ(0, numbers.front());
+  EXPECT_EQ(3, numbers.back());
+}
+
+TEST(TaskGraphTest, AdoptedTaskWaitsForOutsideDependency) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  absl::Notification release;
+  auto outside = absl::make_unique<Task>();
+  outside->SetWorkItem([&receiver, &release]() {
+    release.WaitForNotification();
+    receiver.Receive(0);
+  });
+  std::weak_ptr<Task> outside_handle = pool.Schedule(std::move(outside));
+
+  TaskGraph graph;
+  auto adopted = absl::make_unique<Task>();
+  adopted->SetWorkItem([&receiver]() { receiver.Receive(1); });
+  adopted->AddDependency(outside_handle);
+  const TaskGraph::NodeId adopted_node = graph.AddTask(std::move(adopted));
+  const TaskGraph::NodeId private_node =
+      graph.AddTask([&receiver]() { receiver.Receive(2); });
+  graph.AddDependency(private_node, adopted_node);
+  graph.AddTask([&receiver]() { receiver.Receive(3); });
+  pool.Schedule(std::move(graph));
+
+  // Only the task without any dependency can run before the release.
+  std::vector<int> numbers;
+  while ((numbers = receiver.received_numbers()).empty()) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_EQ(std::vector<int>({3}), numbers);
+  release.Notify();
+  pool.WaitForIdle();
+  EXPECT_EQ(std::vector<int>({3, 0, 1, 2}), receiver.received_numbers());
+}
+
+TEST(TaskGraphTest, TypedTasksPassResultsToDependents) {
+  ThreadPool pool(2);
+  TaskGraph graph;
+  auto number = graph.AddTypedTask([]() { return 21; });
+  auto text = graph.AddTypedTask([]() { return std::string("answer"); });
+  auto owned = graph.AddTypedTask([]() { return std::unique_ptr<int>(new int(2)); });
+  auto combined = graph.AddTypedTask(
+      [](const int& number, const std::string& text, std::unique_ptr<int>& owned) {
+        // The only consumer of 'owned' may move it out.
+        std::unique_ptr<int> factor = std::move(owned);
+        return text + " " + std::to_string(number * *factor);
+      },
+      number, text, owned);
+  std::shared_ptr<TypedTask<std::string>> result = graph.GetTask(combined);
+  pool.Schedule(std::move(graph));
+  pool.WaitForIdle();
+  ASSERT_TRUE(result->has_result());
+  EXPECT_EQ("answer 42", result->result());
+}
+
+// Counts how often it was copied, moves are free.
+struct CopyCounter {
+  explicit CopyCounter(int* copies) : copies(copies) {}
+  CopyCounter(const CopyCounter& other) : copies(other.copies) { ++*copies; }
+  CopyCounter(CopyCounter&&) = default;
+
+  int* copies;
+};
+
+TEST(TaskGraphTest, TypedTasksMoveResultsToTheirOnlyConsumer) {
+  ThreadPool pool(2);
+  TaskGraph graph;
+  int copies = 0;
+  auto chain = graph.AddTypedTask([&copies]() { return CopyCounter(&copies); });
+  for (int i = 0; i != 5; ++i) {
+    chain = graph.AddTypedTask([](CopyCounter counter) { return counter; }, chain);
+  }
+  graph.AddTypedTask([](CopyCounter) {}, chain);
+  // With two consumers, each one gets its own copy.
+  auto forked = graph.AddTypedTask([&copies]() { return CopyCounter(&copies); });
+  graph.AddTypedTask([](CopyCounter) {}, forked);
+  graph.AddTypedTask([](CopyCounter) {}, forked);
+  pool.Schedule(std::move(graph));
+  pool.WaitForIdle();
+  EXPECT_EQ(2, copies);
+}
+
+TEST(TaskGraphTest, TypedTasksReleaseTheirInputs) {
+  ThreadPool pool(2);
+  TaskGraph graph;
+  auto first = graph.AddTypedTask([]() { return 20; });
+  std::weak_ptr<Task> first_task = graph.GetTask(first);
+  auto second = graph.AddTypedTask([](const int number) { return number + 1; }, first);
+  std::shared_ptr<TypedTask<int>> second_task = graph.GetTask(second);
+  pool.Schedule(std::move(graph));
+  pool.WaitForIdle();
+  // Only the result of the last task is kept.
+  EXPECT_TRUE(first_task.expired());
+  EXPECT_EQ(21, second_task->result());
+}
+
+}  // namespace
@@ -0,0 +1,51 @@
+#include "task_metrics.h"
+
+#include <memory>
+
+#include "absl/memory/memory.h"
+#include "gtest/gtest.h"
+#include "task.h"
+#include "thread_pool.h"
+
+namespace {
+
+TEST(DurationHistogramTest, Buckets) {
+  DurationHistogram histogram;
+  histogram.Add(0.5e-6);  // Bucket 0.
+  histogram.Add(3e-6);    // [2, 4) us.
+  histogram.Add(3e-6);
+  histogram.Add(1e-3);    // [512, 1024) us.
+  const DurationHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(4u, snapshot.count);
+  EXPECT_EQ(1u, snapshot.buckets[0]);
+  EXPECT_EQ(2u, snapshot.buckets[2]);
+  EXPECT_EQ(1u, snapshot.buckets[10]);
+  EXPECT_NEAR(1e-3, snapshot.max_sec, 1e-9);
+  EXPECT_NEAR((0.5e-6 + 3e-6 + 3e-6 + 1e-3) / 4., snapshot.Mean(), 1e-9);
+  EXPECT_DOUBLE_EQ(4e-6, snapshot.Percentile(0.5));
+
+  histogram.Reset();
+  EXPECT_EQ(0u, histogram.GetSnapshot().count);
+}
+
+TEST(TaskMetricsTest, RecordsEveryStageOfExecutedTasks) {
+  constexpr int kType = 3;
+  constexpr int kNumTasks = 5;
+  ThreadPool pool(1);
+  for (int i = 0; i != kNumTasks; ++i) {
+    auto task = absl::make_unique<Task>();
+    task->AddTaskInfo("metrics", kType);
+    task->SetWorkItem([]() {});
+    pool.Schedule(std::move(task));
+  }
+  pool.WaitForIdle();
+  const TaskMetrics::Snapshot snapshot = pool.metrics().GetSnapshot();
+  for (int stage = 0; stage != TaskMetrics::kNumStages; ++stage) {
+    EXPECT_EQ(static_cast<uint64_t>(kNumTasks), snapshot[kType][stage].count)
+        << TaskMetrics::StageName(static_cast<TaskMetrics::Stage>(stage));
+    EXPECT_EQ(0u, snapshot[0][stage].count);
+  }
+  EXPECT_NE(std::string::npos, pool.metrics().ToString().find("running"));
+}
+
+}  // namespace
@@ -0,0 +1,58 @@
+#include "task_tracer.h"
+
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "task_graph.h"
+#include "thread_pool.h"
+
+namespace {
+
+int CountOccurrences(const std::string& text, const std::string& pattern) {
+  int count = 0;
+  for (size_t pos = text.find(pattern); pos != std::string::npos;
+       pos = text.find(pattern, pos + pattern.size())) {
+    ++count;
+  }
+  return count;
+}
+
+TEST(TaskTracerTest, ExportsTasksAndDependencies) {
+  TaskTracer tracer;
+  ThreadPool pool(1);
+  pool.SetTracer(&tracer);
+  // Linked before anything runs, so that the dependency is recorded.
+  TaskGraph graph;
+  const TaskGraph::NodeId first = graph.AddTask([]() {}, "first", 1);
+  const TaskGraph::NodeId second = graph.AddTask([]() {}, "second", 1);
+  graph.AddDependency(second, first);
+  pool.Schedule(std::move(graph));
+  pool.WaitForIdle();
+  pool.SetTracer(nullptr);
+
+  const std::string json = tracer.ToChromeTraceJson();
+  EXPECT_NE(std::string::npos, json.find("\"traceEvents\":["));
+  EXPECT_EQ(2, CountOccurrences(json, "\"ph\":\"X\""));
+  EXPECT_NE(std::string::npos, json.find("\"first\""));
+  EXPECT_NE(std::string::npos, json.find("\"second\""));
+  // One arrow from the first task to the second one.
+  EXPECT_EQ(1, CountOccurrences(json, "\"ph\":\"s\""));
+  EXPECT_EQ(1, CountOccurrences(json, "\"ph\":\"f\""));
+  EXPECT_EQ(0u, tracer.NumDroppedEvents());
+
+  tracer.Clear();
+  EXPECT_EQ(0, CountOccurrences(tracer.ToChromeTraceJson(), "\"ph\":\"X\""));
+}
+
+TEST(TaskTracerTest, CountsDroppedEvents) {
+  TaskTracer tracer(/*events_per_thread=*/2);
+  const TaskTracer::TimePoint now = std::chrono::steady_clock::now();
+  int tasks[3];
+  for (int& task : tasks) {
+    tracer.RecordExecution(&task, 0, "task", now, now, now, now);
+  }
+  EXPECT_EQ(1u, tracer.NumDroppedEvents());
+}
+
+}  // namespace
@@ -0,0 +1,60 @@
+#ifndef CARTOGRAPHER_COMMON_TEST_UTIL_H_
+#define CARTOGRAPHER_COMMON_TEST_UTIL_H_
+
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "gtest/gtest.h"
+#include "task_graph.h"
+
+
+// Collects the numbers sent by work items, in the order they ran.
+class Receiver {
+ public:
+  void Receive(int number) LOCKS_EXCLUDED(mutex_) {
+    absl::MutexLock locker(&mutex_);
+    received_numbers_.push_back(number);
+  }
+
+  std::vector<int> received_numbers() LOCKS_EXCLUDED(mutex_) {
+    absl::MutexLock locker(&mutex_);
+    return received_numbers_;
+  }
+
+  void WaitForNumberSequence(const std::vector<int>& expected_numbers)
+      LOCKS_EXCLUDED(mutex_) {
+    const auto predicate =
+        [this, &expected_numbers]() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+          return (received_numbers_.size() >= expected_numbers.size());
+        };
+    absl::MutexLock locker(&mutex_);
+    mutex_.Await(absl::Condition(&predicate));
+    EXPECT_EQ(expected_numbers, received_numbers_);
+  }
+
+  absl::Mutex mutex_;
+  std::vector<int> received_numbers_ GUARDED_BY(mutex_);
+};
+
+// 0 -> 1 -> 2, node i sends i to 'receiver'. The last one also notifies
+// 'done' if given.
+inline TaskGraph MakeChain(Receiver* receiver,
+                           absl::Notification* done = nullptr) {
+  TaskGraph graph;
+  TaskGraph::NodeId previous = 0;
+  for (int number = 0; number != 3; ++number) {
+    const TaskGraph::NodeId node =
+        graph.AddTask([receiver, number, done]() {
+          receiver->Receive(number);
+          if (number == 2 && done != nullptr) done->Notify();
+        });
+    if (number > 0) {
+      graph.AddDependency(node, previous);
+    }
+    previous = node;
+  }
+  return graph;
+}
+
+#endif
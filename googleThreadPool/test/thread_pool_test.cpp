@@ -0,0 +1,344 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "ctpl_governor.h"
+#include "gtest/gtest.h"
+#include "task.h"
+#include "task_graph.h"
+#include "test_util.h"
+
+namespace {
+
+// Keeps the only worker of a pool busy until Release().
+class Blocker {
+ public:
+  explicit Blocker(ThreadPoolInterface* pool) {
+    auto task = absl::make_unique<Task>();
+    task->SetWorkItem([this]() {
+      started_.Notify();
+      release_.WaitForNotification();
+    });
+    pool->Schedule(std::move(task));
+    started_.WaitForNotification();
+  }
+
+  void Release() { release_.Notify(); }
+
+ private:
+  absl::Notification started_;
+  absl::Notification release_;
+};
+
+std::unique_ptr<Task> MakeTask(Receiver* receiver, int number, int type = 0) {
+  auto task = absl::make_unique<Task>();
+  task->AddTaskInfo("number " + std::to_string(number), type);
+  task->SetWorkItem([receiver, number]() { receiver->Receive(number); });
+  return task;
+}
+
+TEST(ThreadPoolTest, RunTask) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  pool.Schedule(MakeTask(&receiver, 1));
+  receiver.WaitForNumberSequence({1});
+}
+
+TEST(ThreadPoolTest, RunWithDependencies) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  auto task_1 = MakeTask(&receiver, 1);
+  auto task_2 = MakeTask(&receiver, 2);
+  auto task_3 = MakeTask(&receiver, 3);
+  // Schedule tasks out of order.
+  auto task_3_handle = pool.Schedule(std::move(task_3));
+  auto task_2_handle = pool.Schedule(std::move(task_2));
+  auto task_1_handle = pool.Schedule(std::move(task_1));
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({3, 2, 1});
+
+  auto task_4 = MakeTask(&receiver, 4);
+  auto task_5 = MakeTask(&receiver, 5);
+  task_5->AddDependency(task_3_handle);
+  task_4->AddDependency(pool.Schedule(std::move(task_5)));
+  pool.Schedule(std::move(task_4));
+  receiver.WaitForNumberSequence({3, 2, 1, 5, 4});
+}
+
+#ifdef __linux__
+TEST(ThreadPoolTest, ThreadClassSetsNameAndNiceLevel) {
+  const int caller_nice = nice(0);
+  for (const ThreadPoolOptions& options :
+       {ThreadPoolOptions::Foreground("fg", 1),
+        ThreadPoolOptions::Background("bg", 1)}) {
+    ThreadPool pool(options);
+    std::string thread_name;
+    int worker_nice = 0;
+    // Not Wait(), which could run the task on this thread.
+    absl::Notification done;
+    auto task = absl::make_unique<Task>();
+    task->SetWorkItem([&thread_name, &worker_nice, &done]() {
+      char name[16] = {};
+      pthread_getname_np(pthread_self(), name, sizeof(name));
+      thread_name = name;
+      worker_nice = nice(0);
+      done.Notify();
+    });
+    pool.Schedule(std::move(task));
+    done.WaitForNotification();
+    EXPECT_EQ(options.name + "/0", thread_name);
+    EXPECT_EQ(std::min(caller_nice + options.nice_increment, 19), worker_nice);
+  }
+}
+#endif
+
+TEST(ThreadPoolTest, SetNumThreads) {
+  ThreadPool pool(2);
+  Receiver receiver;
+  pool.SetNumThreads(1);
+  EXPECT_EQ(1, pool.NumThreads());
+  pool.Schedule(MakeTask(&receiver, 1));
+  pool.WaitForIdle();
+  // Restarts the retired worker.
+  pool.SetNumThreads(3);
+  EXPECT_EQ(3, pool.NumThreads());
+  pool.Schedule(MakeTask(&receiver, 2));
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({1, 2});
+}
+
+TEST(ThreadPoolTest, ControllerAddsWorkerWhenReadyTasksWait) {
+  ThreadPoolOptions options = ThreadPoolOptions::Background("grow", 1);
+  options.max_threads = 2;
+  options.grow_queue_wait_sec = 1e-3;
+  ThreadPool pool(options);
+  Blocker blocker(&pool);
+  absl::Notification done;
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([&done]() { done.Notify(); });
+  pool.Schedule(std::move(task));
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_EQ(2, pool.NumThreads());
+  blocker.Release();
+  pool.WaitForIdle();
+}
+
+TEST(ThreadPoolTest, SingleReadyDependentRunsOnSameThread) {
+  constexpr int kChainLength = 4;
+  ThreadPool pool(2);
+  absl::Mutex mutex;
+  std::vector<std::thread::id> thread_ids;
+  // Nothing of the chain runs before it is complete.
+  absl::Notification release;
+  auto gate = absl::make_unique<Task>();
+  gate->SetWorkItem([&release]() { release.WaitForNotification(); });
+  std::weak_ptr<Task> previous = pool.Schedule(std::move(gate));
+  for (int i = 0; i != kChainLength; ++i) {
+    auto task = absl::make_unique<Task>();
+    task->SetWorkItem([&mutex, &thread_ids]() {
+      absl::MutexLock locker(&mutex);
+      thread_ids.push_back(std::this_thread::get_id());
+    });
+    task->AddDependency(previous);
+    previous = pool.Schedule(std::move(task));
+  }
+  release.Notify();
+  pool.WaitForIdle();
+  absl::MutexLock locker(&mutex);
+  ASSERT_EQ(static_cast<size_t>(kChainLength), thread_ids.size());
+  for (const std::thread::id& thread_id : thread_ids) {
+    EXPECT_EQ(thread_ids.front(), thread_id);
+  }
+}
+
+TEST(ThreadPoolTest, LongerCriticalPathRunsFirst) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  pool.Schedule(MakeTask(&receiver, 1));
+  auto task_2_handle = pool.Schedule(MakeTask(&receiver, 2));
+  // Task 2 is queued already, its dependent must raise it above task 1. The
+  // dependent then continues on the same worker.
+  auto task_3 = MakeTask(&receiver, 3);
+  task_3->AddDependency(task_2_handle);
+  pool.Schedule(std::move(task_3));
+  blocker.Release();
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({2, 3, 1});
+}
+
+TEST(ThreadPoolTest, CriticalPathCostOfChainBuiltTopDown) {
+  constexpr int kType = 7;
+  constexpr int kNumTasks = 10000;
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  std::weak_ptr<Task> root = pool.Schedule(MakeTask(&receiver, 0, kType));
+  std::weak_ptr<Task> previous = root;
+  for (int number = 1; number < kNumTasks; ++number) {
+    auto task = MakeTask(&receiver, number, kType);
+    task->AddDependency(previous);
+    previous = pool.Schedule(std::move(task));
+  }
+  Task::PropagateCriticalPathCosts();
+  EXPECT_NEAR(kNumTasks * Task::EstimatedRunTime(kType),
+              root.lock()->CriticalPathCost(), 1e-9);
+  blocker.Release();
+  pool.WaitForIdle();
+}
+
+TEST(ThreadPoolTest, WaitFromTaskRunsOtherTasks) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  auto outer = absl::make_unique<Task>();
+  outer->SetWorkItem([&pool, &receiver]() {
+    // The only worker is busy here, it has to run task 1 itself.
+    pool.Wait(pool.Schedule(MakeTask(&receiver, 1)));
+    receiver.Receive(2);
+  });
+  pool.Schedule(std::move(outer));
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({1, 2});
+}
+
+TEST(ThreadPoolTest, WaitFromOutsideHelps) {
+  ThreadPool pool(1);
+  Blocker blocker(&pool);
+  std::thread::id thread_id;
+  int worker_id = 0;
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([&thread_id, &worker_id]() {
+    thread_id = std::this_thread::get_id();
+    worker_id = ThreadPool::CurrentWorkerId();
+  });
+  pool.Wait(pool.Schedule(std::move(task)));
+  EXPECT_EQ(std::this_thread::get_id(), thread_id);
+  EXPECT_EQ(-1, worker_id);
+  blocker.Release();
+  pool.WaitForIdle();
+}
+
+TEST(ThreadPoolTest, OutsideThreadsHelpWithAGovernorToken) {
+  ctpl::cpu_governor governor(1);
+  ThreadPoolOptions options = ThreadPoolOptions::Foreground("governed", 1);
+  options.governor = &governor;
+  ThreadPool pool(options);
+  // The only worker holds the only token while it is blocked.
+  Blocker blocker(&pool);
+  EXPECT_EQ(1, governor.n_active());
+
+  absl::Notification ran;
+  auto task = absl::make_unique<Task>();
+  task->SetWorkItem([&ran, &governor]() {
+    EXPECT_EQ(&governor, ctpl::cpu_governor::current());
+    ran.Notify();
+  });
+  std::weak_ptr<Task> handle = pool.Schedule(std::move(task));
+  std::thread helper([&pool, handle]() {
+    pool.Wait(handle);
+    // The token is given back.
+    EXPECT_EQ(nullptr, ctpl::cpu_governor::current());
+  });
+  // The helper waits for the token instead of running the task.
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (governor.n_waiting() == 0 && !ran.HasBeenNotified() &&
+         absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_EQ(1, governor.n_waiting());
+  EXPECT_FALSE(ran.HasBeenNotified());
+  blocker.Release();
+  helper.join();
+  EXPECT_TRUE(ran.HasBeenNotified());
+  pool.WaitForIdle();
+  EXPECT_EQ(nullptr, ctpl::cpu_governor::current());
+}
+
+TEST(ThreadPoolTest, CancelSkipsDownstreamTasks) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  std::weak_ptr<Task> task_1 = pool.Schedule(MakeTask(&receiver, 1));
+  auto task_2 = MakeTask(&receiver, 2);
+  task_2->AddDependency(task_1);
+  std::weak_ptr<Task> task_2_handle = pool.Schedule(std::move(task_2));
+  auto task_3 = MakeTask(&receiver, 3);
+  task_3->AddDependency(task_2_handle);
+  pool.Schedule(std::move(task_3));
+  pool.Schedule(MakeTask(&receiver, 4));
+  EXPECT_TRUE(pool.Cancel(task_1));
+  EXPECT_FALSE(pool.Cancel(task_1));
+  blocker.Release();
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({4});
+}
+
+TEST(ThreadPoolTest, LateDependentOfCancelledReadyTaskIsCancelled) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  // Ready, but not run before the worker is released.
+  std::weak_ptr<Task> task_1 = pool.Schedule(MakeTask(&receiver, 1));
+  EXPECT_TRUE(pool.Cancel(task_1));
+  auto task_2 = MakeTask(&receiver, 2);
+  task_2->AddDependency(task_1);
+  std::weak_ptr<Task> task_2_handle = pool.Schedule(std::move(task_2));
+  pool.Schedule(MakeTask(&receiver, 3));
+  blocker.Release();
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({3});
+  EXPECT_TRUE(task_2_handle.expired());
+}
+
+TEST(ThreadPoolTest, LateDependentOfCancelledDispatchedTaskIsCancelled) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  std::weak_ptr<Task> task_1 = pool.Schedule(MakeTask(&receiver, 1));
+  auto task_2 = MakeTask(&receiver, 2);
+  task_2->AddDependency(task_1);
+  // Waits for task 1, is completed right away by the cancel. Kept alive, an
+  // expired dependency would count as completed.
+  std::shared_ptr<Task> task_2_handle = pool.Schedule(std::move(task_2)).lock();
+  EXPECT_TRUE(pool.Cancel(task_2_handle));
+  EXPECT_EQ(Task::COMPLETED, task_2_handle->GetState());
+  auto task_3 = MakeTask(&receiver, 3);
+  task_3->AddDependency(task_1);
+  task_3->AddDependency(task_2_handle);
+  pool.Schedule(std::move(task_3));
+  blocker.Release();
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({1});
+}
+
+TEST(ThreadPoolTest, GraphBelowCancelledTaskIsCancelled) {
+  ThreadPool pool(1);
+  Receiver receiver;
+  Blocker blocker(&pool);
+  std::weak_ptr<Task> task_1 = pool.Schedule(MakeTask(&receiver, 1));
+  EXPECT_TRUE(pool.Cancel(task_1));
+  TaskGraph graph;
+  auto task_2 = MakeTask(&receiver, 2);
+  task_2->AddDependency(task_1);
+  const TaskGraph::NodeId node_2 = graph.AddTask(std::move(task_2));
+  const TaskGraph::NodeId node_3 =
+      graph.AddTask([&receiver]() { receiver.Receive(3); });
+  graph.AddDependency(node_3, node_2);
+  graph.AddTask([&receiver]() { receiver.Receive(4); });
+  pool.Schedule(std::move(graph));
+  blocker.Release();
+  pool.WaitForIdle();
+  receiver.WaitForNumberSequence({4});
+}
+
+}  // namespace
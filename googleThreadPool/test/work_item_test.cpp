@@ -0,0 +1,60 @@
+#include "work_item.h"
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(WorkItemTest, Empty) {
+  EXPECT_FALSE(WorkItem());
+  EXPECT_FALSE(WorkItem(nullptr));
+  EXPECT_FALSE(WorkItem(std::function<void()>()));
+  void (*function)() = nullptr;
+  EXPECT_FALSE(WorkItem(function));
+}
+
+TEST(WorkItemTest, SmallCallableIsStoredInline) {
+  int calls = 0;
+  WorkItem work_item([&calls]() { ++calls; });
+  EXPECT_TRUE(work_item.is_inline());
+  WorkItem moved(std::move(work_item));
+  EXPECT_FALSE(work_item);
+  moved();
+  moved();
+  EXPECT_EQ(2, calls);
+}
+
+TEST(WorkItemTest, LargeCallableIsStoredOnHeap) {
+  std::array<char, WorkItem::kInlineSize + 1> payload{};
+  payload[0] = 1;
+  int result = 0;
+  WorkItem work_item([payload, &result]() { result = payload[0]; });
+  EXPECT_FALSE(work_item.is_inline());
+  WorkItem moved;
+  moved = std::move(work_item);
+  moved();
+  EXPECT_EQ(1, result);
+}
+
+TEST(WorkItemTest, TakesMoveOnlyCallablesAndDestroysThem) {
+  auto value = std::make_shared<int>(7);
+  std::weak_ptr<int> weak_value = value;
+  int result = 0;
+  {
+    std::unique_ptr<std::shared_ptr<int>> owned(
+        new std::shared_ptr<int>(std::move(value)));
+    WorkItem work_item(
+        [owned = std::move(owned), &result]() { result = **owned; });
+    work_item();
+    EXPECT_FALSE(weak_value.expired());
+    work_item = nullptr;
+    EXPECT_TRUE(weak_value.expired());
+  }
+  EXPECT_EQ(7, result);
+}
+
+}  // namespace
@@ -0,0 +1,151 @@
+// Decodes a dump of the FlightRecorder (see include/flight_recorder.h).
+//
+//   flight_recorder_decode <dump file> [--last=N]
+//
+// Prints a summary per thread, including the task it was running when the
+// dump was taken, followed by the last N events of all threads (default:
+// all) merged by time. Times are in ms relative to the dump.
+// 解析 FlightRecorder 导出的文件
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "flight_recorder.h"
+
+namespace {
+
+struct ThreadEvents {
+    FlightRecorder::ThreadHeader header;
+    std::vector<FlightRecorder::Event> events;  // Oldest first.
+};
+
+struct TimelineEntry {
+    FlightRecorder::Event event;
+    const ThreadEvents* thread;
+};
+
+std::string ThreadName(const ThreadEvents& thread) {
+  char name[sizeof(thread.header.name) + 1] = {};
+  std::memcpy(name, thread.header.name, sizeof(thread.header.name));
+  return name[0] != '\0' ? name : "thread " + std::to_string(thread.header.thread_index);
+}
+
+double MsBeforeDump(const FlightRecorder::FileHeader& file_header,
+                    const FlightRecorder::Event& event) {
+  return (static_cast<double>(event.time_ns) -
+          static_cast<double>(file_header.dump_time_ns)) * 1e-6;
+}
+
+bool Read(std::ifstream* file, void* data, const size_t size) {
+  file->read(static_cast<char*>(data), size);
+  return static_cast<bool>(*file);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <dump file> [--last=N]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t last = 0;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--last=", 7) == 0) {
+      last = std::strtoul(argv[i] + 7, nullptr, 10);
+    }
+  }
+
+  std::ifstream file(argv[1], std::ios::binary);
+  FlightRecorder::FileHeader file_header;
+  if (!Read(&file, &file_header, sizeof(file_header)) ||
+      file_header.magic != FlightRecorder::kMagic) {
+    std::fprintf(stderr, "%s is not a flight recorder dump.\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  if (file_header.version != FlightRecorder::kVersion ||
+      file_header.event_size != sizeof(FlightRecorder::Event)) {
+    std::fprintf(stderr, "Unsupported dump version %u.\n", file_header.version);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<ThreadEvents> threads(file_header.num_threads);
+  for (ThreadEvents& thread : threads) {
+    std::vector<FlightRecorder::Event> ring;
+    if (!Read(&file, &thread.header, sizeof(thread.header))) {
+      std::fprintf(stderr, "Truncated dump.\n");
+      return EXIT_FAILURE;
+    }
+    ring.resize(thread.header.capacity);
+    if (!Read(&file, ring.data(), ring.size() * sizeof(FlightRecorder::Event))) {
+      std::fprintf(stderr, "Truncated dump.\n");
+      return EXIT_FAILURE;
+    }
+    const uint64_t head = thread.header.head;
+    const uint64_t capacity = thread.header.capacity;
+    for (uint64_t i = head > capacity ? head - capacity : 0; i != head; ++i) {
+      const FlightRecorder::Event& event = ring[i % capacity];
+      if (event.time_ns != 0) thread.events.push_back(event);
+    }
+  }
+  std::sort(threads.begin(), threads.end(),
+            [](const ThreadEvents& a, const ThreadEvents& b) {
+              return a.header.thread_index < b.header.thread_index;
+            });
+
+  std::printf("%-16s %8s %10s %12s  %s\n", "thread", "events", "recorded",
+              "last_ms", "state");
+  std::vector<TimelineEntry> timeline;
+  for (const ThreadEvents& thread : threads) {
+    std::string state = "idle";
+    double last_ms = 0.;
+    if (!thread.events.empty()) {
+      const FlightRecorder::Event& last_event = thread.events.back();
+      last_ms = MsBeforeDump(file_header, last_event);
+      char buffer[128];
+      if (last_event.kind() == FlightRecorder::START) {
+        std::snprintf(buffer, sizeof(buffer),
+                      "running task 0x%llx (type %llu) for %.3f ms",
+                      static_cast<unsigned long long>(last_event.object),
+                      static_cast<unsigned long long>(last_event.arg()), -last_ms);
+        state = buffer;
+      } else if (last_event.kind() == FlightRecorder::PARK) {
+        std::snprintf(buffer, sizeof(buffer), "parked for %.3f ms", -last_ms);
+        state = buffer;
+      } else {
+        state = std::string("after ") +
+                FlightRecorder::KindName(last_event.kind());
+      }
+    }
+    std::printf("%-16s %8zu %10llu %12.3f  %s\n", ThreadName(thread).c_str(),
+                thread.events.size(),
+                static_cast<unsigned long long>(thread.header.head), last_ms,
+                state.c_str());
+    for (const FlightRecorder::Event& event : thread.events) {
+      timeline.push_back(TimelineEntry{event, &thread});
+    }
+  }
+
+  std::sort(timeline.begin(), timeline.end(),
+            [](const TimelineEntry& a, const TimelineEntry& b) {
+              return a.event.time_ns < b.event.time_ns;
+            });
+  const size_t begin =
+      last != 0 && timeline.size() > last ? timeline.size() - last : 0;
+  std::printf("\n%14s %-16s %-9s %-18s %s\n", "ms", "thread", "event", "object",
+              "arg");
+  for (size_t i = begin; i != timeline.size(); ++i) {
+    const FlightRecorder::Event& event = timeline[i].event;
+    std::printf("%14.6f %-16s %-9s 0x%-16llx %llu\n",
+                MsBeforeDump(file_header, event),
+                ThreadName(*timeline[i].thread).c_str(),
+                FlightRecorder::KindName(event.kind()),
+                static_cast<unsigned long long>(event.object),
+                static_cast<unsigned long long>(event.arg()));
+  }
+  return EXIT_SUCCESS;
+}